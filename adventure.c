@@ -68,6 +68,15 @@ static int sanity_check (void);
 #define STATUS_MSG_LEN 40    /* maximum length of status message     */
 #define MOTION_SPEED   2     /* pixels moved per command             */
 
+/*
+ * relative times to draw one row and one column of the screen (see
+ * redraw_dirty); a column has fewer pixels, but they are scattered 
+ * through the build buffer, and rows are cheaper still when the room
+ * photo is split into planes
+ */
+#define ROW_DRAW_COST  10
+#define COL_DRAW_COST  11
+
 
 /* outcome of the game */
 typedef enum {GAME_WON, GAME_QUIT} game_condition_t;
@@ -144,6 +153,7 @@ static void move_photo_down (void);
 static void move_photo_left (void);
 static void move_photo_right (void);
 static void move_photo_up (void);
+static void redraw_dirty (void);
 static void redraw_room (void);
 static void* status_thread (void* ignore);
 static int time_is_after (struct timeval* t1, struct timeval* t2);
@@ -263,8 +273,14 @@ game_loop ()
 	    /* Draw the room (calls show. */
 	    redraw_room ();
 
+	    /* Start loading the rooms the player may visit next. */
+	    prefetch_neighbors (game_info.where);
+
 	    /* Only draw once on entry. */
 	    enter_room = 0;
+	} else if (refine_room ()) {
+	    /* The room was shown with a preview; draw the full photo. */
+	    redraw_room ();
 	}
 
 	show_screen ();
@@ -480,7 +496,7 @@ handle_typing ()
 	if (TC_ALLOW_EDIT != result) {
 	    reset_typed_command ();
 	    if (TC_REDRAW_ROOM == result) {
-	        redraw_room ();
+	        redraw_dirty ();
 	    }
 	}
 	return 0;
@@ -638,9 +654,69 @@ move_photo_up ()
 }
 
 
+/* 
+ * redraw_dirty
+ *   DESCRIPTION: Draw the lines on the screen that objects entering or
+ *                leaving the room have changed since it was last drawn.
+ *                Each area changed (see room_take_dirty) is drawn as 
+ *                the rows or the columns of the screen that it crosses,
+ *                whichever is cheaper (see ROW_DRAW_COST), and no line 
+ *                is drawn twice.
+ *   INPUTS: none
+ *   OUTPUTS: none
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: Draws part of the screen (but not the status bar).
+ */
+static void
+redraw_dirty ()
+{
+    room_rect_t rect[ROOM_DIRTY_RECTS]; /* areas changed             */
+    uint8_t     row[SCROLL_Y_DIM];      /* 1 if row must be drawn    */
+    uint8_t     col[SCROLL_X_DIM];      /* 1 if column must be drawn */
+    int32_t     n;                      /* number of areas changed   */
+    int32_t     left, right;            /* columns of area on screen */
+    int32_t     top, bottom;            /* rows of area on screen    */
+    int32_t     i;                      /* index over areas, lines   */
+
+    (void)memset (row, 0, sizeof (row));
+    (void)memset (col, 0, sizeof (col));
+    n = room_take_dirty (game_info.where, rect);
+    for (i = 0; n > i; i++) {
+	left = rect[i].left - (int32_t)game_info.map_x;
+	right = rect[i].right - (int32_t)game_info.map_x;
+	top = rect[i].top - (int32_t)game_info.map_y;
+	bottom = rect[i].bottom - (int32_t)game_info.map_y;
+	left = (0 > left ? 0 : left);
+	right = (SCROLL_X_DIM < right ? SCROLL_X_DIM : right);
+	top = (0 > top ? 0 : top);
+	bottom = (SCROLL_Y_DIM < bottom ? SCROLL_Y_DIM : bottom);
+	if (left >= right || top >= bottom) {
+	    continue;
+	}
+	if ((bottom - top) * ROW_DRAW_COST <= (right - left) * COL_DRAW_COST) {
+	    (void)memset (&row[top], 1, bottom - top);
+	} else {
+	    (void)memset (&col[left], 1, right - left);
+	}
+    }
+    for (i = 0; SCROLL_Y_DIM > i; i++) {
+	if (row[i]) {
+	    (void)draw_horiz_line (i);
+	}
+    }
+    for (i = 0; SCROLL_X_DIM > i; i++) {
+	if (col[i]) {
+	    (void)draw_vert_line (i);
+	}
+    }
+}
+
+
 /* 
  * redraw_room
- *   DESCRIPTION: Draw all lines on the screen.
+ *   DESCRIPTION: Draw all lines on the screen.  Any areas of the room
+ *                recorded as changed are then up to date, and are 
+ *                forgotten.
  *   INPUTS: none
  *   OUTPUTS: none
  *   RETURN VALUE: none
@@ -649,7 +725,10 @@ move_photo_up ()
 static void
 redraw_room ()
 {
-    int32_t i; /* index over rows */
+    room_rect_t rect[ROOM_DIRTY_RECTS]; /* areas changed (ignored) */
+    int32_t     i;                      /* index over rows          */
+
+    (void)room_take_dirty (game_info.where, rect);
 
     /* Draw all lines in the scroll region. */
     for (i = 0; i < SCROLL_Y_DIM; i++) {
@@ -843,7 +922,9 @@ return NULL;
 int
 main ()
 {
-    game_condition_t game;  /* outcome of playing */
+    game_condition_t   game;  /* outcome of playing              */
+    photo_lru_stats_t  lru;   /* lazy photo loading counters     */
+    room_layer_stats_t layer; /* composited room counters        */
 
     /* Randomize for more fun (remove for deterministic layout). */
     srand (time (NULL));
@@ -876,6 +957,7 @@ main ()
 	if (0 != set_mode_X (fill_horiz_buffer, fill_vert_buffer)) {
 	    PANIC ("cannot initialize mode X");
 	}
+	set_horiz_planes_fn (fill_horiz_planes);
 	push_cleanup ((cleanup_fn_t)clear_mode_X, NULL); {
 
 	    /* Initialize the keyboard and/or Tux controller. */
@@ -897,6 +979,35 @@ main ()
 	case GAME_QUIT: printf ("Quitter!\n"); break;
     }
 
+    /* Report on lazy photo loading, if it was used. */
+    get_photo_lru_stats (&lru);
+    if (0 != lru.misses) {
+	fprintf (stderr, "photos: %u hits, %u misses, %u evictions, "
+		 "%lu bytes resident (peak %lu)\n", lru.hits, lru.misses,
+		 lru.evictions, (unsigned long)lru.resident_bytes,
+		 (unsigned long)lru.peak_bytes);
+	fprintf (stderr, "photos: %u prefetched, %u dropped, %u waits, "
+		 "%u previews (%u replaced); room entry %lu us average, "
+		 "%u us worst\n", lru.prefetches, lru.prefetch_drops, 
+		 lru.prefetch_waits, lru.previews, lru.refines,
+		 (unsigned long)(lru.entry_usec / 
+		 		 (0 == lru.entries ? 1 : lru.entries)),
+		 lru.entry_max_usec);
+    }
+
+    /* Report on composited rooms, if they were kept. */
+    get_room_layer_stats (&layer);
+    if (0 != layer.hits + layer.misses) {
+	fprintf (stderr, "room layers: %u hits, %u misses (%u too large), "
+		 "%u evictions, %u updates, %lu bytes resident (peak %lu)\n",
+		 layer.hits, layer.misses, layer.too_large, layer.evictions,
+		 layer.updates, (unsigned long)layer.resident_bytes,
+		 (unsigned long)layer.peak_bytes);
+    }
+
+    /* Release photo and object image memory. */
+    release_photos ();
+
     /* Return success. */
     return 0;
 }
@@ -0,0 +1,196 @@
+/*									tab:8
+ *
+ * arena.c - memory kept for the life of the program
+ *
+ * Version:	    1
+ * Creation Date:   Sun Oct 18 21:40:06 2026
+ * Filename:	    arena.c
+ * History:
+ *	1	Sun Oct 18 21:40:06 2026
+ *		First written.
+ */
+
+
+/*
+ * The arena is one range of address space, reserved with a single mmap
+ * when first used and released with a single munmap.  Pages are backed
+ * by memory only when first touched, so reserving far more than is used
+ * costs nothing but address space.  Blocks are carved from the start of
+ * the range in order.  Where the system supports it, the range is
+ * aligned to ARENA_HUGE_PAGE bytes and marked for transparent huge
+ * pages, so that pixel data touched when loading and scrolling take
+ * fewer page faults and TLB entries.
+ */
+
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "arena.h"
+
+
+/* parameters defined for this file */
+
+/*
+ * Environment variable giving the size of the arena in megabytes (by
+ * default, ARENA_DEFAULT_MB).  0 turns the arena off, so that every
+ * caller falls back to malloc.
+ */
+#define ARENA_ENV        "ADV_ARENA_MB"
+#define ARENA_DEFAULT_MB 256
+
+/* size and alignment of a huge page */
+#define ARENA_HUGE_PAGE  (2UL << 20)
+
+
+/* functions local to this file--see function headers for details */
+
+static void arena_init (void);
+
+
+/*
+ * The range reserved (map, map_len) and the part of it that may hold
+ * blocks (base, limit), with next the address of the next block.
+ * map is NULL if the arena is off, could not be reserved, or has been
+ * released.  All are set once by arena_init (see arena_once); next and
+ * the range after release are protected by arena_lock.
+ */
+static uint8_t*        arena_map = NULL;
+static size_t          arena_map_len = 0;
+static uint8_t*        arena_base = NULL;
+static uint8_t*        arena_limit = NULL;
+static uint8_t*        arena_next = NULL;
+static pthread_once_t  arena_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/*
+ * arena_init
+ *   DESCRIPTION: Reserve the range of address space for the arena, of
+ *                the size given by ARENA_ENV.  One extra huge page is
+ *                reserved so that the usable part can be aligned to a
+ *                huge page boundary.
+ *   INPUTS: none
+ *   OUTPUTS: none
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: maps memory; leaves the arena off on failure
+ */
+static void
+arena_init ()
+{
+    const char* env;		/* value of ARENA_ENV    */
+    size_t      mb = ARENA_DEFAULT_MB; /* size of arena  */
+    void*       map;		/* range reserved        */
+
+    if (NULL != (env = getenv (ARENA_ENV))) {
+	mb = strtoul (env, NULL, 10);
+    }
+    if (0 == mb) {
+        return;
+    }
+    arena_map_len = (mb << 20) + ARENA_HUGE_PAGE;
+    map = mmap (NULL, arena_map_len, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (MAP_FAILED == map) {
+	arena_map_len = 0;
+        return;
+    }
+    arena_map = map;
+    arena_base = (uint8_t*)(((uintptr_t)map + ARENA_HUGE_PAGE - 1) &
+			    ~(uintptr_t)(ARENA_HUGE_PAGE - 1));
+    arena_limit = arena_base + (mb << 20);
+    arena_next = arena_base;
+#if defined(MADV_HUGEPAGE)
+    (void)madvise (arena_base, mb << 20, MADV_HUGEPAGE);
+#endif
+}
+
+
+/*
+ * arena_alloc
+ *   DESCRIPTION: Carve a block from the arena.  Fresh anonymous pages
+ *                are zero, and blocks are never reused, so the block
+ *                needs no clearing.
+ *   INPUTS: bytes -- size of block
+ *   OUTPUTS: none
+ *   RETURN VALUE: the block, aligned to ARENA_ALIGN bytes, or NULL if
+ *                 the arena is off or has no room
+ *   SIDE EFFECTS: none
+ */
+void*
+arena_alloc (size_t bytes)
+{
+    uint8_t* block = NULL;	/* block handed out */
+
+    (void)pthread_once (&arena_once, arena_init);
+    bytes = (bytes + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    (void)pthread_mutex_lock (&arena_lock);
+    if (NULL != arena_map && (size_t)(arena_limit - arena_next) >= bytes) {
+	block = arena_next;
+	arena_next += bytes;
+    }
+    (void)pthread_mutex_unlock (&arena_lock);
+    return block;
+}
+
+
+/*
+ * arena_owns
+ *   DESCRIPTION: Check whether a pointer points into the arena.  Only
+ *                blocks from arena_alloc lie in the usable range, so the
+ *                check needs no lock.  It must not be made concurrently
+ *                with arena_release.
+ *   INPUTS: ptr -- the pointer
+ *   OUTPUTS: none
+ *   RETURN VALUE: 1 if ptr is in a block from arena_alloc, 0 otherwise
+ *   SIDE EFFECTS: none
+ */
+int32_t
+arena_owns (const void* ptr)
+{
+    return (NULL != arena_map && arena_base <= (const uint8_t*)ptr &&
+	    arena_limit > (const uint8_t*)ptr);
+}
+
+
+/*
+ * arena_used
+ *   DESCRIPTION: Get the number of bytes handed out by arena_alloc,
+ *                including the padding that aligns each block.
+ *   INPUTS: none
+ *   OUTPUTS: none
+ *   RETURN VALUE: bytes used
+ *   SIDE EFFECTS: none
+ */
+size_t
+arena_used ()
+{
+    size_t used;	/* bytes used */
+
+    (void)pthread_mutex_lock (&arena_lock);
+    used = (NULL == arena_map ? 0 : arena_next - arena_base);
+    (void)pthread_mutex_unlock (&arena_lock);
+    return used;
+}
+
+
+/*
+ * arena_release
+ *   DESCRIPTION: Release the whole arena with one munmap.
+ *   INPUTS: none
+ *   OUTPUTS: none
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: unmaps memory; turns the arena off for good
+ */
+void
+arena_release ()
+{
+    (void)pthread_once (&arena_once, arena_init);
+    (void)pthread_mutex_lock (&arena_lock);
+    if (NULL != arena_map) {
+	(void)munmap (arena_map, arena_map_len);
+	arena_map = NULL;
+    }
+    (void)pthread_mutex_unlock (&arena_lock);
+}
@@ -0,0 +1,44 @@
+/*									tab:8
+ *
+ * arena.h - memory kept for the life of the program (header file)
+ *
+ * Version:	    1
+ * Creation Date:   Sun Oct 18 21:40:06 2026
+ * Filename:	    arena.h
+ * History:
+ *	1	Sun Oct 18 21:40:06 2026
+ *		First written.
+ */
+#ifndef ARENA_H
+#define ARENA_H
+
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/* alignment in bytes of every block handed out by arena_alloc */
+#define ARENA_ALIGN 64
+
+/*
+ * Carve a block of the given size from the arena, aligned to ARENA_ALIGN
+ * bytes and filled with zeros.  Blocks are never freed individually; all
+ * are released at once by arena_release.  Returns NULL if the arena is
+ * turned off or full (see arena.c), in which case the caller should fall
+ * back to malloc.  Safe to call from several threads at once.
+ */
+extern void* arena_alloc (size_t bytes);
+
+/* Returns 1 if ptr points into a block from arena_alloc, 0 otherwise. */
+extern int32_t arena_owns (const void* ptr);
+
+/* Get the number of bytes handed out by arena_alloc so far. */
+extern size_t arena_used (void);
+
+/*
+ * Release all memory in the arena.  No block from it may be used
+ * afterward, and the arena cannot be used again.
+ */
+extern void arena_release (void);
+
+#endif /* ARENA_H */
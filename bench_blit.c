@@ -0,0 +1,285 @@
+/*									tab:8
+ *
+ * bench_blit.c - benchmark for drawing rows of object images
+ *
+ * Version:	    1
+ * Creation Date:   Sun Oct 18 23:10:37 2026
+ * Filename:	    bench_blit.c
+ * History:
+ *	1	Sun Oct 18 23:10:37 2026
+ *		First written.
+ */
+
+
+/*
+ * This file is a standalone program that times the drawing of object
+ * image rows over line buffers (see draw_image_row in photo.c) in each
+ * of the ways the game can draw them, and checks that all of them
+ * produce the same pixels.  Usage:
+ *
+ *     bench_blit [-n <repeats>] [<object image file> ...]
+ *
+ * With no files named, every object image in the images directory is
+ * used (see DEFAULT_OBJECTS).  Every row of each image is drawn with
+ * the image starting at each of the first BENCH_SHIFTS pixels of the
+ * line, so that the vector blits meet every alignment.  Each pass over
+ * those rows is repeated the given number of times (default
+ * DEFAULT_REPEATS), and the fastest pass is reported.  The ways of
+ * drawing are:
+ *
+ *     spans   each span of opaque pixels copied with memcpy
+ *     scalar  every row masked blit one pixel at a time
+ *     sse2    every row masked blit 16 pixels at a time
+ *     avx2    every row masked blit 32 pixels at a time
+ *
+ * Blits that the processor cannot run are skipped.
+ *
+ * Output is one header line naming the fields, then one line per image,
+ * with fields separated by tabs:
+ *
+ *     object     file name
+ *     width      width in pixels
+ *     height     height in pixels
+ *     spans_ns   mean time per row drawn span by span
+ *     scalar_ns  mean time per row drawn with the scalar blit
+ *     sse2_ns    mean time per row drawn with the SSE2 blit
+ *     avx2_ns    mean time per row drawn with the AVX2 blit
+ *
+ * A time is "-" if the blit was skipped.  A summary is printed to
+ * stderr.  The exit status is 1 if any image could not be read or any
+ * way of drawing produced different pixels from the spans.
+ */
+
+
+#include <glob.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "modex.h"
+#include "photo.h"
+#include "photo_headers.h"
+#include "world.h"
+
+
+/* parameters defined for this file */
+
+#define DEFAULT_OBJECTS "images/*.obj"	/* images used by default      */
+#define DEFAULT_REPEATS 100		/* passes over each image      */
+#define BENCH_SHIFTS    32		/* starting pixels in the line */
+#define BENCH_BACKDROP  0x5A		/* line pixels under the image */
+#define N_MODES         4		/* ways of drawing (see mode)  */
+
+
+/* functions local to this file--see function headers for details */
+
+static int32_t draw_all (const image_t* im, uint8_t* out);
+static double time_rows (const image_t* im, int32_t repeats);
+
+
+/*
+ * Ways of drawing rows, as names for set_obj_blit and the mean span
+ * length below which each uses the masked blit.  Every row of an image
+ * is narrower than MAX_OBJECT_WIDTH + 1 pixels, so every row is blitted
+ * in all but the first.
+ */
+static const char* const mode_name[N_MODES] = {
+    "spans", "scalar", "sse2", "avx2"
+};
+static const char* const mode_blit[N_MODES] = {
+    "scalar", "scalar", "sse2", "avx2"
+};
+static const int32_t mode_span[N_MODES] = {
+    0, MAX_OBJECT_WIDTH + 1, MAX_OBJECT_WIDTH + 1, MAX_OBJECT_WIDTH + 1
+};
+
+
+/*
+ * The game's photo code refers to the world and to the VGA palette when
+ * drawing rooms (see prep_room and fill_horiz_buffer).  None of it is
+ * used here, since rows are drawn with draw_image_row directly.
+ */
+void fill_palette (unsigned char palette[192][3]) {}
+const obj_draw_t* room_objects (const room_t* r) { return NULL; }
+uint32_t room_objects_on_col (const room_t* r, int32_t x) { return 0; }
+uint32_t room_objects_on_row (const room_t* r, int32_t y) { return 0; }
+photo_t* room_photo (const room_t* r) { return NULL; }
+
+
+/*
+ * draw_all
+ *   DESCRIPTION: Draw every row of an image at every starting pixel
+ *                over a fresh line of BENCH_BACKDROP pixels, and keep
+ *                the lines.
+ *   INPUTS: im -- the image
+ *   OUTPUTS: out -- the lines, BENCH_SHIFTS for each row of the image
+ *   RETURN VALUE: number of bytes written to out
+ *   SIDE EFFECTS: none
+ */
+static int32_t
+draw_all (const image_t* im, uint8_t* out)
+{
+    int32_t row;	/* index over image rows      */
+    int32_t shift;	/* index over starting pixels */
+    int32_t len = 0;	/* bytes written to out       */
+
+    for (row = 0; image_height (im) > row; row++) {
+	for (shift = 0; BENCH_SHIFTS > shift; shift++) {
+	    (void)memset (&out[len], BENCH_BACKDROP, SCROLL_X_DIM);
+	    draw_image_row (im, row, -shift, &out[len]);
+	    len += SCROLL_X_DIM;
+	}
+    }
+    return len;
+}
+
+
+/*
+ * time_rows
+ *   DESCRIPTION: Draw every row of an image at every starting pixel over
+ *                one line buffer, repeatedly, and find the time per row
+ *                of the fastest pass.
+ *   INPUTS: im -- the image
+ *           repeats -- number of passes (at least 1)
+ *   OUTPUTS: none
+ *   RETURN VALUE: mean time per row drawn in the fastest pass, in
+ *                 nanoseconds
+ *   SIDE EFFECTS: none
+ */
+static double
+time_rows (const image_t* im, int32_t repeats)
+{
+    unsigned char   line[SCROLL_X_DIM]; /* line drawn over          */
+    struct timespec start;	/* time pass started               */
+    struct timespec end;	/* time pass finished              */
+    double          ns;		/* time per row in pass            */
+    double          best = 0;	/* time per row in fastest pass    */
+    int32_t         i;		/* index over passes               */
+    int32_t         row;	/* index over image rows           */
+    int32_t         shift;	/* index over starting pixels      */
+
+    (void)memset (line, BENCH_BACKDROP, sizeof (line));
+    for (i = 0; repeats > i; i++) {
+	(void)clock_gettime (CLOCK_MONOTONIC, &start);
+	for (row = 0; image_height (im) > row; row++) {
+	    for (shift = 0; BENCH_SHIFTS > shift; shift++) {
+		draw_image_row (im, row, -shift, line);
+	    }
+	}
+	(void)clock_gettime (CLOCK_MONOTONIC, &end);
+	ns = ((end.tv_sec - start.tv_sec) * 1e9 +
+	      (end.tv_nsec - start.tv_nsec)) /
+	     (image_height (im) * BENCH_SHIFTS);
+	if (0 == i || best > ns) {
+	    best = ns;
+	}
+    }
+    return best;
+}
+
+
+/*
+ * main
+ *   DESCRIPTION: Time the drawing of each object image named on the
+ *                command line (or each default image) in every way, and
+ *                report on it; see the top of this file.
+ *   INPUTS: argc -- number of arguments
+ *           argv -- the arguments
+ *   OUTPUTS: none
+ *   RETURN VALUE: 0 if all images were read and drawn the same in every
+ *                 way, 1 otherwise (2 for bad usage)
+ *   SIDE EFFECTS: prints the report
+ */
+int
+main (int argc, char* argv[])
+{
+    glob_t   names;		/* default image files             */
+    char**   files;		/* image files to use              */
+    int32_t  n_files;		/* number of image files           */
+    int32_t  repeats = DEFAULT_REPEATS; /* passes over each image  */
+    image_t* im;		/* image read                      */
+    uint8_t* ref;		/* lines drawn span by span        */
+    uint8_t* out;		/* lines drawn in another way      */
+    int32_t  len;		/* bytes of lines drawn            */
+    int32_t  run[N_MODES];	/* 1 if mode can be run            */
+    double   ns[N_MODES];	/* time per row in each mode       */
+    double   total_ns[N_MODES]; /* sum of ns over images           */
+    int32_t  used = 0;		/* images read                     */
+    int32_t  differ = 0;	/* images drawn differently        */
+    int32_t  i;			/* index over image files          */
+    int32_t  m;			/* index over modes                */
+
+    if (3 <= argc && 0 == strcmp (argv[1], "-n")) {
+	if (1 > (repeats = atoi (argv[2]))) {
+	    fprintf (stderr, "usage: %s [-n <repeats>] "
+		     "[<object image file> ...]\n", argv[0]);
+	    return 2;
+	}
+	argc -= 2;
+	argv += 2;
+    }
+    if (1 < argc) {
+	files = argv + 1;
+	n_files = argc - 1;
+    } else {
+	if (0 != glob (DEFAULT_OBJECTS, 0, NULL, &names)) {
+	    fprintf (stderr, "no images match %s\n", DEFAULT_OBJECTS);
+	    return 1;
+	}
+	files = names.gl_pathv;
+	n_files = names.gl_pathc;
+    }
+    len = MAX_OBJECT_HEIGHT * BENCH_SHIFTS * SCROLL_X_DIM;
+    if (NULL == (ref = malloc (len)) || NULL == (out = malloc (len))) {
+	fprintf (stderr, "out of memory\n");
+	return 1;
+    }
+    for (m = 0; N_MODES > m; m++) {
+	run[m] = (0 == set_obj_blit (mode_blit[m], mode_span[m]));
+	total_ns[m] = 0;
+    }
+
+    printf ("object\twidth\theight");
+    for (m = 0; N_MODES > m; m++) {
+	printf ("\t%s_ns", mode_name[m]);
+    }
+    printf ("\n");
+    for (i = 0; n_files > i; i++) {
+	if (NULL == (im = read_obj_image (files[i])) ||
+	    NULL == (im = share_obj_image (im))) {
+	    fprintf (stderr, "%s: could not read image\n", files[i]);
+	    continue;
+	}
+	used++;
+	printf ("%s\t%u\t%u", files[i], image_width (im),
+		image_height (im));
+	for (m = 0; N_MODES > m; m++) {
+	    if (!run[m]) {
+		printf ("\t-");
+		continue;
+	    }
+	    (void)set_obj_blit (mode_blit[m], mode_span[m]);
+	    len = draw_all (im, (0 == m ? ref : out));
+	    if (0 != m && 0 != memcmp (ref, out, len)) {
+		fprintf (stderr, "%s: %s blit differs from spans\n",
+			 files[i], mode_name[m]);
+		differ++;
+	    }
+	    ns[m] = time_rows (im, repeats);
+	    total_ns[m] += ns[m];
+	    printf ("\t%.1f", ns[m]);
+	}
+	printf ("\n");
+    }
+
+    fprintf (stderr, "%d of %d images, mean ns per row:", used, n_files);
+    for (m = 0; N_MODES > m; m++) {
+	if (run[m] && 0 != used) {
+	    fprintf (stderr, " %s %.1f", mode_name[m], total_ns[m] / used);
+	}
+    }
+    fprintf (stderr, "; %s\n", (0 == differ ? "all drawn identically" :
+				 "SOME DRAWN DIFFERENTLY"));
+    return (n_files == used && 0 == differ ? 0 : 1);
+}
@@ -0,0 +1,301 @@
+/*									tab:8
+ *
+ * bench_photo.c - benchmark and quality report for room photo loading
+ *
+ * Version:	    1
+ * Creation Date:   Sun Oct 18 14:05:12 2026
+ * Filename:	    bench_photo.c
+ * History:
+ *	1	Sun Oct 18 14:05:12 2026
+ *		First written.
+ */
+
+
+/*
+ * This file is a standalone program that loads room photos with
+ * read_photo, without mode X or any other VGA access, and reports the
+ * cost and quality of quantizing each one.  Usage:
+ *
+ *     bench_photo [-n <repeats>] [<photo file> ...]
+ *
+ * With no files named, every photo in the images directory is loaded
+ * (see DEFAULT_PHOTOS).  Each photo is loaded the given number of times
+ * (default 1), and the times from the fastest load are reported.  The 
+ * on-disk photo cache is disabled so that every load quantizes; the
+ * quantizer, dithering, and packing of pixels in memory are chosen from
+ * the environment as in the game (see photo.c).  The last copy of each
+ * photo loaded is then drawn as if it were the room on the screen, 
+ * every row with fill_horiz_buffer and every column with 
+ * fill_vert_buffer, and the fastest of the same number of passes is 
+ * reported.
+ *
+ * Output is one header line naming the fields, then one line per photo,
+ * with fields separated by tabs:
+ *
+ *     photo        file name
+ *     width        width in pixels
+ *     height       height in pixels
+ *     quantizer    quantizer name
+ *     dither       dithering mode name
+ *     load_ms      total time spent in read_photo
+ *     read_ms      mapping the file and allocating pixels
+ *     hist_ms      counting colors
+ *     select_ms    choosing the palette and color map
+ *     remap_ms     mapping pixels to the palette
+ *     mse          mean squared error per 6-bit field against the source
+ *     psnr_db      peak signal-to-noise ratio
+ *     bytes        bytes of pixel data held in memory
+ *     hline_us     mean time to fill a buffer for one row
+ *     vline_us     mean time to fill a buffer for one column
+ *     peak_rss_kb  peak resident memory of the process so far
+ *
+ * A summary is printed to stderr.  The exit status is 1 if any photo
+ * could not be loaded.
+ */
+
+
+#include <glob.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "modex.h"
+#include "photo.h"
+#include "photo_cache.h"
+#include "world.h"
+
+
+/* parameters defined for this file */
+
+#define DEFAULT_PHOTOS "images/*.photo"	/* photos loaded by default */
+
+
+/* functions local to this file--see function headers for details */
+
+static photo_t* bench_one (const char* fname, int32_t repeats,
+			   photo_quant_stats_t* best, double* best_ms);
+static long peak_rss_kb (void);
+static void time_lines (photo_t* p, int32_t repeats, double* h_us, 
+			double* v_us);
+
+
+/* the photo drawn by time_lines, returned by room_photo */
+static photo_t* shown = NULL;
+
+
+/*
+ * The game's photo code refers to the world and to the VGA palette when
+ * drawing rooms (see prep_room and fill_horiz_buffer).  Here the room 
+ * on the screen holds only the photo being drawn by time_lines.
+ */
+void fill_palette (unsigned char palette[192][3]) {}
+const obj_draw_t* room_objects (const room_t* r) { return NULL; }
+uint32_t room_objects_on_col (const room_t* r, int32_t x) { return 0; }
+uint32_t room_objects_on_row (const room_t* r, int32_t y) { return 0; }
+photo_t* room_photo (const room_t* r) { return shown; }
+
+
+/*
+ * bench_one
+ *   DESCRIPTION: Load a photo repeatedly and keep the costs of the
+ *                fastest load.  Loaded photos are not freed (see photo.h).
+ *   INPUTS: fname -- photo file name
+ *           repeats -- number of loads (at least 1)
+ *   OUTPUTS: best -- costs of the fastest load
+ *            best_ms -- total time of the fastest load in milliseconds
+ *   RETURN VALUE: the last photo loaded, or NULL if any load fails
+ *   SIDE EFFECTS: prints a message on failure
+ */
+static photo_t*
+bench_one (const char* fname, int32_t repeats, photo_quant_stats_t* best,
+	   double* best_ms)
+{
+    photo_t*            p;	/* photo just loaded           */
+    photo_quant_stats_t stats;	/* costs of that load          */
+    struct timespec     start;	/* time load started           */
+    struct timespec     end;	/* time load finished          */
+    double              ms;	/* length of load              */
+    int32_t             i;	/* index over loads            */
+
+    for (i = 0; repeats > i; i++) {
+	(void)clock_gettime (CLOCK_MONOTONIC, &start);
+	p = read_photo (fname);
+	(void)clock_gettime (CLOCK_MONOTONIC, &end);
+	if (NULL == p || 0 != get_photo_quant_stats (p, &stats)) {
+	    fprintf (stderr, "%s: could not load photo\n", fname);
+	    return NULL;
+	}
+	ms = (end.tv_sec - start.tv_sec) * 1e3 +
+	     (end.tv_nsec - start.tv_nsec) / 1e6;
+	if (0 == i || *best_ms > ms) {
+	    *best = stats;
+	    *best_ms = ms;
+	}
+    }
+    return p;
+}
+
+
+/*
+ * peak_rss_kb
+ *   DESCRIPTION: Find the peak resident memory of this process.
+ *   INPUTS: none
+ *   OUTPUTS: none
+ *   RETURN VALUE: peak resident set size in kilobytes, or -1 if unknown
+ *   SIDE EFFECTS: none
+ */
+static long
+peak_rss_kb ()
+{
+    struct rusage ru;	/* resource usage of this process */
+
+    return (0 == getrusage (RUSAGE_SELF, &ru) ? ru.ru_maxrss : -1);
+}
+
+
+/*
+ * time_lines
+ *   DESCRIPTION: Draw every row and every column of a photo into line
+ *                buffers as the mode X code would, repeatedly, and keep
+ *                the times of the fastest pass.
+ *   INPUTS: p -- the photo
+ *           repeats -- number of passes (at least 1)
+ *   OUTPUTS: h_us -- mean time per row in microseconds
+ *            v_us -- mean time per column in microseconds
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: makes p the photo of the room on the screen
+ */
+static void
+time_lines (photo_t* p, int32_t repeats, double* h_us, double* v_us)
+{
+    unsigned char   hbuf[SCROLL_X_DIM]; /* pixels of one row        */
+    unsigned char   vbuf[SCROLL_Y_DIM]; /* pixels of one column     */
+    struct timespec start;	/* time pass started               */
+    struct timespec end;	/* time pass finished              */
+    double          us;		/* time per line in pass           */
+    int32_t         i;		/* index over passes               */
+    int32_t         n;		/* index over rows or columns      */
+
+    shown = p;
+    for (i = 0; repeats > i; i++) {
+	prep_room (NULL);
+	(void)clock_gettime (CLOCK_MONOTONIC, &start);
+	for (n = 0; photo_height (p) > n; n++) {
+	    fill_horiz_buffer (0, n, hbuf);
+	}
+	(void)clock_gettime (CLOCK_MONOTONIC, &end);
+	us = ((end.tv_sec - start.tv_sec) * 1e6 +
+	      (end.tv_nsec - start.tv_nsec) / 1e3) / photo_height (p);
+	if (0 == i || *h_us > us) {
+	    *h_us = us;
+	}
+
+	prep_room (NULL);
+	(void)clock_gettime (CLOCK_MONOTONIC, &start);
+	for (n = 0; photo_width (p) > n; n++) {
+	    fill_vert_buffer (n, 0, vbuf);
+	}
+	(void)clock_gettime (CLOCK_MONOTONIC, &end);
+	us = ((end.tv_sec - start.tv_sec) * 1e6 +
+	      (end.tv_nsec - start.tv_nsec) / 1e3) / photo_width (p);
+	if (0 == i || *v_us > us) {
+	    *v_us = us;
+	}
+    }
+}
+
+
+/*
+ * main
+ *   DESCRIPTION: Load each photo named on the command line (or each
+ *                default photo) and report on it; see the top of this
+ *                file.
+ *   INPUTS: argc -- number of arguments
+ *           argv -- the arguments
+ *   OUTPUTS: none
+ *   RETURN VALUE: 0 if all photos loaded, 1 otherwise (2 for bad usage)
+ *   SIDE EFFECTS: prints the report
+ */
+int
+main (int argc, char* argv[])
+{
+    glob_t              names;	/* default photo files             */
+    char**              files;	/* photo files to load             */
+    int32_t             n_files; /* number of photo files          */
+    int32_t             repeats = 1; /* loads of each photo         */
+    photo_t*            p;	/* photo loaded                    */
+    photo_quant_stats_t stats;	/* costs of fastest load of photo  */
+    double              ms;	/* time of fastest load of photo   */
+    double              total_ms = 0; /* sum of ms over photos     */
+    double              total_psnr = 0; /* sum of PSNR over photos */
+    double              h_us = 0; /* time per row of photo        */
+    double              v_us = 0; /* time per column of photo     */
+    double              total_h_us = 0; /* sum of h_us over photos */
+    double              total_v_us = 0; /* sum of v_us over photos */
+    size_t              bytes;	/* pixel data held for photo       */
+    size_t              total_bytes = 0; /* sum of bytes           */
+    size_t              total_raw = 0; /* sum of unpacked sizes    */
+    int32_t             loaded = 0; /* photos loaded                */
+    int32_t             i;	/* index over photo files          */
+
+    if (3 <= argc && 0 == strcmp (argv[1], "-n")) {
+	if (1 > (repeats = atoi (argv[2]))) {
+	    fprintf (stderr, "usage: %s [-n <repeats>] [<photo file> ...]\n",
+		     argv[0]);
+	    return 2;
+	}
+	argc -= 2;
+	argv += 2;
+    }
+    if (1 < argc) {
+	files = argv + 1;
+	n_files = argc - 1;
+    } else {
+	if (0 != glob (DEFAULT_PHOTOS, 0, NULL, &names)) {
+	    fprintf (stderr, "no photos match %s\n", DEFAULT_PHOTOS);
+	    return 1;
+	}
+	files = names.gl_pathv;
+	n_files = names.gl_pathc;
+    }
+
+    (void)setenv (PHOTO_CACHE_ENV, "", 1);
+    set_photo_quant_stats (1);
+
+    printf ("photo\twidth\theight\tquantizer\tdither\tload_ms\tread_ms\t"
+	    "hist_ms\tselect_ms\tremap_ms\tmse\tpsnr_db\tbytes\thline_us\t"
+	    "vline_us\tpeak_rss_kb\n");
+    for (i = 0; n_files > i; i++) {
+	if (NULL == (p = bench_one (files[i], repeats, &stats, &ms))) {
+	    continue;
+	}
+	time_lines (p, repeats, &h_us, &v_us);
+	bytes = photo_resident_bytes (p);
+	loaded++;
+	total_ms += ms;
+	total_psnr += stats.psnr;
+	total_h_us += h_us;
+	total_v_us += v_us;
+	total_bytes += bytes;
+	total_raw += (size_t)photo_width (p) * photo_height (p);
+	printf ("%s\t%u\t%u\t%s\t%s\t%.3f\t%.3f\t%.3f\t%.3f\t%.3f\t%.4f\t"
+		"%.2f\t%zu\t%.3f\t%.3f\t%ld\n", files[i], photo_width (p),
+		photo_height (p), stats.quantizer, stats.dither, ms, 
+		stats.read_usec / 1e3, stats.hist_usec / 1e3, 
+		stats.select_usec / 1e3, stats.remap_usec / 1e3, stats.mse,
+		stats.psnr, bytes, h_us, v_us, peak_rss_kb ());
+    }
+
+    fprintf (stderr, "%d of %d photos loaded in %.3f ms, mean PSNR %.2f dB, "
+	     "peak RSS %ld KB\n", loaded, n_files, total_ms,
+	     (0 == loaded ? 0.0 : total_psnr / loaded), peak_rss_kb ());
+    if (0 != loaded) {
+	fprintf (stderr, "pixel data %zu of %zu bytes (%.1f%%), mean row "
+		 "%.3f us, mean column %.3f us\n", total_bytes, total_raw,
+		 100.0 * total_bytes / total_raw, total_h_us / loaded, 
+		 total_v_us / loaded);
+    }
+    return (n_files == loaded ? 0 : 1);
+}
@@ -193,6 +193,13 @@ static unsigned short target_img;   /* offset of displayed screen image */
  */
 static void (*horiz_line_fn) (int, int, unsigned char[SCROLL_X_DIM]);
 static void (*vert_line_fn) (int, int, unsigned char[SCROLL_Y_DIM]);
+
+/* 
+ * optional function provided by the caller to set_horiz_planes_fn() and
+ * used by draw_horiz_line to write a line directly into the build buffer
+ * planes; NULL if none
+ */
+static int (*horiz_planes_fn) (int, int, unsigned char*[4]) = NULL;
 	
 
 /* 
@@ -560,6 +567,30 @@ clear_screens ()
 #if !defined(TEXT_RESTORE_PROGRAM)
 
 
+/*
+ * set_horiz_planes_fn
+ *   DESCRIPTION: Give draw_horiz_line a function that writes the image
+ *                of a logical line directly into the four planes of the
+ *                build buffer, skipping the line buffer.  The function 
+ *                is given the logical coordinates of the leftmost pixel
+ *                and the address of column (x >> 2) of the line in each
+ *                plane, and must put pixel x + i in plane (x + i) & 3 at
+ *                offset ((x + i) >> 2) - (x >> 2).  It returns 0 if it
+ *                drew the line, or -1 to have the line drawn through 
+ *                the function given to set_mode_X instead.
+ *   INPUTS: planes_fn -- the function, or NULL to draw every line 
+ *                        through the line buffer
+ *   OUTPUTS: none
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: none
+ */   
+void
+set_horiz_planes_fn (int (*planes_fn) (int, int, unsigned char*[4]))
+{
+    horiz_planes_fn = planes_fn;
+}
+
+
 /*
  * draw_vert_line
  *   DESCRIPTION: Draw a vertical map line into the build buffer.  The 
@@ -629,6 +660,8 @@ draw_horiz_line (int y)
     unsigned char buf[SCROLL_X_DIM]; /* buffer for graphical image of line */
     unsigned char* addr;             /* address of first pixel in build    */
    				     /*     buffer (without plane offset)  */
+    unsigned char* plane[4];         /* address of first pixel in each     */
+    				     /*     plane of build buffer          */
     int p_off;                       /* offset of plane of first pixel     */
     int i;			     /* loop index over pixels             */
 
@@ -639,13 +672,23 @@ draw_horiz_line (int y)
     /* Adjust y to the logical row value. */
     y += show_y; // logical view window coordinates
 
-    /* Get the image of the line. */
-    (*horiz_line_fn) (show_x, y, buf);
-
     /* Calculate starting address in build buffer. */
     //addr = upperleft + (old logical/4)+()
     addr = img3 + (show_x >> 2) + y * SCROLL_X_WIDTH;
 
+    /* Let the caller write the planes directly if it can. */
+    if (NULL != horiz_planes_fn) {
+	for (i = 0; i < 4; i++) {
+	    plane[i] = addr + (3 - i) * SCROLL_SIZE;
+	}
+	if (0 == (*horiz_planes_fn) (show_x, y, plane)) {
+	    return 0;
+	}
+    }
+
+    /* Get the image of the line. */
+    (*horiz_line_fn) (show_x, y, buf);
+
     /* Calculate plane offset of first pixel. */
     // 3-(show_x mod 4) = # of plane
     p_off = (3 - (show_x & 3));
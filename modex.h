@@ -126,6 +126,13 @@ extern int set_mode_X (void (*horiz_fill_fn)
 		       void (*vert_fill_fn) 
 		            (int, int, unsigned char[SCROLL_Y_DIM]));
 
+/* 
+ * optionally let draw_horiz_line write lines directly into the build 
+ * buffer planes; see modex.c
+ */
+extern void set_horiz_planes_fn (int (*planes_fn) 
+				     (int, int, unsigned char*[4]));
+
 /* return to text mode */
 extern void clear_mode_X ();
 
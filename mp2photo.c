@@ -60,6 +60,9 @@
 #define WRITE_OBJECT_IMAGE 0		/* output defaults to room photo */
 #endif
 
+/* largest width and height accepted (see MAX_STREAM_WIDTH in photo.h) */
+#define MAX_BMP_DIM 16384
+
 
 /* 
  * Calculate width of one row of a BMP image in bytes, including padding
@@ -87,7 +90,8 @@ bmp_header_check (const char* fname, FILE* in, bmp_header_t* h)
         fprintf (stderr, "%s does not appear to be a BMP file.\n", fname);
 	return 0;
     }
-    if (4096 < h->img_width || 4096 < h->img_height || 1 != h->planes || 
+    if (MAX_BMP_DIM < h->img_width || MAX_BMP_DIM < h->img_height || 
+	1 != h->planes || 
     	24 != h->bits_per_pixel || 0 != h->compression_type) {
         fprintf (stderr, "%s must be 24-bit-color on one plane with no "
 		 "compression.\n", fname);
@@ -102,12 +106,13 @@ bmp_header_check (const char* fname, FILE* in, bmp_header_t* h)
     return 1;
 }
 
-// Read image data from BMP file into dynamically allocated memory.
-// Return pointer to memory on success, or NULL on failure.
+// Seek to image data in BMP file and allocate space for one row of it.
+// Return pointer to memory on success, or NULL on failure.  Rows are
+// read one at a time so that large images need not fit in memory.
 static uint8_t*
-read_bmp_image_data (FILE* in, const bmp_header_t* h)
+start_bmp_image_data (FILE* in, const bmp_header_t* h)
 {
-    uint8_t* img_data;
+    uint8_t* img_row;
 
     // Seek to image data.
     if (0 != fseek (in, h->pixel_offset, SEEK_SET)) {
@@ -115,23 +120,19 @@ read_bmp_image_data (FILE* in, const bmp_header_t* h)
         return NULL;
     }
 
-    // Allocate space, then read in the image data.
-    if (NULL == (img_data = malloc (h->img_size)) ||
-    	1 != fread (img_data, h->img_size, 1, in)) {
-	if (NULL != img_data) {
-	    free (img_data);
-	}
-        perror ("allocate and read image");
+    // Allocate space for a row.
+    if (NULL == (img_row = malloc (bmp_row_width (h)))) {
+        perror ("allocate image row");
 	return NULL;
     }
-    return img_data;
+    return img_row;
 }
 
-// Write header and data as either 5:6:5 RGB words (little endian) or
-// 2:2:2 RGB bytes, row by row, to the output file.  Return 1 on success, 
-// 0 on failure.
+// Read header and data from the BMP file, row by row into img, and write
+// them as either 5:6:5 RGB words (little endian) or 2:2:2 RGB bytes to 
+// the output file.  Return 1 on success, 0 on failure.
 static int
-write_output_file (FILE* out, const bmp_header_t* h, const uint8_t* img)
+write_output_file (FILE* in, FILE* out, const bmp_header_t* h, uint8_t* img)
 {
     photo_header_t photo_header;
     uint32_t       row_width;
@@ -149,12 +150,16 @@ write_output_file (FILE* out, const bmp_header_t* h, const uint8_t* img)
     // Write image data to output file.
     row_width = bmp_row_width (h);
     for (y = 0; h->img_height > y; y++) {
+	if (1 != fread (img, row_width, 1, in)) {
+	    perror ("read image");
+	    return 0;
+	}
 	for (x = 0; h->img_width > x; x++) {
 #if (1 == WRITE_OBJECT_IMAGE)
 	    uint8_t vga_color;
- 	    vga_color = ((img[row_width * y + 3 * x + 2] >> 6) << 4) | 
- 	    		((img[row_width * y + 3 * x + 1] >> 6) << 2) | 
- 			(img[row_width * y + 3 * x] >> 6);
+ 	    vga_color = ((img[3 * x + 2] >> 6) << 4) | 
+ 	    		((img[3 * x + 1] >> 6) << 2) | 
+ 			(img[3 * x] >> 6);
 	    /* 
 	     * We map any bright yellow pixel to transparent; it's easy to
 	     * be more specific by conditioning on the img data (24 bits)
@@ -165,9 +170,9 @@ write_output_file (FILE* out, const bmp_header_t* h, const uint8_t* img)
  	    }
 #else /* (1 != WRITE_OBJECT_IMAGE) */
 	    uint16_t vga_color;
-	    vga_color = ((img[row_width * y + 3 * x + 2] >> 3) << 11) | 
-	    		((img[row_width * y + 3 * x + 1] >> 2) << 5) | 
-			(img[row_width * y + 3 * x] >> 3);
+	    vga_color = ((img[3 * x + 2] >> 3) << 11) | 
+	    		((img[3 * x + 1] >> 2) << 5) | 
+			(img[3 * x] >> 3);
 #endif /* WRITE_OBJECT_IMAGE */
 	    if (1 != fwrite (&vga_color, sizeof (vga_color), 1, out)) {
 	        perror ("write data to output file");
@@ -205,19 +210,19 @@ main (int argc, char* argv[])
 	return 2;
     }
 
-    // Check validity of input file, then read image data from input file.
+    // Check validity of input file, then find image data in input file.
     if (!bmp_header_check (argv[1], in, &bmp_header) ||
-	NULL == (img_data = read_bmp_image_data (in, &bmp_header))) {
+	NULL == (img_data = start_bmp_image_data (in, &bmp_header))) {
 	fclose (in);
 	fclose (out);
 	return 2;
     }
 
+    // Try to write, then close, the output file.
+    written = write_output_file (in, out, &bmp_header, img_data);
+
     // Done with the input file.  Ignore remaining errors.
     (void)fclose (in);
-
-    // Try to write, then close, the output file.
-    written = write_output_file (out, &bmp_header, img_data);
     if (EOF == fclose (out)) {
 	perror ("close output file");
         written = 0;
@@ -36,15 +36,168 @@
  */
 
 
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
+#include "arena.h"
 #include "assert.h"
 #include "modex.h"
 #include "photo.h"
+#include "photo_cache.h"
 #include "photo_headers.h"
+#include "photo_pack.h"
+#include "quantize.h"
 #include "world.h"
 
 
+/* parameters defined for this file */
+
+/*
+ * Identifies the output of the photo quantization code for the on-disk
+ * photo cache.  Change this value whenever a change to read_photo alters
+ * the palettes or pixels produced, so that old cache entries are ignored.
+ * The quantizer in use is added in multiples of 256, and the dithering
+ * mode in multiples of 4096.
+ */
+#define QUANT_VARIANT 1
+
+/* maximum number of photos waiting for the prefetch thread */
+#define PREFETCH_MAX 16
+
+/* number of hash chains of object images shared by share_obj_image */
+#define IMAGE_HASH_SLOTS 64
+
+/*
+ * Number of interleaved full-color histograms used when counting photo
+ * pixels (see count_colors), and the number of 5:6:5 colors in each.
+ */
+#define HIST_SUBS   2
+#define HIST_COLORS QUANT_COLORS
+
+/*
+ * Environment variables selecting the quantizer used to choose photo 
+ * palettes (a name from quantizer_name in quantize.c; "popular" by 
+ * default) and, when QUANT_REPORT_ENV is set, asking for the time taken
+ * and the resulting PSNR to be printed for each photo quantized.
+ */
+#define QUANTIZER_ENV    "ADV_QUANTIZER"
+#define QUANT_REPORT_ENV "ADV_QUANT_REPORT"
+
+/* 
+ * Environment variable selecting the dithering applied when photo pixels
+ * are mapped to the palette (a name from dither_name; "none" by default).
+ */
+#define DITHER_ENV "ADV_DITHER"
+
+/*
+ * Environment variable that sets the number of threads used to count the
+ * colors of one photo and to map its pixels to the palette without 
+ * dithering (1 forces serial quantization).  By default, one thread per
+ * online processor is used.  Each thread takes at least QUANT_PART_MIN 
+ * pixels, so smaller photos are quantized serially, and at most 
+ * QUANT_MAX_PARTS threads are used.
+ */
+#define QUANT_THREADS_ENV "ADV_QUANT_THREADS"
+#define QUANT_PART_MIN    65536
+#define QUANT_MAX_PARTS   16
+
+/* 
+ * Environment variable asking for photo pixels to be kept packed in 
+ * memory when set to 1 (see pack_photo).  Pixels are packed in bands of
+ * BAND_ROWS rows, and the BAND_SLOTS bands drawn most recently are kept
+ * unpacked (see photo_row).  Enough bands are kept to cover the height
+ * of the screen, so that drawing a column unpacks each band only once.
+ */
+#define PHOTO_PACK_ENV "ADV_PHOTO_PACK"
+#define BAND_ROWS      8
+#define BAND_SLOTS     32
+
+/* 
+ * Environment variable asking for unpacked photo pixels to be stored in
+ * square tiles when set to 1 (see tile_photo).  Each tile holds 
+ * TILE_SIZE rows of TILE_SIZE pixels, so drawing a column reads 
+ * TILE_SIZE pixels from each block of memory rather than one from each
+ * row of the photo.
+ */
+#define PHOTO_TILE_ENV "ADV_PHOTO_TILES"
+#define TILE_BITS      4
+#define TILE_SIZE      (1 << TILE_BITS)
+#define TILE_MASK      (TILE_SIZE - 1)
+#define TILE_PIXELS    (TILE_SIZE * TILE_SIZE)
+
+/* 
+ * Environment variable asking for unpacked photo pixels to be split into
+ * the four mode X planes when set to 1 (see plane_photo), so that each
+ * plane of a row can be copied into the build buffer with one memcpy 
+ * (see fill_horiz_planes).  Tiles are used instead if also asked for.
+ */
+#define PHOTO_PLANE_ENV "ADV_PHOTO_PLANES"
+
+/* 
+ * Photos larger than MAX_PHOTO_WIDTH by MAX_PHOTO_HEIGHT (up to 
+ * MAX_STREAM_WIDTH by MAX_STREAM_HEIGHT) are streamed from their mapped
+ * files (see stream_photo).  Pixels are mapped to the palette only for
+ * tiles of TILE_SIZE by TILE_SIZE pixels that are drawn, and are kept in
+ * STREAM_COLS by STREAM_ROWS slots shared by all streamed photos (see 
+ * photo_tile).  Tile (tx,ty) may be held only in slot (tx % STREAM_COLS,
+ * ty % STREAM_ROWS), so all tiles of a screen fit at once.  Pages of the
+ * mapped file are released after every STREAM_DROP_PIXELS pixels counted
+ * when choosing the palette, and after every STREAM_SLOTS tiles mapped
+ * when drawing, so that little of the file stays resident either.
+ */
+#define STREAM_COLS        32
+#define STREAM_ROWS        16
+#define STREAM_SLOTS       (STREAM_COLS * STREAM_ROWS)
+#define STREAM_DROP_PIXELS (1 << 20)
+
+/* 
+ * Environment variable that, when set to 0, makes the use of a lazily 
+ * loaded photo that is not in memory wait for it to load rather than 
+ * showing a preview at once (see photo_use).
+ */
+#define PREVIEW_ENV "ADV_PREVIEW"
+
+/* 
+ * Environment variables selecting how rows of object images are drawn 
+ * (see draw_image_row).  A row whose opaque spans average fewer pixels
+ * than OBJ_BLIT_SPAN_ENV gives (OBJ_BLIT_SPAN by default; 0 for never)
+ * is drawn with one masked blit over all of its spans rather than one 
+ * copy per span.  OBJ_BLIT_ENV names the blit used (a name from 
+ * blit_name; by default, the fastest the processor supports).  Copying
+ * span by span is faster for every row of the shipped objects (see
+ * bench_blit.c), so by default only rows speckled with very short spans
+ * are blitted.
+ */
+#define OBJ_BLIT_ENV      "ADV_OBJ_BLIT"
+#define OBJ_BLIT_SPAN_ENV "ADV_OBJ_BLIT_SPAN"
+#define OBJ_BLIT_SPAN     4
+
+/* most rooms kept composited at once (see room_layer_t) */
+#define LAYER_SLOTS 8
+
+/* 
+ * Offsets added to 5-bit (red and blue) and 6-bit (green) fields for a 
+ * Bayer threshold t (0 to 15) in ordered dithering.  Both span -4 to 4 in
+ * 6:6:6 units (about the spacing of level-4 octree colors) and average 0.
+ */
+#define ORDERED_RB(t) (((t) + 2) / 4 - 2)
+#define ORDERED_G(t)  (((t) + 1) / 2 - 4)
+
+/* x86 processors may support SSE2 even if this file is not built for it */
+#if defined(__i386__) || defined(__x86_64__)
+#define HIST_SSE2 1
+#include <emmintrin.h>
+#include <immintrin.h>
+#endif
+
+
 /* types local to this file (declared in types.h) */
 
 /* 
@@ -54,11 +207,50 @@
  * Pixel data are stored as one-byte values starting from the upper
  * left and traversing the top row before returning to the left of
  * the second row, and so forth.  No padding should be used.
+ * Packed pixel data (see pack_photo) start with the offset within img 
+ * of each band of rows packed by photo_pack, followed by the offset of
+ * the end of the last band, all as uint32_t; the bands come after.
+ * Tiled pixel data (see tile_photo) hold the tiles of each row of tiles
+ * from left to right, and the rows of tiles from top to bottom; the
+ * tiles on the right and bottom edges are padded to full size.
+ * Planar pixel data (see plane_photo) hold four images, one for each
+ * mode X plane: plane k holds the pixels whose x is k modulo 4, in row
+ * order, with each row padded to (width + 3) / 4 pixels.
+ * A preview (see load_preview) maps each pixel to one of 64 fixed 2:2:2
+ * colors at the start of the palette.
+ * A streamed photo (see stream_photo) has no pixel data in img; its 
+ * pixels are mapped to the palette a tile at a time when drawn (see 
+ * photo_tile).
  */
 struct photo_t {
-    photo_header_t hdr;			/* defines height and width */
-    uint8_t        palette[192][3];     /* optimized palette colors */
-    uint8_t*       img;                 /* pixel data               */
+    photo_header_t      hdr;		/* defines height and width */
+    uint8_t             palette[192][3];/* optimized palette colors */
+    uint8_t*            img;            /* pixel data               */
+    photo_cache_entry_t cache;		/* cache mapping holding    */
+    					/*   img (map NULL if none) */
+    photo_quant_stats_t quant;		/* costs of quantizing img  */
+    					/*   (quantizer NULL if not */
+    					/*   quantized)             */
+    photo_load_stats_t  load;		/* what loading img read    */
+    uint32_t            packed_len;	/* bytes in img if packed,  */
+    					/*   or 0 if not packed     */
+    int32_t             tiled;		/* 1 if img is in tiles     */
+    int32_t             planar;		/* 1 if img is in planes    */
+    struct photo_stream_t* stream;	/* source of tiles if       */
+    					/*   streamed, or NULL      */
+    int32_t             preview;	/* 1 if img and palette are */
+    					/*   a 2:2:2 preview        */
+    int32_t             keep;		/* 1 if data are kept until */
+    					/*   exit (see photo_alloc) */
+    photo_t*            full;		/* full photo loaded to     */
+    					/*   replace preview, or    */
+    					/*   NULL                   */
+    /* fields used only for photos opened lazily with open_photo */
+    char*               fname;		/* file name (NULL if eager)*/
+    uint32_t            last_use;	/* use_clock at last use    */
+    int32_t             loading;	/* 1 while being loaded     */
+    uint32_t            want_gen;	/* last prefetch request    */
+    photo_t*            lazy_next;	/* list of all lazy photos  */
 };
 
 /* 
@@ -69,13 +261,260 @@ struct photo_t {
  * pixel data are stored as one-byte values starting from the upper 
  * left and traversing the top row before returning to the left of the 
  * second row, and so forth.  No padding is used.
+ *
+ * Images with the same contents are shared (see share_obj_image), so
+ * anything derived from the pixels is found once for each distinct 
+ * image.  All opaque pixels lie in the columns from left up to right
+ * and the rows from top up to bottom; the box is empty (top equal to
+ * bottom) if the image is entirely transparent.
+ *
+ * The opaque pixels of each row and of each column are also listed as 
+ * spans (see find_opaque_spans), so that they can be drawn without 
+ * checking every pixel for transparency.  The spans of row y are 
+ * spans[row_span[y]] up to spans[row_span[y + 1]], in order from left
+ * to right; those of column x are found in the same way from col_span.
  */
+typedef struct image_span_t image_span_t;
+struct image_span_t {
+    uint16_t start;			/* first column (or row)    */
+    uint16_t len;			/* length in pixels         */
+};
 struct image_t {
     photo_header_t hdr;			/* defines height and width */
     uint8_t*       img;                 /* pixel data               */
+    uint16_t       left;		/* first opaque column      */
+    uint16_t       right;		/* after last opaque column */
+    uint16_t       top;			/* first opaque row         */
+    uint16_t       bottom;		/* after last opaque row    */
+    image_span_t*  spans;		/* opaque spans of rows,    */
+    					/*   then of columns        */
+    uint32_t*      row_span;		/* first span of each row   */
+    uint32_t*      col_span;		/* first span of each col   */
+    uint32_t       hash;		/* hash of size and pixels  */
+    image_t*       hash_next;		/* next image in hash chain */
+};
+
+
+/* 
+ * The contents of a room photo file, as brought into memory by
+ * map_photo_file.  The data are normally mapped directly from the file;
+ * if mapping fails, they are instead read into a heap buffer.
+ */
+typedef struct photo_map_t photo_map_t;
+struct photo_map_t {
+    const uint8_t*  base;		/* start of file data          */
+    size_t          len;		/* length of file data         */
+    int32_t         mapped;		/* 1 if mmap'd, 0 if malloc'd  */
+    photo_header_t  hdr;		/* copy of header from file    */
+    const uint16_t* pixels;		/* 5:6:5 pixels in file order  */
+};
+
+
+/* 
+ * Dithering modes for mapping photo pixels to the palette.
+ *
+ * DITHER_NONE    each pixel gets the color chosen for its 5:6:5 value
+ * DITHER_FS      Floyd-Steinberg error diffusion (see dither_fs)
+ * DITHER_ORDERED 4x4 Bayer ordered dithering (see dither_ordered)
+ */
+typedef enum {
+    DITHER_NONE,
+    DITHER_FS,
+    DITHER_ORDERED,
+    N_DITHERS
+} dither_t;
+
+
+/* 
+ * Implementations of the masked blit used for object image rows (see 
+ * blit_masked), each using the instructions of those before it.
+ *
+ * BLIT_SCALAR one pixel at a time
+ * BLIT_SSE2   16 pixels at a time with SSE2
+ * BLIT_AVX2   32 pixels at a time with AVX2
+ */
+typedef enum {
+    BLIT_SCALAR,
+    BLIT_SSE2,
+    BLIT_AVX2,
+    N_BLITS
+} blit_t;
+
+
+/*
+ * The source of a streamed photo (see stream_photo): the mapped photo
+ * file, the dithering used for the photo, and the VGA color for each
+ * 5:6:5 color, with the palette arranged for dithering.
+ */
+typedef struct photo_stream_t photo_stream_t;
+struct photo_stream_t {
+    photo_map_t    map;			/* photo file in memory        */
+    dither_t       dither;		/* dithering mode              */
+    quant_lookup_t lookup;		/* palette for dithering       */
+    uint8_t        color_map[HIST_COLORS]; /* VGA color for each color */
+};
+
+/* 
+ * One part of the work of quantizing a photo on several threads (see
+ * run_quant_parts).  The parts of a photo cover disjoint ranges of 
+ * pixels when counting colors, or of rows when mapping pixels.
+ */
+typedef struct quant_part_t quant_part_t;
+struct quant_part_t {
+    photo_t*        p;		/* photo being quantized            */
+    const uint16_t* src;	/* 5:6:5 pixels in file order       */
+    const uint8_t*  color_map;	/* VGA color for each 5:6:5 color   */
+    uint32_t        (*colors)[HIST_COLORS]; /* histograms for part  */
+    size_t          first;	/* first pixel or row of part       */
+    size_t          end;	/* pixel or row after part          */
+};
+
+
+/* 
+ * The color histogram from which a photo's palette is chosen.  Each of 
+ * the 4096 level-4 octree nodes (4:4:4 RGB) has a pixel count and sums 
+ * of the 5:6:5 red, green, and blue fields of its pixels.  The fields are
+ * kept in separate arrays.  Counts fit in 32 bits, since a photo has at
+ * most 2^28 pixels (see stream_photo), but a sum of 6-bit fields over
+ * that many pixels does not, so the sums are 64-bit.
+ */
+typedef struct photo_hist_t photo_hist_t;
+struct photo_hist_t {
+    uint32_t count[4096];		/* pixels in node              */
+    uint64_t red[4096];			/* sum of 5-bit red values     */
+    uint64_t green[4096];		/* sum of 6-bit green values   */
+    uint64_t blue[4096];		/* sum of 5-bit blue values    */
+};
+
+/* 
+ * A room photo with the room's objects drawn over it, kept so that lines
+ * of the screen can be copied rather than composited (see 
+ * set_room_layer_budget).  Pixels are split into planes as in the photo
+ * if the photo is split into planes (see plane_photo), and are otherwise
+ * in row order with no padding.  Areas that objects entered or left 
+ * while the room was not on the screen are recorded in stale, and are
+ * composited again when the room is next entered.
+ */
+typedef struct room_layer_t room_layer_t;
+struct room_layer_t {
+    const room_t*  room;	/* room composited (NULL if unused)   */
+    const photo_t* photo;	/* photo composited                   */
+    int32_t        preview;	/* 1 if photo was shown as a preview  */
+    int32_t        planar;	/* 1 if pixels are split into planes  */
+    int32_t        width;	/* width of photo in pixels           */
+    int32_t        height;	/* height of photo in pixels          */
+    size_t         row_len;	/* bytes from one row to the next     */
+    uint32_t       last_use;	/* layer_clock at last entry          */
+    size_t         bytes;	/* size of pixels                     */
+    uint8_t*       pixels;	/* composited pixels                  */
+    int32_t        n_stale;	/* rectangles in stale                */
+    room_rect_t    stale[ROOM_DIRTY_RECTS]; /* areas out of date      */
 };
 
 
+/* functions local to this file--see function headers for details */
+static void* alloc_asset (size_t bytes);
+static blit_t best_blit (void);
+static void blit_masked (uint8_t* dst, const uint8_t* src, int32_t n);
+#if defined(HIST_SSE2)
+static int32_t blit_masked_avx2 (uint8_t* dst, const uint8_t* src, 
+				 int32_t n);
+static int32_t blit_masked_sse2 (uint8_t* dst, const uint8_t* src, 
+				 int32_t n);
+#endif
+static void build_color_map (const uint8_t node_color[4096], 
+			     uint8_t color_map[HIST_COLORS]);
+#if defined(HIST_SSE2)
+static void build_color_map_sse2 (const uint8_t node_color[4096], 
+				  uint8_t color_map[HIST_COLORS]);
+#endif
+static int32_t choose_palette (photo_t* p, uint32_t (*colors)[HIST_COLORS],
+			       uint8_t color_map[HIST_COLORS]);
+static void choose_quantizer (void);
+static void composite_layer (room_layer_t* l, int32_t left, int32_t right,
+			     int32_t top, int32_t bottom);
+static void compose_horiz (int x, int y, unsigned char buf[SCROLL_X_DIM]);
+static void count_colors (const uint16_t* pix, size_t n, 
+			  uint32_t (*colors)[HIST_COLORS]);
+static void count_colors_split (const uint16_t* pix, size_t n, 
+				uint32_t (*colors)[HIST_COLORS]);
+static void* count_part (void* arg);
+static void count_slots (photo_t* p, const uint8_t used[256]);
+static void dither_fs (photo_t* p, const uint16_t* src, 
+		       uint8_t color_map[HIST_COLORS]);
+static void dither_ordered (photo_t* p, const uint16_t* src, 
+			    uint8_t color_map[HIST_COLORS]);
+#if defined(HIST_SSE2)
+static void dither_ordered_sse2 (photo_t* p, const uint16_t* src, 
+				 uint8_t color_map[HIST_COLORS]);
+#endif
+static void drop_file_pages (const photo_map_t* map);
+static void drop_layer (room_layer_t* l);
+static uint32_t elapsed_usec (const struct timespec* from, 
+			      const struct timespec* to);
+static void enter_room_layer (const room_t* r);
+static void evict_photos (const photo_t* keep, size_t need, 
+			  int32_t spare_wanted);
+static void find_opaque_box (image_t* im);
+static int32_t find_opaque_spans (image_t* im);
+static void free_asset (void* ptr);
+static int32_t finish_refine (photo_t* p);
+static void free_photo_data (photo_t* p);
+static int32_t install_photo (photo_t* p, const photo_t* tmp, 
+			      int32_t spare_wanted);
+static size_t layer_offset (const room_layer_t* l, int32_t x, int32_t y);
+static int32_t load_cached_photo (photo_t* p, const char* fname);
+static int32_t load_photo (photo_t* p, const char* fname, int32_t keep);
+static int32_t load_preview (photo_t* p, const char* fname);
+static uint32_t line_spans (const uint8_t* px, uint16_t n, size_t step,
+			    image_span_t* spans);
+static uint8_t map_color (const quant_lookup_t* l, 
+			  uint8_t color_map[HIST_COLORS], uint16_t c);
+static int32_t map_photo_file (const char* fname, photo_map_t* map);
+static void merge_colors (uint32_t (*colors)[HIST_COLORS]);
+static uint8_t ordered_color (const quant_lookup_t* l, 
+			      uint8_t color_map[HIST_COLORS], 
+			      uint16_t c, int32_t t);
+static void pack_photo (photo_t* p);
+static int32_t park_full_photo (photo_t* p, const photo_t* tmp);
+static void plane_photo (photo_t* p);
+static void popular_palette (const uint32_t (*colors)[HIST_COLORS], 
+			     uint8_t palette[QUANT_PALETTE][3], 
+			     uint8_t color_map[HIST_COLORS]);
+static void* photo_alloc (const photo_t* p, size_t bytes);
+static size_t photo_bytes (const photo_t* p);
+static double photo_mse (const photo_t* p, const uint16_t* src);
+static size_t photo_plane_width (const photo_t* p);
+static const uint8_t* photo_row (const photo_t* p, int32_t y);
+static const uint8_t* photo_tile (const photo_t* p, int32_t tx, int32_t ty);
+static size_t photo_tiles_x (const photo_t* p);
+static int32_t prefetch_fits (const photo_t* p);
+static void* prefetch_thread (void* ignore);
+static void reduce_colors (const uint32_t (*colors)[HIST_COLORS],
+			   photo_hist_t* h);
+static void run_quant_parts (void* (*fn) (void*), quant_part_t* part, 
+			     int32_t n_parts);
+#if defined(HIST_SSE2)
+static void reduce_colors_sse2 (const uint32_t (*colors)[HIST_COLORS],
+				photo_hist_t* h);
+#endif
+static int32_t quant_part_count (size_t n_pixels);
+static void remap_part (photo_t* p, const uint16_t* src, 
+			const uint8_t color_map[HIST_COLORS], 
+			int32_t first, int32_t end);
+static void* remap_part_thread (void* arg);
+static void remap_split (photo_t* p, const uint16_t* src, 
+			 const uint8_t color_map[HIST_COLORS]);
+static void report_quant (photo_t* p, const char* fname);
+static void request_refine (photo_t* p);
+static int32_t select_top_nodes (const photo_hist_t* h, uint16_t top[128]);
+static int32_t start_prefetcher (void);
+static int32_t stream_photo (photo_t* p, const char* fname, 
+			     photo_map_t* map);
+static void tile_photo (photo_t* p);
+static void unmap_photo_file (photo_map_t* map);
+
+
 /* file-scope variables */
 
 /* 
@@ -86,6 +525,156 @@ struct image_t {
  */
 static const room_t* cur_room = NULL; 
 
+/*
+ * Residency management for photos opened with open_photo.  All such
+ * photos are linked through their lazy_next fields.  Pixel data are
+ * loaded on first use and kept until the total resident pixel data
+ * would exceed photo_budget, at which point the least recently used
+ * photos are unloaded.  The use_clock advances each time a photo is
+ * loaded or a photo other than the most recently used one is used, and
+ * each photo records the clock value at its last use.  A budget of 0 
+ * means no limit.  The last photo passed to photo_use (normally that of
+ * the room on the screen) is recorded in last_used_photo.
+ *
+ * Photos may also be loaded in advance by the prefetch thread (see 
+ * photo_prefetch).  Requests wait in prefetch_queue between 
+ * prefetch_head and prefetch_tail, and prefetch_gen counts requests so
+ * that the thread can tell when the player has moved on.  Each lazy 
+ * photo named in the latest request has want_gen equal to prefetch_gen;
+ * prefetching never unloads such photos to make room for others.
+ *
+ * A lazy photo used while not in memory is first shown as a preview,
+ * unless PREVIEW_ENV is 0, and the prefetch thread is asked to load the
+ * full photo through refine_wanted, ahead of any prefetch requests.
+ * The full photo is held in the full field of the photo until the 
+ * thread drawing the screen puts it in place (see finish_refine), since
+ * that thread may be drawing the preview in the meantime.
+ * prefetch_started is 1 while the thread runs, and -1 if it could not 
+ * be started or has stopped; prefetch_stop asks it to stop (see 
+ * release_photos).
+ *
+ * All of these variables and the loading, img, last_use, preview, and
+ * full fields of lazy photos are protected by photo_lock.  photo_cv is
+ * broadcast when a photo finishes loading; prefetch_cv is signaled when
+ * new requests arrive.  The entry_* counters record the time taken by
+ * prep_room.
+ */
+static photo_t*          lazy_photos = NULL;
+static size_t            photo_budget = 0;
+static uint32_t          use_clock = 0;
+static photo_t*          last_used_photo = NULL;
+static photo_lru_stats_t lru_stats;
+static photo_t*          prefetch_queue[PREFETCH_MAX];
+static int32_t           prefetch_head = 0;
+static int32_t           prefetch_tail = 0;
+static uint32_t          prefetch_gen = 0;
+static int32_t           prefetch_started = 0;
+static int32_t           prefetch_stop = 0;
+static photo_t*          refine_wanted = NULL;
+static pthread_mutex_t   photo_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t    photo_cv = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t    prefetch_cv = PTHREAD_COND_INITIALIZER;
+
+/* 
+ * The quantizer used for photo palettes, the dithering used when mapping
+ * pixels to them, whether to report on each photo quantized, whether
+ * to keep photo pixels packed (see PHOTO_PACK_ENV), tiled (see 
+ * PHOTO_TILE_ENV), or split into planes (see PHOTO_PLANE_ENV), 
+ * whether to show previews (see PREVIEW_ENV), and the number of threads
+ * that may quantize one photo (see QUANT_THREADS_ENV).  All are set from
+ * the environment by choose_quantizer, which is run once (see 
+ * quant_once).  quant_thread_limit, if not 0, further limits the threads
+ * (see set_photo_quant_threads).  The masked blit for object rows and 
+ * the span length below which it is used are chosen there as well (see
+ * OBJ_BLIT_ENV), or by set_obj_blit.
+ * The error of each photo quantized is measured if quant_report or 
+ * quant_stats (see set_photo_quant_stats) is set, and the palette slots
+ * used by each photo loaded are counted if load_stats is set (see
+ * set_photo_load_stats).
+ */
+static quantizer_t       quantizer = QUANT_POPULAR;
+static dither_t          dither = DITHER_NONE;
+static int32_t           quant_report = 0;
+static int32_t           quant_stats = 0;
+static int32_t           load_stats = 0;
+static pthread_once_t    quant_once = PTHREAD_ONCE_INIT;
+static int32_t           pack_photos = 0;
+static int32_t           tile_photos = 0;
+static int32_t           plane_photos = 0;
+static int32_t           previews_on = 1;
+static int32_t           quant_threads = 1;
+static int32_t           quant_thread_limit = 0;
+static blit_t            obj_blit = BLIT_SCALAR;
+static int32_t           obj_blit_span = OBJ_BLIT_SPAN;
+
+/* 
+ * Unpacked bands of packed photo pixels (see photo_row).  Band b of 
+ * band_photo, if unpacked, is held in slot b % BAND_SLOTS of 
+ * band_pixels, with rows the width of the photo, and band_tag records 
+ * which band each slot holds (-1 for none).  prep_room sets band_photo 
+ * to NULL, since the photo it names may since have been unloaded.  These
+ * are used only by the thread drawing the screen, as is showing_preview,
+ * which is 1 while the room on the screen is shown with a preview.
+ */
+static const photo_t* band_photo = NULL;
+static int32_t        band_tag[BAND_SLOTS];
+static uint8_t        band_pixels[BAND_SLOTS * BAND_ROWS * MAX_PHOTO_WIDTH];
+static int32_t        showing_preview = 0;
+
+/* 
+ * Tiles of streamed photos mapped to the palette (see photo_tile).  The
+ * tile of stream_shown in slot i of stream_tiles, if any, is recorded in
+ * stream_tag[i] as its index in row order (-1 for none); stream_mapped
+ * counts tiles mapped since pages of its file were last released.  These
+ * are used only by the thread drawing the screen.
+ */
+static const photo_t* stream_shown = NULL;
+static int32_t        stream_tag[STREAM_SLOTS];
+static uint8_t        stream_tiles[STREAM_SLOTS * TILE_PIXELS];
+static int32_t        stream_mapped = 0;
+
+/* 
+ * Composited room layers (see room_layer_t), kept within layer_budget
+ * bytes in all (0 turns them off) by dropping those of the rooms least
+ * recently entered; layer_clock counts room entries.  cur_layer is the
+ * layer of the room on the screen, or NULL if it has none.  These are
+ * used only by the thread drawing the screen, which also runs the 
+ * commands that move objects.
+ */
+static room_layer_t       layers[LAYER_SLOTS];
+static room_layer_t*      cur_layer = NULL;
+static size_t             layer_budget = 0;
+static uint32_t           layer_clock = 0;
+static room_layer_stats_t layer_stats;
+
+/* 
+ * Object images registered by share_obj_image, chained by hash_next 
+ * from slot hash % IMAGE_HASH_SLOTS.  Used only while building the 
+ * world, by one thread.
+ */
+static image_t* image_hash[IMAGE_HASH_SLOTS];
+
+/* names accepted in DITHER_ENV, indexed by dither_t */
+static const char* const dither_name[N_DITHERS] = {
+    "none", "fs", "ordered"
+};
+
+/* names accepted in OBJ_BLIT_ENV, indexed by blit_t */
+static const char* const blit_name[N_BLITS] = {
+    "scalar", "sse2", "avx2"
+};
+
+/* 
+ * Bayer threshold matrix for ordered dithering, indexed by row and
+ * column modulo 4.
+ */
+static const uint8_t bayer[4][4] = {
+    { 0,  8,  2, 10},
+    {12,  4, 14,  6},
+    { 3, 11,  1,  9},
+    {15,  7, 13,  5}
+};
+
 
 /* 
  * fill_horiz_buffer
@@ -95,7 +684,9 @@ static const room_t* cur_room = NULL;
  *                is represented as a single byte in the image.
  *
  *                Note that this routine draws both the room photo and
- *                the objects in the room.
+ *                the objects in the room.  If the room is kept 
+ *                composited (see room_layer_t), the line is copied from
+ *                the composited pixels.
  *
  *   INPUTS: (x,y) -- leftmost pixel of line to be drawn 
  *   OUTPUTS: buf -- buffer holding image data for the line
@@ -105,63 +696,457 @@ static const room_t* cur_room = NULL;
 void
 fill_horiz_buffer (int x, int y, unsigned char buf[SCROLL_X_DIM])
 {
-    int            idx;   /* loop index over pixels in the line          */ 
-    object_t*      obj;   /* loop index over objects in the current room */
-    int            imgx;  /* loop index over pixels in object image      */ 
-    int            yoff;  /* y offset into object image                  */ 
-    uint8_t        pixel; /* pixel from object image                     */
-    const photo_t* view;  /* room photo                                  */
-    int32_t        obj_x; /* object x position                           */
-    int32_t        obj_y; /* object y position                           */
-    const image_t* img;   /* object image                                */
+    int idx; /* loop index over pixels in the line */
+    int lo;  /* first pixel of line in photo       */
+    int hi;  /* pixel after last of line in photo  */
+
+    if (NULL == cur_layer) {
+        compose_horiz (x, y, buf);
+	return;
+    }
+    lo = (0 > x ? -x : 0);
+    hi = cur_layer->width - x;
+    if (0 > y || cur_layer->height <= y || SCROLL_X_DIM < lo) {
+        lo = SCROLL_X_DIM;
+    }
+    if (SCROLL_X_DIM < hi) {
+        hi = SCROLL_X_DIM;
+    }
+    if (lo > hi) {
+        hi = lo;
+    }
+    (void)memset (buf, 0, lo);
+    if (cur_layer->planar) {
+	for (idx = lo; hi > idx; idx++) {
+	    buf[idx] = cur_layer->pixels[layer_offset (cur_layer, x + idx, y)];
+	}
+    } else if (lo < hi) {
+	(void)memcpy (&buf[lo], 
+		      &cur_layer->pixels[layer_offset (cur_layer, x + lo, y)],
+		      hi - lo);
+    }
+    (void)memset (&buf[hi], 0, SCROLL_X_DIM - hi);
+}
+
+
+/* 
+ * compose_horiz
+ *   DESCRIPTION: Draw a line of the room on the screen from the room 
+ *                photo and the objects in the room, as described for
+ *                fill_horiz_buffer, whether or not the room is kept
+ *                composited.
+ *   INPUTS: (x,y) -- leftmost pixel of line to be drawn 
+ *   OUTPUTS: buf -- buffer holding image data for the line
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: may unpack a band of rows or map a tile of the photo 
+ *                 (see photo_row and photo_tile)
+ */
+static void
+compose_horiz (int x, int y, unsigned char buf[SCROLL_X_DIM])
+{
+    int               idx;  /* loop index over pixels in the line    */
+    const obj_draw_t* draw; /* objects in the current room           */
+    uint32_t          objs; /* objects that may cover the line       */
+    const obj_draw_t* obj;  /* loop index over those objects         */
+    const photo_t*    view; /* room photo                            */
+    const uint8_t*    row;  /* pixels of photo row, or of tile       */
+    int               n;    /* pixels of row copied from one tile    */
 
     /* Get pointer to current photo of current room. */
     view = room_photo (cur_room);
 
     /* Loop over pixels in line. */
-    for (idx = 0; idx < SCROLL_X_DIM; idx++) {
-        buf[idx] = (0 <= x + idx && view->hdr.width > x + idx ?
-		    view->img[view->hdr.width * y + x + idx] : 0);
+    if (view->tiled || NULL != view->stream) {
+	/* Copy the part of the line in each tile in turn. */
+	for (idx = 0; idx < SCROLL_X_DIM && 0 > x + idx; idx++) {
+	    buf[idx] = 0;
+	}
+	while (idx < SCROLL_X_DIM && view->hdr.width > x + idx) {
+	    n = TILE_SIZE - ((x + idx) & TILE_MASK);
+	    if (n > SCROLL_X_DIM - idx) {
+		n = SCROLL_X_DIM - idx;
+	    }
+	    if (n > view->hdr.width - (x + idx)) {
+		n = view->hdr.width - (x + idx);
+	    }
+	    row = photo_tile (view, (x + idx) >> TILE_BITS, y >> TILE_BITS);
+	    (void)memcpy (&buf[idx], &row[(y & TILE_MASK) * TILE_SIZE + 
+	    				  ((x + idx) & TILE_MASK)], n);
+	    idx += n;
+	}
+	for (; idx < SCROLL_X_DIM; idx++) {
+	    buf[idx] = 0;
+	}
+    } else if (view->planar) {
+	row = &view->img[photo_plane_width (view) * y];
+	for (idx = 0; idx < SCROLL_X_DIM; idx++) {
+	    buf[idx] = (0 <= x + idx && view->hdr.width > x + idx ?
+			row[((x + idx) & 3) * photo_plane_width (view) * 
+			    view->hdr.height + ((x + idx) >> 2)] : 0);
+	}
+    } else {
+	row = photo_row (view, y);
+	for (idx = 0; idx < SCROLL_X_DIM; idx++) {
+	    buf[idx] = (0 <= x + idx && view->hdr.width > x + idx ?
+			row[x + idx] : 0);
+	}
     }
 
-    /* Loop over objects in the current room. */
-    for (obj = room_contents_iterate (cur_room); NULL != obj;
-    	 obj = obj_next (obj)) {
-	obj_x = obj_get_x (obj);
-	obj_y = obj_get_y (obj);
-	img = obj_image (obj);
+    /* 
+     * Loop over the objects in the current room that may cover the row,
+     * in drawing order (see room_objects_on_row).
+     */
+    draw = room_objects (cur_room);
+    for (objs = room_objects_on_row (cur_room, y); 0 != objs; 
+    	 objs &= objs - 1) {
+	obj = &draw[__builtin_ctz (objs)];
 
-        /* Is object outside of the line we're drawing? */
-	if (y < obj_y || y >= obj_y + img->hdr.height ||
-	    x + SCROLL_X_DIM <= obj_x || x >= obj_x + img->hdr.width) {
+        /* 
+	 * Is object outside of the line we're drawing?  Only the box 
+	 * holding its opaque pixels matters.
+	 */
+	if (y < obj->top || y >= obj->bottom ||
+	    x + SCROLL_X_DIM <= obj->left || x >= obj->right) {
 	    continue;
 	}
 
-	/* The y offset of drawing is fixed. */
-	yoff = (y - obj_y) * img->hdr.width;
+	/* Copy the object's opaque pixels. */
+	draw_image_row (obj->img, y - obj->y, x - obj->x, buf);
+    }
+}
 
-	/* 
-	 * The x offsets depend on whether the object starts to the left
-	 * or to the right of the starting point for the line being drawn.
-	 */
-	if (x <= obj_x) {
-	    idx = obj_x - x;
-	    imgx = 0;
-	} else {
-	    idx = 0;
-	    imgx = x - obj_x;
+
+/* 
+ * draw_image_row
+ *   DESCRIPTION: Draw one row of an object image over a line buffer.  
+ *                The opaque pixels of the row are copied span by span
+ *                (see image_t), skipping transparent runs without 
+ *                looking at them.  A row broken into many short spans,
+ *                averaging fewer than obj_blit_span pixels each, is 
+ *                instead drawn with one masked blit from the start of 
+ *                its first span to the end of its last (see 
+ *                blit_masked).
+ *   INPUTS: im -- the image
+ *           row -- the row of the image (must be in the image)
+ *           start -- image column drawn at buf[0], which may be 
+ *                    negative or past the right edge of the image
+ *           buf -- buffer holding image data for the line
+ *   OUTPUTS: buf -- opaque pixels of the row drawn over it
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: none
+ */
+void
+draw_image_row (const image_t* im, int32_t row, int32_t start,
+		unsigned char buf[SCROLL_X_DIM])
+{
+    const uint8_t*      src;	/* pixels of the row         */
+    const image_span_t* span;	/* loop index over spans     */
+    const image_span_t* last;	/* span after last of row    */
+    int32_t             from;	/* first pixel drawn         */
+    int32_t             to;	/* pixel after last drawn    */
+
+    src = &im->img[row * im->hdr.width];
+    span = &im->spans[im->row_span[row]];
+    last = &im->spans[im->row_span[row + 1]];
+    if (last == span) {
+        return;
+    }
+
+    /* Blit rows broken into short spans as a whole. */
+    from = span->start;
+    to = last[-1].start + last[-1].len;
+    if (to - from < obj_blit_span * (last - span)) {
+	if (start > from) {
+	    from = start;
+	}
+	if (start + SCROLL_X_DIM < to) {
+	    to = start + SCROLL_X_DIM;
+	}
+	if (from < to) {
+	    blit_masked (&buf[from - start], &src[from], to - from);
+	}
+	return;
+    }
+
+    /* Otherwise, copy the spans that fall in the line. */
+    for (; last > span && start + SCROLL_X_DIM > span->start; span++) {
+	from = (start > span->start ? start : span->start);
+	to = span->start + span->len;
+	if (start + SCROLL_X_DIM < to) {
+	    to = start + SCROLL_X_DIM;
+	}
+	if (from < to) {
+	    (void)memcpy (&buf[from - start], &src[from], to - from);
+	}
+    }
+}
+
+
+/* 
+ * best_blit
+ *   DESCRIPTION: Find the fastest masked blit the processor can run.
+ *   INPUTS: none
+ *   OUTPUTS: none
+ *   RETURN VALUE: the blit
+ *   SIDE EFFECTS: none
+ */
+static blit_t
+best_blit ()
+{
+#if defined(HIST_SSE2)
+    if (__builtin_cpu_supports ("avx2")) {
+        return BLIT_AVX2;
+    }
+    if (__builtin_cpu_supports ("sse2")) {
+        return BLIT_SSE2;
+    }
+#endif
+    return BLIT_SCALAR;
+}
+
+
+/* 
+ * blit_masked
+ *   DESCRIPTION: Copy the opaque pixels of a run of object image pixels 
+ *                over a line buffer, leaving the buffer as it is under 
+ *                transparent pixels.  The bulk of the run is done with 
+ *                the vector instructions selected by obj_blit (see 
+ *                OBJ_BLIT_ENV), and the rest one pixel at a time; the
+ *                result is the same either way.
+ *   INPUTS: dst -- first pixel of buffer to draw over
+ *           src -- first pixel of run
+ *           n -- pixels in run
+ *   OUTPUTS: dst -- opaque pixels copied
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: none
+ */
+static void
+blit_masked (uint8_t* dst, const uint8_t* src, int32_t n)
+{
+    int32_t i = 0;	/* index over pixels */
+
+#if defined(HIST_SSE2)
+    if (BLIT_AVX2 == obj_blit) {
+	i = blit_masked_avx2 (dst, src, n);
+    } else if (BLIT_SSE2 == obj_blit) {
+	i = blit_masked_sse2 (dst, src, n);
+    }
+#endif
+    for (; n > i; i++) {
+	if (OBJ_CLR_TRANSP != src[i]) {
+	    dst[i] = src[i];
+	}
+    }
+}
+
+
+#if defined(HIST_SSE2)
+/* 
+ * blit_masked_avx2
+ *   DESCRIPTION: Do as much of a masked blit as can be done 32 and then
+ *                16 pixels at a time, with AVX2.  The pixels of each 
+ *                block are compared with OBJ_CLR_TRANSP all at once, and
+ *                the comparison selects between the buffer and the 
+ *                image for each byte.
+ *   INPUTS: dst -- first pixel of buffer to draw over
+ *           src -- first pixel of run
+ *           n -- pixels in run
+ *   OUTPUTS: dst -- opaque pixels copied, for the pixels done
+ *   RETURN VALUE: number of pixels done (n rounded down to a multiple 
+ *                 of 16)
+ *   SIDE EFFECTS: none
+ */
+__attribute__ ((target ("avx2")))
+static int32_t
+blit_masked_avx2 (uint8_t* dst, const uint8_t* src, int32_t n)
+{
+    __m256i transp;	/* OBJ_CLR_TRANSP in every byte */
+    __m256i pix;	/* 32 pixels of image           */
+    __m128i pix16;	/* 16 pixels of image           */
+    __m128i keep16;	/* buffer pixels to keep        */
+    int32_t i;		/* index over pixels            */
+
+    transp = _mm256_set1_epi8 (OBJ_CLR_TRANSP);
+
+    for (i = 0; n - 32 >= i; i += 32) {
+	pix = _mm256_loadu_si256 ((const __m256i*)&src[i]);
+	_mm256_storeu_si256 ((__m256i*)&dst[i], _mm256_blendv_epi8 
+			     (pix, _mm256_loadu_si256 ((__m256i*)&dst[i]),
+			      _mm256_cmpeq_epi8 (pix, transp)));
+    }
+    if (n - 16 >= i) {
+	pix16 = _mm_loadu_si128 ((const __m128i*)&src[i]);
+	keep16 = _mm_cmpeq_epi8 (pix16, _mm256_castsi256_si128 (transp));
+	_mm_storeu_si128 ((__m128i*)&dst[i], _mm_blendv_epi8 
+			  (pix16, _mm_loadu_si128 ((__m128i*)&dst[i]), 
+			   keep16));
+	i += 16;
+    }
+    return i;
+}
+
+
+/* 
+ * blit_masked_sse2
+ *   DESCRIPTION: Do as much of a masked blit as can be done 16 pixels at
+ *                a time, with SSE2.  The pixels of each block are 
+ *                compared with OBJ_CLR_TRANSP all at once, and the 
+ *                comparison masks the image and buffer bytes that are
+ *                kept.
+ *   INPUTS: dst -- first pixel of buffer to draw over
+ *           src -- first pixel of run
+ *           n -- pixels in run
+ *   OUTPUTS: dst -- opaque pixels copied, for the pixels done
+ *   RETURN VALUE: number of pixels done (n rounded down to a multiple 
+ *                 of 16)
+ *   SIDE EFFECTS: none
+ */
+__attribute__ ((target ("sse2")))
+static int32_t
+blit_masked_sse2 (uint8_t* dst, const uint8_t* src, int32_t n)
+{
+    __m128i transp;	/* OBJ_CLR_TRANSP in every byte */
+    __m128i pix;	/* 16 pixels of image           */
+    __m128i keep;	/* buffer pixels to keep        */
+    int32_t i;		/* index over pixels            */
+
+    transp = _mm_set1_epi8 (OBJ_CLR_TRANSP);
+    for (i = 0; n - 16 >= i; i += 16) {
+	pix = _mm_loadu_si128 ((const __m128i*)&src[i]);
+	keep = _mm_cmpeq_epi8 (pix, transp);
+	_mm_storeu_si128 ((__m128i*)&dst[i], _mm_or_si128 
+			  (_mm_and_si128 (keep, _mm_loadu_si128 
+					  ((__m128i*)&dst[i])),
+			   _mm_andnot_si128 (keep, pix)));
+    }
+    return i;
+}
+#endif /* defined(HIST_SSE2) */
+
+
+/* 
+ * fill_horiz_planes
+ *   DESCRIPTION: Given the (x,y) map pixel coordinate of the leftmost 
+ *                pixel of a line to be drawn on the screen, this routine
+ *                writes the line directly into the four mode X planes of
+ *                the build buffer, for a room photo split into planes 
+ *                (see plane_photo).  The part of the line in each plane 
+ *                is copied from the photo as one run, with zeros on 
+ *                either side, after which the objects in the room are 
+ *                drawn over it.  If the room is kept composited (see 
+ *                room_layer_t), the run is copied from the composited
+ *                pixels instead, which hold the objects already.
+ *                Pixel x + i of the line goes to
+ *                plane[(x + i) & 3][((x + i) >> 2) - (x >> 2)], as 
+ *                draw_horiz_line would put it.
+ *   INPUTS: (x,y) -- leftmost pixel of line to be drawn 
+ *           plane -- address in the build buffer of column x >> 2 of
+ *                    the line in each plane
+ *   OUTPUTS: the line, written through plane
+ *   RETURN VALUE: 0 on success, or -1 (with nothing written) if the
+ *                 room photo is not split into planes
+ *   SIDE EFFECTS: none
+ */
+int
+fill_horiz_planes (int x, int y, unsigned char* plane[4])
+{
+    int                 k;     /* loop index over planes                 */
+    int                 first; /* first pixel of line in plane           */
+    int                 lo;    /* first pixel in plane inside photo      */
+    int                 hi;    /* pixel in plane after last inside photo */
+    unsigned char*      dst;   /* first pixel of line in plane           */
+    const uint8_t*      src;   /* row of plane in photo                  */
+    int                 idx;   /* loop index over pixels in the line     */
+    const obj_draw_t*   draw;  /* objects in the current room            */
+    uint32_t            objs;  /* objects that may cover the line        */
+    const obj_draw_t*   obj;   /* loop index over those objects          */
+    int                 imgx;  /* loop index over pixels in object image */
+    int                 yoff;  /* y offset into object image             */
+    int                 start; /* first image pixel in the line          */
+    const image_span_t* span;  /* loop index over spans of object line   */
+    const image_span_t* last;  /* span after last of object line         */
+    int                 from;  /* first pixel of span drawn              */
+    int                 to;    /* pixel after last of span drawn         */
+    const photo_t*      view;  /* room photo                             */
+    const image_t*      img;   /* object image                           */
+
+    /* Get pointer to current photo of current room. */
+    view = room_photo (cur_room);
+    if (!view->planar) {
+        return -1;
+    }
+
+    /* 
+     * Each plane holds SCROLL_X_DIM / 4 pixels of the line, starting 
+     * with pixel first of the line.  Those from lo up to hi are in the
+     * photo; the rest are 0.
+     */
+    for (k = 0; 4 > k; k++) {
+	first = x + ((k - x) & 3);
+	dst = plane[k] + ((first >> 2) - (x >> 2));
+	lo = (0 > first ? (3 - first) >> 2 : 0);
+	hi = (view->hdr.width > first ? 
+	      (view->hdr.width - first + 3) >> 2 : 0);
+	if (0 > y || view->hdr.height <= y || SCROLL_X_DIM / 4 < lo) {
+	    lo = hi = SCROLL_X_DIM / 4;
+	}
+	if (SCROLL_X_DIM / 4 < hi) {
+	    hi = SCROLL_X_DIM / 4;
+	}
+	if (lo > hi) {
+	    hi = lo;
 	}
+	src = &(NULL != cur_layer ? cur_layer->pixels : view->img)
+	       [(k * view->hdr.height + y) * photo_plane_width (view) + 
+		(first >> 2)];
+	(void)memset (dst, 0, lo);
+	(void)memcpy (&dst[lo], &src[lo], hi - lo);
+	(void)memset (&dst[hi], 0, SCROLL_X_DIM / 4 - hi);
+    }
+    if (NULL != cur_layer) {
+        return 0;
+    }
+
+    /* 
+     * Loop over the objects in the current room that may cover the row,
+     * in drawing order (see room_objects_on_row).
+     */
+    draw = room_objects (cur_room);
+    for (objs = room_objects_on_row (cur_room, y); 0 != objs; 
+    	 objs &= objs - 1) {
+	obj = &draw[__builtin_ctz (objs)];
+	img = obj->img;
 
-	/* Copy the object's pixel data. */
-	for (; SCROLL_X_DIM > idx && img->hdr.width > imgx; idx++, imgx++) {
-	    pixel = img->img[yoff + imgx];
+        /* 
+	 * Is object outside of the line we're drawing?  Only the box 
+	 * holding its opaque pixels matters.
+	 */
+	if (y < obj->top || y >= obj->bottom ||
+	    x + SCROLL_X_DIM <= obj->left || x >= obj->right) {
+	    continue;
+	}
 
-	    /* Don't copy transparent pixels. */
-	    if (OBJ_CLR_TRANSP != pixel) {
-		buf[idx] = pixel;
+	/* 
+	 * Copy the spans of opaque pixels in the object's row that fall in
+	 * the line into the planes, as in fill_horiz_buffer.
+	 */
+	yoff = (y - obj->y) * img->hdr.width;
+	start = x - obj->x;
+	last = &img->spans[img->row_span[y - obj->y + 1]];
+	for (span = &img->spans[img->row_span[y - obj->y]]; 
+	     last > span && start + SCROLL_X_DIM > span->start; span++) {
+	    from = (start > span->start ? start : span->start);
+	    to = span->start + span->len;
+	    if (start + SCROLL_X_DIM < to) {
+		to = start + SCROLL_X_DIM;
+	    }
+	    for (imgx = from; to > imgx; imgx++) {
+		idx = x + imgx - start;
+		plane[idx & 3][(idx >> 2) - (x >> 2)] = img->img[yoff + imgx];
 	    }
 	}
     }
+    return 0;
 }
 
 
@@ -173,7 +1158,9 @@ fill_horiz_buffer (int x, int y, unsigned char buf[SCROLL_X_DIM])
  *                is represented as a single byte in the image.
  *
  *                Note that this routine draws both the room photo and
- *                the objects in the room.
+ *                the objects in the room.  If the room is kept 
+ *                composited (see room_layer_t), the line is copied from
+ *                the composited pixels.
  *
  *   INPUTS: (x,y) -- top pixel of line to be drawn 
  *   OUTPUTS: buf -- buffer holding image data for the line
@@ -183,60 +1170,114 @@ fill_horiz_buffer (int x, int y, unsigned char buf[SCROLL_X_DIM])
 void
 fill_vert_buffer (int x, int y, unsigned char buf[SCROLL_Y_DIM])
 {
-    int            idx;   /* loop index over pixels in the line          */ 
-    object_t*      obj;   /* loop index over objects in the current room */
-    int            imgy;  /* loop index over pixels in object image      */ 
-    int            xoff;  /* x offset into object image                  */ 
-    uint8_t        pixel; /* pixel from object image                     */
-    const photo_t* view;  /* room photo                                  */
-    int32_t        obj_x; /* object x position                           */
-    int32_t        obj_y; /* object y position                           */
-    const image_t* img;   /* object image                                */
+    int                 idx;   /* loop index over pixels in the line     */
+    const obj_draw_t*   draw;  /* objects in the current room            */
+    uint32_t            objs;  /* objects that may cover the line        */
+    const obj_draw_t*   obj;   /* loop index over those objects          */
+    int                 imgy;  /* loop index over pixels in object image */
+    int                 xoff;  /* x offset into object image             */
+    int                 start; /* first image pixel in the line          */
+    const image_span_t* span;  /* loop index over spans of object line   */
+    const image_span_t* last;  /* span after last of object line         */
+    int                 from;  /* first pixel of span drawn              */
+    int                 to;    /* pixel after last of span drawn         */
+    const photo_t*      view;  /* room photo                             */
+    const uint8_t*      row;   /* pixels of photo row                    */
+    const image_t*      img;   /* object image                           */
+
+    /* Copy the line from the composited room if there is one. */
+    if (NULL != cur_layer) {
+	for (idx = 0; idx < SCROLL_Y_DIM; idx++) {
+	    buf[idx] = (0 <= x && cur_layer->width > x && 0 <= y + idx && 
+			cur_layer->height > y + idx ?
+			cur_layer->pixels[layer_offset (cur_layer, x, y + idx)]
+			: 0);
+	}
+	return;
+    }
 
     /* Get pointer to current photo of current room. */
     view = room_photo (cur_room);
 
-    /* Loop over pixels in line. */
+    /* 
+     * Loop over pixels in line.  Rows in the same tile, or in the same
+     * band of BAND_ROWS if the photo is not tiled, are a fixed distance
+     * apart in memory, so the position of the pixel in a row is found 
+     * only at the start of each tile or band (see photo_row).  All rows
+     * of a plane are a fixed distance apart.
+     */
+    row = NULL;
     for (idx = 0; idx < SCROLL_Y_DIM; idx++) {
-        buf[idx] = (0 <= y + idx && view->hdr.height > y + idx ?
-		    view->img[view->hdr.width * (y + idx) + x] : 0);
+	if (0 > y + idx || view->hdr.height <= y + idx) {
+	    buf[idx] = 0;
+	    continue;
+	}
+	if (view->tiled || NULL != view->stream) {
+	    if (NULL == row || 0 == ((y + idx) & TILE_MASK)) {
+		row = &photo_tile (view, x >> TILE_BITS, 
+				   (y + idx) >> TILE_BITS)
+			[((y + idx) & TILE_MASK) * TILE_SIZE];
+	    } else {
+		row += TILE_SIZE;
+	    }
+	    buf[idx] = row[x & TILE_MASK];
+	} else if (view->planar) {
+	    if (NULL == row) {
+		row = &view->img[(x & 3) * photo_plane_width (view) * 
+				 view->hdr.height + 
+				 photo_plane_width (view) * (y + idx) + 
+				 (x >> 2)];
+	    } else {
+		row += photo_plane_width (view);
+	    }
+	    buf[idx] = *row;
+	} else {
+	    if (NULL == row || 0 == (y + idx) % BAND_ROWS) {
+		row = photo_row (view, y + idx);
+	    } else {
+		row += view->hdr.width;
+	    }
+	    buf[idx] = row[x];
+	}
     }
 
-    /* Loop over objects in the current room. */
-    for (obj = room_contents_iterate (cur_room); NULL != obj;
-    	 obj = obj_next (obj)) {
-	obj_x = obj_get_x (obj);
-	obj_y = obj_get_y (obj);
-	img = obj_image (obj);
+    /* 
+     * Loop over the objects in the current room that may cover the 
+     * column, in drawing order (see room_objects_on_col).
+     */
+    draw = room_objects (cur_room);
+    for (objs = room_objects_on_col (cur_room, x); 0 != objs; 
+    	 objs &= objs - 1) {
+	obj = &draw[__builtin_ctz (objs)];
+	img = obj->img;
 
-        /* Is object outside of the line we're drawing? */
-	if (x < obj_x || x >= obj_x + img->hdr.width ||
-	    y + SCROLL_Y_DIM <= obj_y || y >= obj_y + img->hdr.height) {
+        /* 
+	 * Is object outside of the line we're drawing?  Only the box 
+	 * holding its opaque pixels matters.
+	 */
+	if (x < obj->left || x >= obj->right ||
+	    y + SCROLL_Y_DIM <= obj->top || y >= obj->bottom) {
 	    continue;
 	}
 
-	/* The x offset of drawing is fixed. */
-	xoff = x - obj_x;
-
 	/* 
-	 * The y offsets depend on whether the object starts below or 
-	 * above the starting point for the line being drawn.
+	 * Copy the spans of opaque pixels in the object's column that fall
+	 * in the line, which holds image rows start up to start plus 
+	 * SCROLL_Y_DIM.  Transparent pixels are skipped without looking
+	 * at them.
 	 */
-	if (y <= obj_y) {
-	    idx = obj_y - y;
-	    imgy = 0;
-	} else {
-	    idx = 0;
-	    imgy = y - obj_y;
-	}
-
-	/* Copy the object's pixel data. */
-	for (; SCROLL_Y_DIM > idx && img->hdr.height > imgy; idx++, imgy++) {
-	    pixel = img->img[xoff + img->hdr.width * imgy];
-
-	    /* Don't copy transparent pixels. */
-	    if (OBJ_CLR_TRANSP != pixel) {
-		buf[idx] = pixel;
+	xoff = x - obj->x;
+	start = y - obj->y;
+	last = &img->spans[img->col_span[xoff + 1]];
+	for (span = &img->spans[img->col_span[xoff]]; 
+	     last > span && start + SCROLL_Y_DIM > span->start; span++) {
+	    from = (start > span->start ? start : span->start);
+	    to = span->start + span->len;
+	    if (start + SCROLL_Y_DIM < to) {
+		to = start + SCROLL_Y_DIM;
+	    }
+	    for (imgy = from; to > imgy; imgy++) {
+		buf[imgy - start] = img->img[xoff + img->hdr.width * imgy];
 	    }
 	}
     }
@@ -272,9 +1313,30 @@ image_width (const image_t* im)
     return im->hdr.width;
 }
 
+
 /* 
- * photo_height
- *   DESCRIPTION: Get height of room photo in pixels.
+ * image_opaque_box
+ *   DESCRIPTION: Get the box holding the opaque pixels of an object image
+ *                (see find_opaque_box).
+ *   INPUTS: im -- object image pointer
+ *   OUTPUTS: left, right -- columns of the box, [left,right)
+ *            top, bottom -- rows of the box, [top,bottom)
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: none
+ */
+void
+image_opaque_box (const image_t* im, int32_t* left, int32_t* right, 
+		  int32_t* top, int32_t* bottom)
+{
+    *left = im->left;
+    *right = im->right;
+    *top = im->top;
+    *bottom = im->bottom;
+}
+
+/* 
+ * photo_height
+ *   DESCRIPTION: Get height of room photo in pixels.
  *   INPUTS: p -- room photo pointer
  *   OUTPUTS: none
  *   RETURN VALUE: height of room photo p in pixels
@@ -302,409 +1364,3523 @@ photo_width (const photo_t* p)
 }
 
 
+/* 
+ * elapsed_usec
+ *   DESCRIPTION: Find the time between two readings of CLOCK_MONOTONIC.
+ *   INPUTS: from -- the earlier reading
+ *           to -- the later reading
+ *   OUTPUTS: none
+ *   RETURN VALUE: elapsed time in microseconds
+ *   SIDE EFFECTS: none
+ */
+static uint32_t
+elapsed_usec (const struct timespec* from, const struct timespec* to)
+{
+    return ((to->tv_sec - from->tv_sec) * 1000000 + 
+	    (to->tv_nsec - from->tv_nsec) / 1000);
+}
+
+
 /* 
  * prep_room
  *   DESCRIPTION: Prepare a new room for display.  You might want to set
  *                up the VGA palette registers according to the color
  *                palette that you chose for this room.
+ *                If the room's photo is not in memory, a preview may be
+ *                shown until the full photo is ready (see refine_room).
  *   INPUTS: r -- pointer to the new room
  *   OUTPUTS: none
  *   RETURN VALUE: none
- *   SIDE EFFECTS: changes recorded cur_room for this file
+ *   SIDE EFFECTS: changes recorded cur_room for this file; records the
+ *                 time taken, including any wait for the room's photo
+ *                 to load, in the entry counters returned by 
+ *                 get_photo_lru_stats
  */
 void
 prep_room (const room_t* r)
 {
+    struct timespec start;	/* time at entry            */
+    struct timespec end;	/* time photo became ready  */
+    uint32_t        usec;	/* elapsed time             */
+
+    (void)clock_gettime (CLOCK_MONOTONIC, &start);
+
     /* Record the current room. */
     cur_room = r;
+    band_photo = NULL;
 	photo_t* p = room_photo(r);
+
+    /* 
+     * Bring the photo into memory.  As the photo last used, it stays
+     * there until another room is entered, so the line fills need not
+     * check it again.
+     */
+    photo_use (p);
+
+    /* Use the full photo if it has replaced a preview by now. */
+    (void)pthread_mutex_lock (&photo_lock);
+    (void)finish_refine (p);
+    showing_preview = p->preview;
+    (void)pthread_mutex_unlock (&photo_lock);
+
     // set the palette based on this
     fill_palette(p->palette);
+
+    /* Find or composite the room's layer, if rooms are kept composited. */
+    enter_room_layer (r);
+
+    (void)clock_gettime (CLOCK_MONOTONIC, &end);
+    usec = elapsed_usec (&start, &end);
+    (void)pthread_mutex_lock (&photo_lock);
+    lru_stats.entries++;
+    lru_stats.entry_usec += usec;
+    if (lru_stats.entry_max_usec < usec) {
+	lru_stats.entry_max_usec = usec;
+    }
+    (void)pthread_mutex_unlock (&photo_lock);
 }
 
 
 /* 
- * read_obj_image
- *   DESCRIPTION: Read size and pixel data in 2:2:2 RGB format from a
- *                photo file and create an image structure from it.
- *   INPUTS: fname -- file name for input
+ * refine_room
+ *   DESCRIPTION: If the room on the screen is shown with a preview and
+ *                the full photo has since been loaded, put the full 
+ *                photo in place and set up the VGA palette for it.  
+ *                Otherwise the request for the full photo is repeated,
+ *                in case a later request replaced it.  Called once per
+ *                tick by the game loop, which must then redraw the room.
+ *   INPUTS: none
  *   OUTPUTS: none
- *   RETURN VALUE: pointer to newly allocated photo on success, or NULL
- *                 on failure
- *   SIDE EFFECTS: dynamically allocates memory for the image
+ *   RETURN VALUE: 1 if the room must be redrawn, 0 if not
+ *   SIDE EFFECTS: may replace the preview and change the VGA palette;
+ *                 may wake the prefetch thread
  */
-image_t*
-read_obj_image (const char* fname)
+int32_t
+refine_room ()
 {
-    FILE*    in;		/* input file               */
-    image_t* img = NULL;	/* image structure          */
-    uint16_t x;			/* index over image columns */
-    uint16_t y;			/* index over image rows    */
-    uint8_t  pixel;		/* one pixel from the file  */
+    photo_t* p;		/* photo of the room on the screen   */
+    int32_t  refined;	/* 1 if the full photo was put in place */
 
-    /* 
-     * Open the file, allocate the structure, read the header, do some
-     * sanity checks on it, and allocate space to hold the image pixels.
-     * If anything fails, clean up as necessary and return NULL.
-     */
-    if (NULL == (in = fopen (fname, "r+b")) ||
-	NULL == (img = malloc (sizeof (*img))) ||
-	NULL != (img->img = NULL) || /* false clause for initialization */
-	1 != fread (&img->hdr, sizeof (img->hdr), 1, in) ||
-	MAX_OBJECT_WIDTH < img->hdr.width ||
-	MAX_OBJECT_HEIGHT < img->hdr.height ||
-	NULL == (img->img = malloc 
-		 (img->hdr.width * img->hdr.height * sizeof (img->img[0])))) {
-	if (NULL != img) {
-	    if (NULL != img->img) {
-	        free (img->img);
-	    }
-	    free (img);
-	}
-	if (NULL != in) {
-	    (void)fclose (in);
-	}
-	return NULL;
+    if (!showing_preview) {
+        return 0;
+    }
+    p = room_photo (cur_room);
+    (void)pthread_mutex_lock (&photo_lock);
+    refined = finish_refine (p);
+    showing_preview = p->preview;
+    if (showing_preview && NULL == p->full) {
+	request_refine (p);
+    }
+    (void)pthread_mutex_unlock (&photo_lock);
+    if (!refined) {
+        return 0;
+    }
+    band_photo = NULL;
+    fill_palette (p->palette);
+    enter_room_layer (cur_room);
+    return 1;
+}
+
+
+/* 
+ * layer_offset
+ *   DESCRIPTION: Find a pixel of a composited room (see room_layer_t).
+ *   INPUTS: l -- the composited room
+ *           (x,y) -- the pixel, which must be in the room photo
+ *   OUTPUTS: none
+ *   RETURN VALUE: offset of the pixel in l->pixels
+ *   SIDE EFFECTS: none
+ */
+static size_t
+layer_offset (const room_layer_t* l, int32_t x, int32_t y)
+{
+    if (l->planar) {
+        return ((x & 3) * l->height + y) * l->row_len + (x >> 2);
     }
+    return y * l->row_len + x;
+}
 
-    /* 
-     * Loop over rows from bottom to top.  Note that the file is stored
-     * in this order, whereas in memory we store the data in the reverse
-     * order (top to bottom).
-     */
-    for (y = img->hdr.height; y-- > 0; ) {
 
-	/* Loop over columns from left to right. */
-	for (x = 0; img->hdr.width > x; x++) {
+/* 
+ * composite_layer
+ *   DESCRIPTION: Draw an area of the room on the screen, photo and 
+ *                objects, into the room's composited pixels, a line of
+ *                the screen at a time (see compose_horiz).
+ *   INPUTS: l -- the composited room, which must be cur_room
+ *           left, right -- columns of the area, [left,right)
+ *           top, bottom -- rows of the area, [top,bottom)
+ *   OUTPUTS: l -- area of pixels drawn (clipped to the photo)
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: as for compose_horiz
+ */
+static void
+composite_layer (room_layer_t* l, int32_t left, int32_t right, 
+		 int32_t top, int32_t bottom)
+{
+    unsigned char line[SCROLL_X_DIM]; /* line of the room          */
+    int32_t       x;		/* leftmost pixel of line          */
+    int32_t       y;		/* index over rows of area         */
+    int32_t       n;		/* pixels of line in area          */
+    int32_t       i;		/* index over pixels of line       */
 
-	    /* 
-	     * Try to read one 8-bit pixel.  On failure, clean up and 
-	     * return NULL.
-	     */
-	    if (1 != fread (&pixel, sizeof (pixel), 1, in)) {
-		free (img->img);
-		free (img);
-	        (void)fclose (in);
-		return NULL;
+    left = (0 > left ? 0 : left);
+    right = (l->width < right ? l->width : right);
+    top = (0 > top ? 0 : top);
+    bottom = (l->height < bottom ? l->height : bottom);
+    for (y = top; bottom > y; y++) {
+	for (x = left; right > x; x += SCROLL_X_DIM) {
+	    compose_horiz (x, y, line);
+	    n = (SCROLL_X_DIM < right - x ? SCROLL_X_DIM : right - x);
+	    if (l->planar) {
+		for (i = 0; n > i; i++) {
+		    l->pixels[layer_offset (l, x + i, y)] = line[i];
+		}
+	    } else {
+		(void)memcpy (&l->pixels[layer_offset (l, x, y)], line, n);
 	    }
-
-	    /* Store the pixel in the image data. */
-	    img->img[img->hdr.width * y + x] = pixel;
 	}
     }
+}
 
-    /* All done.  Return success. */
-    (void)fclose (in);
-    return img;
+
+/* 
+ * drop_layer
+ *   DESCRIPTION: Discard a composited room, freeing its slot.
+ *   INPUTS: l -- the composited room
+ *   OUTPUTS: l -- marked unused
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: frees memory; clears cur_layer if it is l
+ */
+static void
+drop_layer (room_layer_t* l)
+{
+    free (l->pixels);
+    l->pixels = NULL;
+    l->room = NULL;
+    layer_stats.resident_bytes -= l->bytes;
+    if (cur_layer == l) {
+        cur_layer = NULL;
+    }
 }
 
 
 /* 
- * read_photo
- *   DESCRIPTION: Read size and pixel data in 5:6:5 RGB format from a
- *                photo file and create a photo structure from it.
- *                Code provided simply maps to 2:2:2 RGB.  You must
- *                replace this code with palette color selection, and
- *                must map the image pixels into the palette colors that
- *                you have defined.
- *   INPUTS: fname -- file name for input
+ * enter_room_layer
+ *   DESCRIPTION: Make the composited layer of a room current as the room
+ *                is entered, or as its preview is replaced.  A layer 
+ *                kept from an earlier entry is used if it was composited
+ *                from the same photo, once areas that objects have since
+ *                entered or left are composited again; this is a hit.
+ *                Otherwise (a miss) the whole room is composited into a
+ *                new layer, after the layers of the rooms least recently
+ *                entered are dropped to keep within layer_budget.  A 
+ *                room too large for the budget has no layer.
+ *   INPUTS: r -- the room, which must be cur_room
  *   OUTPUTS: none
- *   RETURN VALUE: pointer to newly allocated photo on success, or NULL
- *                 on failure
- *   SIDE EFFECTS: dynamically allocates memory for the photo
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: sets cur_layer; may allocate and free memory
  */
-photo_t*
-read_photo (const char* fname)
+static void
+enter_room_layer (const room_t* r)
 {
-    FILE*    in;	/* input file               */
-    photo_t* p = NULL;	/* photo structure          */
-    uint16_t x;		/* index over image columns */
-    uint16_t y;		/* index over image rows    */
-    uint16_t pixel;	/* one pixel from the file  */
+    const photo_t* p = room_photo (r); /* room photo             */
+    room_layer_t*  l = NULL;	/* layer of the room               */
+    room_layer_t*  lru;		/* layer of room least recently in */
+    size_t         used;	/* bytes in other layers           */
+    size_t         bytes;	/* bytes needed for the layer      */
+    int32_t        i;		/* index over slots, areas         */
 
-    /* 
-     * Open the file, allocate the structure, read the header, do some
-     * sanity checks on it, and allocate space to hold the photo pixels.
-     * If anything fails, clean up as necessary and return NULL.
-     */
-    if (NULL == (in = fopen (fname, "r+b")) ||
-	NULL == (p = malloc (sizeof (*p))) ||
-	NULL != (p->img = NULL) || /* false clause for initialization */
-	1 != fread (&p->hdr, sizeof (p->hdr), 1, in) ||
-	MAX_PHOTO_WIDTH < p->hdr.width ||
-	MAX_PHOTO_HEIGHT < p->hdr.height ||
-	NULL == (p->img = malloc 
-		 (p->hdr.width * p->hdr.height * sizeof (p->img[0])))) {
-	if (NULL != p) {
-	    if (NULL != p->img) {
-	        free (p->img);
+    cur_layer = NULL;
+    if (0 == layer_budget) {
+        return;
+    }
+    for (i = 0; LAYER_SLOTS > i; i++) {
+	if (r == layers[i].room) {
+	    l = &layers[i];
+	}
+    }
+    if (NULL != l && (p != l->photo || showing_preview != l->preview ||
+		      p->planar != l->planar)) {
+	drop_layer (l);
+	l = NULL;
+    }
+    if (NULL != l) {
+	layer_stats.hits++;
+	for (i = 0; l->n_stale > i; i++) {
+	    composite_layer (l, l->stale[i].left, l->stale[i].right, 
+			     l->stale[i].top, l->stale[i].bottom);
+	}
+	l->n_stale = 0;
+	l->last_use = ++layer_clock;
+	cur_layer = l;
+	return;
+    }
+
+    layer_stats.misses++;
+    bytes = (p->planar ? 4 * photo_plane_width (p) : p->hdr.width) * 
+	    p->hdr.height;
+    if (layer_budget < bytes) {
+	layer_stats.too_large++;
+        return;
+    }
+    while (1) {
+	used = 0;
+	lru = NULL;
+	for (i = 0; LAYER_SLOTS > i; i++) {
+	    if (NULL == layers[i].room) {
+		l = &layers[i];
+		continue;
+	    }
+	    used += layers[i].bytes;
+	    if (NULL == lru || lru->last_use > layers[i].last_use) {
+		lru = &layers[i];
 	    }
-	    free (p);
 	}
-	if (NULL != in) {
-	    (void)fclose (in);
+	if (NULL != l && layer_budget - used >= bytes) {
+	    break;
 	}
-	return NULL;
+	drop_layer (lru);
+	layer_stats.evictions++;
+    }
+    if (NULL == (l->pixels = malloc (bytes))) {
+        return;
+    }
+    l->room = r;
+    l->photo = p;
+    l->preview = showing_preview;
+    l->planar = p->planar;
+    l->width = p->hdr.width;
+    l->height = p->hdr.height;
+    l->row_len = (p->planar ? photo_plane_width (p) : p->hdr.width);
+    l->last_use = ++layer_clock;
+    l->bytes = bytes;
+    l->n_stale = 0;
+    composite_layer (l, 0, l->width, 0, l->height);
+    layer_stats.resident_bytes += bytes;
+    if (layer_stats.peak_bytes < layer_stats.resident_bytes) {
+	layer_stats.peak_bytes = layer_stats.resident_bytes;
     }
+    cur_layer = l;
+}
 
 
+/* 
+ * update_room_layer
+ *   DESCRIPTION: Bring an area of a composited room up to date after an
+ *                object has entered or left the area.  The area is 
+ *                composited again at once if the room is on the screen,
+ *                and otherwise when the room is next entered.  Rooms not
+ *                kept composited are ignored.
+ *   INPUTS: r -- the room, with the object already added or removed
+ *           left, right -- columns of the area, [left,right)
+ *           top, bottom -- rows of the area, [top,bottom)
+ *   OUTPUTS: none
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: none
+ */
+void
+update_room_layer (const room_t* r, int32_t left, int32_t right, 
+		   int32_t top, int32_t bottom)
+{
+    room_layer_t* l;	/* index over layers            */
+    room_rect_t*  last;	/* last area recorded as stale  */
 
-//----------------------------------Pallete implementation----------------------------------//
-//Initialize struct for level 2 and level 4
-struct octree level2[64];
-struct octree level4[4096];
-int i,j;
-// sorted list used to store the list after qsort
-int sorted_list [4096];
-
-//------------------------------------Initialization--------------------------------//
-// build octree level 2, 64 is the octant number
-for (i = 0; i < 64; i++){ 
-	//node number
-	level2[i].node_number =i;
-	// counter for pixel loop
-	level2[i].pixel_loop_counter =0;
-	// sum of red color
-	level2[i].red_sum =0;
-	//sum of gree color
-	level2[i].green_sum =0;
-	// sum of blue color
-	level2[i].blue_sum =0;
-}
-
-// build octree level 4, 4096 is the octant number
-for (j = 0; j< 4096; j++){
-	//node number
-	level4[j].node_number =j;
-	// counter for pixel loop
-	level4[j].pixel_loop_counter =0;
-	// sum of red color
-	level4[j].red_sum =0;
-	//sum of gree color
-	level4[j].green_sum =0;
-	// sum of blue color
-	level4[j].blue_sum =0;
-	// also initialize sorted list
-	sorted_list[j] = 0;
-}
- 
-//------------------------------------read pixel routine--------------------------------//
-    /* 
-     * Loop over rows from bottom to top.  Note that the file is stored
-     * in this order, whereas in memory we store the data in the reverse
-     * order (top to bottom).
-     */
-    for (y = p->hdr.height; y-- > 0; ) {
+    for (l = layers; &layers[LAYER_SLOTS] > l && r != l->room; l++) {
+    }
+    if (&layers[LAYER_SLOTS] == l) {
+        return;
+    }
+    layer_stats.updates++;
+    if (cur_layer == l) {
+	composite_layer (l, left, right, top, bottom);
+	return;
+    }
+    if (ROOM_DIRTY_RECTS > l->n_stale) {
+	last = &l->stale[l->n_stale++];
+	last->left = left;
+	last->right = right;
+	last->top = top;
+	last->bottom = bottom;
+	return;
+    }
+    last = &l->stale[ROOM_DIRTY_RECTS - 1];
+    last->left = (last->left > left ? left : last->left);
+    last->right = (last->right < right ? right : last->right);
+    last->top = (last->top > top ? top : last->top);
+    last->bottom = (last->bottom < bottom ? bottom : last->bottom);
+}
 
-		/* Loop over columns from left to right. */
-		for (x = 0; p->hdr.width > x; x++) {
-			/* 
-			* Try to read one 16-bit pixel.  On failure, clean up and 
-			* return NULL.
-			*/
-			if (1 != fread (&pixel, sizeof (pixel), 1, in)) {
-			free (p->img);
-			free (p);
-				(void)fclose (in);
-			return NULL;
-			}
-
-//------------------------------------SUM ALL NODE ON IMAGE--------------------------------//
 
-	/* 
-	 * 16-bit pixel is coded as 5:6:5 RGB (5 bits red, 6 bits green,
-	 * and 6 bits blue).  We change to 2:2:2, which we've set for the
-	 * game objects.  You need to use the other 192 palette colors
-	 * to specialize the appearance of each photo.
-	 *
-	 * In this code, you need to calculate the p->palette values,
-	 * which encode 6-bit RGB as arrays of three uint8_t's.  When
-	 * the game puts up a photo, you should then change the palette 
-	 * to match the colors needed for that photo.
-	 p->img[p->hdr.width * y + x] = (((pixel >> 14) << 4) |(((pixel >> 9) & 0x3) << 2) |((pixel >> 3) & 0x3));*/
-	
-	// int level2_shift = (((pixel >> 14) << 4) | (((pixel >> 9) & 0x3) << 2) | ((pixel >> 3) & 0x3));
-	// // counter for pixel loop
-	// level2[level2_shift].pixel_loop_counter = level2[level2_shift].pixel_loop_counter + 1;
+/* 
+ * open_photo
+ *   DESCRIPTION: Create a photo structure whose pixel data are loaded
+ *                only when needed.  Only the header is checked now, so
+ *                the size of the photo is known immediately.  Use 
+ *                photo_use to bring the palette and pixels into memory
+ *                before drawing the photo; the pixels may be unloaded
+ *                again later to keep within the photo budget (see 
+ *                set_photo_budget).  A photo too large to hold in memory
+ *                is instead streamed (see stream_photo), as if created
+ *                by read_photo, and uses none of the budget.
+ *   INPUTS: fname -- file name for input
+ *   OUTPUTS: none
+ *   RETURN VALUE: pointer to newly allocated photo on success, or NULL
+ *                 on failure
+ *   SIDE EFFECTS: dynamically allocates memory for the photo structure
+ */
+photo_t*
+open_photo (const char* fname)
+{
+    photo_map_t map;	/* file contents (header used only) */
+    photo_t*    p;	/* photo structure                  */
 
-	// // sum of red color, red is located in "RRRRR" GGGGGGBBBBB, has to shift right 11 bit
-	// level2[level2_shift].red_sum += (red_blue_mask & (pixel >> 11));
+    if (0 != map_photo_file (fname, &map)) {
+        return NULL;
+    }
+    unmap_photo_file (&map);
+    if (MAX_PHOTO_WIDTH < map.hdr.width ||
+	MAX_PHOTO_HEIGHT < map.hdr.height) {
+        return read_photo (fname);
+    }
+    if (NULL == (p = alloc_asset (sizeof (*p)))) {
+	return NULL;
+    }
+    if (NULL == (p->fname = alloc_asset (strlen (fname) + 1))) {
+	free_asset (p);
+	return NULL;
+    }
+    (void)strcpy (p->fname, fname);
+    p->hdr = map.hdr;
+    p->img = NULL;
+    p->cache.map = NULL;
+    p->packed_len = 0;
+    p->tiled = 0;
+    p->planar = 0;
+    p->stream = NULL;
+    p->preview = 0;
+    p->full = NULL;
+    p->last_use = 0;
+    p->loading = 0;
+    p->want_gen = 0;
+    (void)pthread_mutex_lock (&photo_lock);
+    p->lazy_next = lazy_photos;
+    lazy_photos = p;
+    (void)pthread_mutex_unlock (&photo_lock);
+    return p;
+}
 
-	// //sum of gree color, green is located in RRRRR "GGGGGG" BBBBB, has to shift right 5 bit
-	// level2[level2_shift].green_sum +=(green_mask & (pixel >> 5));
 
-	// // sum of blue color, blue is located in RRRRRGGGGGG "BBBBB", no need to shift
-	// level2[level2_shift].blue_sum += (red_blue_mask & (pixel));
+/* 
+ * photo_use
+ *   DESCRIPTION: Make sure that a photo's palette and pixels are in 
+ *                memory, loading them if necessary, and mark the photo
+ *                as the most recently used.  Loading may unload the
+ *                least recently used photos to stay within the photo
+ *                budget; the most recently used photo itself is never
+ *                unloaded, so the pixels remain valid until photo_use
+ *                is called for another photo.  Unless PREVIEW_ENV is 0,
+ *                a photo not in memory is given a 2:2:2 preview at once
+ *                (see load_preview), and the prefetch thread is asked to
+ *                load the full photo, which replaces the preview only
+ *                in prep_room or refine_room.  Otherwise, if the 
+ *                prefetch thread is already loading the photo, waits 
+ *                for it to finish.  Photos created by read_photo are
+ *                always in memory and are ignored.
+ *   INPUTS: p -- the photo
+ *   OUTPUTS: none
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: may load p and unload other photos; updates the 
+ *                 statistics returned by get_photo_lru_stats; terminates
+ *                 the program if the photo can no longer be read
+ */
+void
+photo_use (photo_t* p)
+{
+    photo_t tmp;	/* photo data loaded outside of the lock */
+    int32_t new_use;	/* 1 if p was not the last photo used    */
 
-	int level4_shift = (((pixel >> 12) << 8) | (((pixel >> 7) & 0xF) << 4) | ((pixel >> 1) & 0xF));
-	// increment counter for pixel loop
-	level4[level4_shift].pixel_loop_counter ++;
+    if (NULL == p->fname) {
+        return;
+    }
+    (void)pthread_once (&quant_once, choose_quantizer);
+    (void)pthread_mutex_lock (&photo_lock);
+    new_use = (last_used_photo != p);
+    last_used_photo = p;
+    if (NULL == p->img && previews_on && start_prefetcher ()) {
+	/* 
+	 * Make a preview without holding the lock.  If the full photo 
+	 * is installed first, the preview is not needed.
+	 */
+	lru_stats.misses++;
+	lru_stats.previews++;
+	request_refine (p);
+	(void)pthread_mutex_unlock (&photo_lock);
+	if (0 != load_preview (&tmp, p->fname)) {
+	    PANIC ("can't reload room photo");
+	}
+	(void)pthread_mutex_lock (&photo_lock);
+	if (NULL == p->img) {
+	    (void)install_photo (p, &tmp, 0);
+	} else {
+	    free_photo_data (&tmp);
+	}
+	(void)pthread_mutex_unlock (&photo_lock);
+	return;
+    }
+    if (NULL == p->img && p->loading) {
+	lru_stats.prefetch_waits++;
+	do {
+	    (void)pthread_cond_wait (&photo_cv, &photo_lock);
+	} while (p->loading);
+    }
+    if (NULL != p->img) {
+	if (new_use) {
+	    lru_stats.hits++;
+	}
+	if (use_clock != p->last_use) {
+	    p->last_use = ++use_clock;
+	}
+	if (p->preview && NULL == p->full) {
+	    request_refine (p);
+	}
+	(void)pthread_mutex_unlock (&photo_lock);
+	return;
+    }
 
-	// sum of red color, red is located in "RRRRR" GGGGGGBBBBB, has to shift right 11 bit
-	level4[level4_shift].red_sum += (red_blue_mask & (pixel >> 11));
+    /* Load without holding the lock so that the prefetcher can run. */
+    lru_stats.misses++;
+    p->loading = 1;
+    (void)pthread_mutex_unlock (&photo_lock);
+    if (0 != load_photo (&tmp, p->fname, 0)) {
+	PANIC ("can't reload room photo");
+    }
+    (void)pthread_mutex_lock (&photo_lock);
+    (void)install_photo (p, &tmp, 0);
+    p->loading = 0;
+    (void)pthread_cond_broadcast (&photo_cv);
+    (void)pthread_mutex_unlock (&photo_lock);
+}
 
-	//sum of gree color, green is located in RRRRR "GGGGGG" BBBBB, has to shift right 5 bit
-	level4[level4_shift].green_sum +=(green_mask & (pixel >> 5));
 
-	// sum of blue color, blue is located in RRRRRGGGGGG "BBBBB", no need to shift
-	level4[level4_shift].blue_sum += (red_blue_mask & pixel);
+/* 
+ * photo_prefetch
+ *   DESCRIPTION: Ask the prefetch thread to load photos in the 
+ *                background, in the order given.  The list replaces any
+ *                photos still waiting from an earlier request.  To 
+ *                make room, prefetching unloads only photos not in the
+ *                list (least recently used first) and never the photo
+ *                last passed to photo_use; a photo that does not fit is
+ *                not loaded, nor is one whose request has been replaced
+ *                by the time it is loaded.  The prefetch thread is 
+ *                started on the first call.  Photos created by 
+ *                read_photo and photos already in memory are skipped.
+ *   INPUTS: list -- photos to be loaded
+ *           n -- number of photos in list
+ *   OUTPUTS: none
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: may start the prefetch thread
+ */
+void
+photo_prefetch (photo_t* const* list, int32_t n)
+{
+    int32_t i;		/* loop index over photos given  */
 
+    (void)pthread_mutex_lock (&photo_lock);
+    (void)start_prefetcher ();
+    prefetch_gen++;
+    prefetch_head = prefetch_tail = 0;
+    for (i = 0; 1 == prefetch_started && n > i && PREFETCH_MAX > i; i++) {
+	if (NULL != list[i] && NULL != list[i]->fname) {
+	    list[i]->want_gen = prefetch_gen;
+	    if (NULL == list[i]->img) {
+		prefetch_queue[prefetch_tail++] = list[i];
+	    }
 	}
+    }
+    (void)pthread_cond_signal (&prefetch_cv);
+    (void)pthread_mutex_unlock (&photo_lock);
 }
 
 
-//------------------------------------SORT (HIGH TO LOW ORDER)--------------------------------//
-// sort level 4
-
-/*
- * qsort
- *   DESCRIPTION: This function sort the level 4 array 
- *   INPUTS:  level4, size of level 4, size of octree, compare function
- *   OUTPUTS: sorted list
- *   RETURN VALUE: none
- *   SIDE EFFECTS: none
- */ 
-qsort(level4, 4096, sizeof(struct octree), compare_function );
+/* 
+ * start_prefetcher
+ *   DESCRIPTION: Start the prefetch thread if it has not yet been 
+ *                started.  The caller must hold photo_lock.
+ *   INPUTS: none
+ *   OUTPUTS: none
+ *   RETURN VALUE: 1 if the thread is running, 0 if it could not start
+ *   SIDE EFFECTS: may start the prefetch thread
+ */
+static int32_t
+start_prefetcher ()
+{
+    pthread_t tid;	/* id of prefetch thread */
 
-//------------------------------------Calculate AVG FOR LEVEL 4--------------------------------//
-// calculate avg for level 4
-// palette has RGB 6:6:6
-for (i = 0; i<128; i++){
-	if (level4[i].pixel_loop_counter != 0){
-		// red avg
-		p->palette[i][0]= (((level4[i].red_sum)   / (level4[i].pixel_loop_counter))<<1);
-		//gree avg
-		p->palette[i][1]= (level4[i].green_sum)  / (level4[i].pixel_loop_counter);
-		// blue avg
-		p->palette[i][2]= (((level4[i].blue_sum)  / (level4[i].pixel_loop_counter))<<1);		
-	}
-	else {
-		// unused palette assign 0
-		p->palette[i][0]= 0;
-		p->palette[i][1]= 0;
-		p->palette[i][2]= 0;	
-	}
+    if (0 == prefetch_started) {
+	prefetch_started = 
+		(0 == pthread_create (&tid, NULL, prefetch_thread, NULL) &&
+		 0 == pthread_detach (tid) ? 1 : -1);
+    }
+    return (1 == prefetch_started);
 }
 
 
-//------------------------------------NODE NUMBER 128 to 4096 SHIFT TO LEVEL 2--------------------------------//
-for (i=128; i<4096; i++){
-	if(level4[i].pixel_loop_counter != 0){
-		// level 2 has 64 node, so addr is 6-bit, RGB = 2:2:2
-		int addr = (((level4[i].node_number >> 10) & level2_mask) << 4) | (((level4[i].node_number >> 6) & level2_mask) << 2) | ((level4[i].node_number >> 2) & level2_mask);
-		// copy level 4 [128:4096] to level 2
-		level2[addr].pixel_loop_counter += level4[i].pixel_loop_counter;		
-		level2[addr].red_sum += level4[i].red_sum;
-		level2[addr].green_sum += level4[i].green_sum;
-		level2[addr].blue_sum += level4[i].blue_sum;
-	}
+/* 
+ * request_refine
+ *   DESCRIPTION: Ask the prefetch thread to load the full photo for a
+ *                photo with no pixels or only a preview, before any 
+ *                prefetch requests.  Only the latest such request is
+ *                kept; refine_room repeats the request for a preview 
+ *                still on the screen.  The caller must hold photo_lock.
+ *   INPUTS: p -- the photo
+ *   OUTPUTS: none
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: wakes the prefetch thread
+ */
+static void
+request_refine (photo_t* p)
+{
+    if (!p->loading) {
+	refine_wanted = p;
+	(void)pthread_cond_signal (&prefetch_cv);
+    }
 }
 
 
-//---------------------------CALCULATE AVG FOR LEVEL 2-------------------------//
-// calculate avg for level 2
-// palette has RGB 6:6:6
+/* 
+ * prefetch_thread
+ *   DESCRIPTION: Load photos requested with photo_prefetch or 
+ *                request_refine, one at a time, taking the latter 
+ *                first.  Loading happens without holding photo_lock;
+ *                photo_use waits for a photo being loaded here rather
+ *                than loading it a second time.  A full photo loaded
+ *                for a preview is left in the full field of the photo
+ *                (see park_full_photo and finish_refine).
+ *   INPUTS: none (ignored)
+ *   OUTPUTS: none
+ *   RETURN VALUE: NULL, once asked to stop by release_photos
+ *   SIDE EFFECTS: loads photos and may unload others
+ */
+static void*
+prefetch_thread (void* ignore)
+{
+    photo_t* p;		/* photo being loaded                    */
+    photo_t  tmp;	/* photo data loaded outside of the lock */
+    uint32_t gen;	/* request generation when load started  */
+    int32_t  ok;	/* 1 if the load succeeded               */
 
-for (i = 0; i<64; i++){
-	if (level2[i].pixel_loop_counter != 0){
-		// level 2 store in palette after level 4, so start at i+128
-		// 128 means first 128 color in palette is the occupied by level 4
-		p->palette[i+128][0]= ((level2[i].red_sum)   / (level2[i].pixel_loop_counter)<<1);
-		p->palette[i+128][1]= (level2[i].green_sum)  / (level2[i].pixel_loop_counter);
-		p->palette[i+128][2]= ((level2[i].blue_sum)  / (level2[i].pixel_loop_counter)<<1);		
+    (void)pthread_mutex_lock (&photo_lock);
+    while (1) {
+	while (!prefetch_stop && NULL == refine_wanted && 
+	       prefetch_head == prefetch_tail) {
+	    (void)pthread_cond_wait (&prefetch_cv, &photo_lock);
 	}
-	else {
-		// level 2 store in palette after level 4, so start at i+128
-		// 128 means first 128 color in palette is the occupied by level 4
-		p->palette[i+128][0]= 0;
-		p->palette[i+128][1]= 0;
-		p->palette[i+128][2]= 0;	
+	if (prefetch_stop) {
+	    break;
 	}
-}
-/*
- * fseek
- *   DESCRIPTION: This function reopen the file
- *   INPUTS:  in, sizeof(p->hdr), SEEK_SET
- *   OUTPUTS: none
- *   RETURN VALUE: none
- *   SIDE EFFECTS: none
- */ 
-fseek(in, sizeof(p->hdr), SEEK_SET);
+	if (NULL != refine_wanted) {
+	    p = refine_wanted;
+	    refine_wanted = NULL;
+	} else {
+	    p = prefetch_queue[prefetch_head++];
+	}
+	if ((NULL != p->img && !p->preview) || NULL != p->full || 
+	    p->loading) {
+	    continue;
+	}
+	if (!p->preview && !prefetch_fits (p)) {
+	    lru_stats.prefetch_drops++;
+	    continue;
+	}
+	p->loading = 1;
+	gen = prefetch_gen;
+	(void)pthread_mutex_unlock (&photo_lock);
 
-//------------------------------------read pixel routine--------------------------------//
-    /* 
-     * Loop over rows from bottom to top.  Note that the file is stored
-     * in this order, whereas in memory we store the data in the reverse
-     * order (top to bottom).
-     */
+	ok = (0 == load_photo (&tmp, p->fname, 0));
 
-	// loop over level 4 store node_number in sorted list. 
-	// node_number here represent the color in level4
-	// therefore, color are store same location(as they in level 4)
-	// but node value represent the order in palette
-	// we can use i to sort the order in palette
-	for (i=0; i<4096; i++){
-	sorted_list[level4[i].node_number] = i;
+	(void)pthread_mutex_lock (&photo_lock);
+	if (ok && p->preview) {
+	    /* The preview may be on the screen; leave it in place. */
+	    if (0 != park_full_photo (p, &tmp)) {
+		free_photo_data (&tmp);
+		lru_stats.prefetch_drops++;
+	    }
+	} else if (ok && 
+	    ((gen == prefetch_gen && 0 == install_photo (p, &tmp, 1)) ||
+	     (last_used_photo == p && 0 == install_photo (p, &tmp, 0)))) {
+	    lru_stats.prefetches++;
+	} else if (ok) {
+	    /* No room, or the player has moved on: discard the photo. */
+	    free_photo_data (&tmp);
+	    lru_stats.prefetch_drops++;
+	}
+	p->loading = 0;
+	(void)pthread_cond_broadcast (&photo_cv);
+    }
+    prefetch_started = -1;
+    (void)pthread_cond_broadcast (&photo_cv);
+    (void)pthread_mutex_unlock (&photo_lock);
+    return NULL;
 }
-    for (y = p->hdr.height; y-- > 0; ) {
 
-		/* Loop over columns from left to right. */
-		for (x = 0; p->hdr.width > x; x++) {
-			/* 
-			* Try to read one 16-bit pixel.  On failure, clean up and 
-			* return NULL.
-			*/
-			if (1 != fread (&pixel, sizeof (pixel), 1, in)) {
-			free (p->img);
-			free (p);
-				(void)fclose (in);
-			return NULL;}
-
-			// pixel = R:G:B = 5:6:5,we will shift to 4:4:4 for level 4 index
-			int addr = (pixel >> 12) << 8 ;
-				addr += ((pixel >> 7) & fourbit_mask) << 4;
-				addr += ((pixel >> 1) & fourbit_mask);
-			int idx = sorted_list[addr];
-			if ((level4[idx].pixel_loop_counter != 0)  && (idx < 128) ){	
-			// add 64 because first 64 is used
-			p->img[p->hdr.width*y + x] = 64 + (sorted_list[addr]);
-			}
-			else {
-			// pixel = R:G:B = 5:6:5, we will shift to 2:2:2 for level 2 index
-				addr = ((pixel >> 14) << 4);
-				addr += (((pixel >> 9)&level2_mask) << 2);
-				addr += ((pixel >> 3) & level2_mask);	
-			// add 64 and 128 because it was occupied
-			p->img[p->hdr.width*y + x] = 64 + 128 + addr;
-			}
-
-			
-			}
-		}
 
-/* All done.  Return success. */
-    (void)fclose (in);
+/* 
+ * prefetch_fits
+ *   DESCRIPTION: Check whether the prefetch thread could make room for
+ *                a photo without unloading any photo in the latest 
+ *                prefetch request or the photo last passed to 
+ *                photo_use, so that no time is spent loading photos that
+ *                would only be discarded.  The caller must hold 
+ *                photo_lock.
+ *   INPUTS: p -- the photo to be prefetched
+ *   OUTPUTS: none
+ *   RETURN VALUE: 1 if the photo would fit, 0 if not
+ *   SIDE EFFECTS: none
+ */
+static int32_t
+prefetch_fits (const photo_t* p)
+{
+    const photo_t* scan;	/* index over lazy photos       */
+    size_t         kept = 0;	/* bytes that can't be unloaded */
 
-    return p;
+    if (0 == photo_budget) {
+        return 1;
+    }
+    for (scan = lazy_photos; NULL != scan; scan = scan->lazy_next) {
+	if (NULL != scan->img && 
+	    (last_used_photo == scan || prefetch_gen == scan->want_gen)) {
+	    kept += photo_bytes (scan);
+	    if (NULL != scan->full) {
+		kept += photo_bytes (scan->full);
+	    }
+	}
+    }
+    return (photo_budget >= kept + photo_bytes (p));
 }
 
-/*
- * compare_function
- *   DESCRIPTION: This function compare the pixel_loop_counter of two node and return 1 if a is smaller than b
- * 				  -1 if a is larger than b , 0 if equal 
- *   INPUTS:  a -- pointer to node a
- * 			  B -- pointer to node b
- *   OUTPUTS: none
- *   RETURN VALUE: 1, -1, 0
- *   SIDE EFFECTS: 
- */ 
-int compare_function(const void *a, const void *b){
-	if ( (((struct octree*)b) -> pixel_loop_counter)  >  (((struct octree*)a) -> pixel_loop_counter ) )
-		return 1;
-	else if ( (((struct octree*)b) -> pixel_loop_counter)  <  (((struct octree*)a) -> pixel_loop_counter ) )
-		return -1;
-	else {
-		return 0;}
-		
-}
+
+/* 
+ * install_photo
+ *   DESCRIPTION: Give a lazily loaded photo the palette and pixels that
+ *                were loaded into a temporary structure, unloading the
+ *                least recently used photos first if necessary.  When
+ *                sparing wanted photos, the data are installed only if
+ *                they then fit within the photo budget.  The caller 
+ *                must hold photo_lock.
+ *   INPUTS: p -- the lazily loaded photo
+ *           tmp -- the data loaded for it
+ *           spare_wanted -- 1 to keep photos in the latest prefetch 
+ *                           request in memory, or 0 to ignore requests
+ *   OUTPUTS: p -- palette, pixels, and cache mapping filled in; marked
+ *                 as most recently used
+ *   RETURN VALUE: 0 if installed, -1 if not
+ *   SIDE EFFECTS: may unload other photos
+ */
+static int32_t
+install_photo (photo_t* p, const photo_t* tmp, int32_t spare_wanted)
+{
+    size_t size = photo_bytes (tmp); /* size of pixel data in bytes */
+
+    evict_photos (p, size, spare_wanted);
+    if (spare_wanted && 0 != photo_budget && 
+	photo_budget < lru_stats.resident_bytes + size) {
+        return -1;
+    }
+    (void)memcpy (p->palette, tmp->palette, sizeof (p->palette));
+    p->img = tmp->img;
+    p->cache = tmp->cache;
+    p->quant = tmp->quant;
+    p->load = tmp->load;
+    p->packed_len = tmp->packed_len;
+    p->tiled = tmp->tiled;
+    p->planar = tmp->planar;
+    p->stream = tmp->stream;
+    p->preview = tmp->preview;
+    lru_stats.resident_bytes += size;
+    if (lru_stats.peak_bytes < lru_stats.resident_bytes) {
+	lru_stats.peak_bytes = lru_stats.resident_bytes;
+    }
+    p->last_use = ++use_clock;
+    return 0;
+}
+
+
+/* 
+ * park_full_photo
+ *   DESCRIPTION: Keep the full photo loaded for a photo shown as a 
+ *                preview until finish_refine puts it in place, counting
+ *                it against the photo budget meanwhile.  The least 
+ *                recently used photos are unloaded to make room.  If
+ *                the player has left the room, the photo is kept only 
+ *                if it then fits without unloading photos in the latest
+ *                prefetch request, as for other prefetched photos.  The
+ *                caller must hold photo_lock.
+ *   INPUTS: p -- the photo with a preview
+ *           tmp -- the full photo loaded for it
+ *   OUTPUTS: p -- full filled in
+ *   RETURN VALUE: 0 if kept, -1 if not (the caller must free tmp's data)
+ *   SIDE EFFECTS: may unload other photos
+ */
+static int32_t
+park_full_photo (photo_t* p, const photo_t* tmp)
+{
+    size_t  size = photo_bytes (tmp); /* size of pixel data in bytes */
+    int32_t left = (last_used_photo != p); /* 1 if player has left  */
+
+    evict_photos (p, size, left);
+    if ((left && 0 != photo_budget && 
+	 photo_budget < lru_stats.resident_bytes + size) ||
+	NULL == (p->full = malloc (sizeof (*p->full)))) {
+        return -1;
+    }
+    *p->full = *tmp;
+    lru_stats.resident_bytes += size;
+    if (lru_stats.peak_bytes < lru_stats.resident_bytes) {
+	lru_stats.peak_bytes = lru_stats.resident_bytes;
+    }
+    return 0;
+}
+
+
+/* 
+ * evict_photos
+ *   DESCRIPTION: Unload the least recently used photos until another
+ *                need bytes of pixel data fit within the photo budget,
+ *                or until nothing else can be unloaded.  Neither keep
+ *                nor the photo last passed to photo_use is unloaded.
+ *                The caller must hold photo_lock.
+ *   INPUTS: keep -- photo that must not be unloaded
+ *           need -- number of bytes about to be loaded
+ *           spare_wanted -- 1 to keep photos in the latest prefetch
+ *                           request, or 0 to ignore requests
+ *   OUTPUTS: none
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: unloads photos
+ */
+static void
+evict_photos (const photo_t* keep, size_t need, int32_t spare_wanted)
+{
+    photo_t* scan;	/* index over lazy photos               */
+    photo_t* victim;	/* least recently used photo in memory  */
+
+    while (0 != photo_budget && 
+	   photo_budget < lru_stats.resident_bytes + need) {
+	victim = NULL;
+	for (scan = lazy_photos; NULL != scan; scan = scan->lazy_next) {
+	    if (keep != scan && last_used_photo != scan && 
+		NULL != scan->img &&
+		(!spare_wanted || prefetch_gen != scan->want_gen) &&
+		(NULL == victim || 
+		 (int32_t)(scan->last_use - victim->last_use) < 0)) {
+		victim = scan;
+	    }
+	}
+	if (NULL == victim) {
+	    return;
+	}
+	lru_stats.resident_bytes -= photo_bytes (victim);
+	free_photo_data (victim);
+	lru_stats.evictions++;
+    }
+}
+
+
+/* 
+ * free_photo_data
+ *   DESCRIPTION: Release the pixel data of a photo, along with any full
+ *                photo waiting to replace a preview, whose size is 
+ *                taken out of the resident bytes (see park_full_photo).
+ *                The header (and hence the photo size) remains valid.
+ *   INPUTS: p -- the photo
+ *   OUTPUTS: none
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: frees or unmaps the pixel data
+ */
+static void
+free_photo_data (photo_t* p)
+{
+    if (NULL != p->full) {
+	lru_stats.resident_bytes -= photo_bytes (p->full);
+	free_photo_data (p->full);
+	free (p->full);
+	p->full = NULL;
+    }
+    if (NULL != p->cache.map) {
+	photo_cache_release (&p->cache);
+    } else {
+	free_asset (p->img);
+    }
+    if (NULL != p->stream) {
+	if (stream_shown == p) {
+	    stream_shown = NULL;
+	}
+	unmap_photo_file (&p->stream->map);
+	free_asset (p->stream);
+	p->stream = NULL;
+    }
+    p->img = NULL;
+    p->packed_len = 0;
+    p->tiled = 0;
+    p->planar = 0;
+    p->preview = 0;
+}
+
+
+/* 
+ * alloc_asset
+ *   DESCRIPTION: Allocate memory to be kept until exit from the asset 
+ *                arena (see arena.c), or with calloc if the arena is off
+ *                or full.  Either way, the memory is zero-filled.
+ *   INPUTS: bytes -- size of block
+ *   OUTPUTS: none
+ *   RETURN VALUE: the block, or NULL on failure
+ *   SIDE EFFECTS: none
+ */
+static void*
+alloc_asset (size_t bytes)
+{
+    void* block;	/* block allocated */
+
+    if (NULL == (block = arena_alloc (bytes))) {
+	block = calloc (1, bytes);
+    }
+    return block;
+}
+
+
+/* 
+ * free_asset
+ *   DESCRIPTION: Free memory from alloc_asset, photo_alloc, or malloc.
+ *                Blocks in the arena are left in place until the whole
+ *                arena is released (see release_photos).
+ *   INPUTS: ptr -- the block (may be NULL)
+ *   OUTPUTS: none
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: none
+ */
+static void
+free_asset (void* ptr)
+{
+    if (!arena_owns (ptr)) {
+	free (ptr);
+    }
+}
+
+
+/* 
+ * photo_alloc
+ *   DESCRIPTION: Allocate zero-filled memory for a photo's data.  The 
+ *                data of photos read with read_photo are kept until exit,
+ *                so they come from the asset arena (see alloc_asset); 
+ *                those of photos opened lazily may be unloaded at any 
+ *                time, so they come from calloc.
+ *   INPUTS: p -- the photo
+ *           bytes -- size of block
+ *   OUTPUTS: none
+ *   RETURN VALUE: the block, or NULL on failure
+ *   SIDE EFFECTS: none
+ */
+static void*
+photo_alloc (const photo_t* p, size_t bytes)
+{
+    return (p->keep ? alloc_asset (bytes) : calloc (1, bytes));
+}
+
+
+/* 
+ * finish_refine
+ *   DESCRIPTION: Replace the preview of a photo with the full photo, if
+ *                the prefetch thread has loaded it.  Must be called only
+ *                from the thread drawing the screen, when the preview is
+ *                not being drawn.  The caller must hold photo_lock.
+ *   INPUTS: p -- the photo
+ *   OUTPUTS: p -- palette and pixels replaced, if the full photo was 
+ *                 ready
+ *   RETURN VALUE: 1 if replaced, 0 if not
+ *   SIDE EFFECTS: frees the preview
+ */
+static int32_t
+finish_refine (photo_t* p)
+{
+    photo_t* full = p->full;	/* the full photo */
+
+    if (NULL == full) {
+        return 0;
+    }
+    p->full = NULL;
+    lru_stats.resident_bytes -= photo_bytes (p) + photo_bytes (full);
+    free_photo_data (p);
+    (void)install_photo (p, full, 0);
+    free (full);
+    lru_stats.refines++;
+    return 1;
+}
+
+
+/* 
+ * photo_bytes
+ *   DESCRIPTION: Get the size of the pixel data of a photo.  The size 
+ *                of a photo not in memory is taken to be its size when
+ *                in row order.  A streamed photo holds its color map
+ *                and at most the tiles in stream_tiles.
+ *   INPUTS: p -- the photo
+ *   OUTPUTS: none
+ *   RETURN VALUE: size of the pixel data in bytes
+ *   SIDE EFFECTS: none
+ */
+static size_t
+photo_bytes (const photo_t* p)
+{
+    if (0 != p->packed_len) {
+        return p->packed_len;
+    }
+    if (p->tiled) {
+	return photo_tiles_x (p) * TILE_PIXELS * 
+	       ((p->hdr.height + TILE_MASK) >> TILE_BITS);
+    }
+    if (p->planar) {
+	return 4 * photo_plane_width (p) * p->hdr.height;
+    }
+    if (NULL != p->stream) {
+	return sizeof (*p->stream) + sizeof (stream_tiles);
+    }
+    return (size_t)p->hdr.width * p->hdr.height;
+}
+
+
+/* 
+ * photo_plane_width
+ *   DESCRIPTION: Get the number of pixels in each row of each plane of a
+ *                photo split into planes (see plane_photo), counting
+ *                padding on the right.
+ *   INPUTS: p -- the photo
+ *   OUTPUTS: none
+ *   RETURN VALUE: number of pixels
+ *   SIDE EFFECTS: none
+ */
+static size_t
+photo_plane_width (const photo_t* p)
+{
+    return (p->hdr.width + 3) >> 2;
+}
+
+
+/* 
+ * photo_tiles_x
+ *   DESCRIPTION: Get the number of tiles in each row of tiles of a photo
+ *                (see tile_photo), counting a partial tile on the right.
+ *   INPUTS: p -- the photo
+ *   OUTPUTS: none
+ *   RETURN VALUE: number of tiles
+ *   SIDE EFFECTS: none
+ */
+static size_t
+photo_tiles_x (const photo_t* p)
+{
+    return (p->hdr.width + TILE_MASK) >> TILE_BITS;
+}
+
+
+/* 
+ * photo_tile
+ *   DESCRIPTION: Find the pixels of one tile of a tiled or streamed 
+ *                photo, in row order.  For a streamed photo, the tile
+ *                is mapped to the palette into its slot in stream_tiles
+ *                unless it is already there (see STREAM_COLS), after 
+ *                releasing the pages of the photo file if STREAM_SLOTS
+ *                tiles have been mapped since they were last released.
+ *                Pixels padding the tiles on the right and bottom edges
+ *                are 0.  Must be called only from the thread drawing the
+ *                screen.
+ *   INPUTS: p -- the photo
+ *           (tx,ty) -- the tile, counted in tiles from the upper left
+ *   OUTPUTS: none
+ *   RETURN VALUE: pointer to the pixels of the tile, valid until a tile
+ *                 of another streamed photo, or another tile in the
+ *                 same slot, is needed
+ *   SIDE EFFECTS: may map a tile, replacing another in stream_tiles
+ */
+static const uint8_t*
+photo_tile (const photo_t* p, int32_t tx, int32_t ty)
+{
+    photo_stream_t* s = p->stream;	/* source of tiles             */
+    int32_t         tag;		/* tile index in row order     */
+    int32_t         slot;		/* slot for tile               */
+    uint8_t*        tile;		/* pixels of tile in slot      */
+    const uint16_t* src;		/* row of tile in file         */
+    int32_t         x;			/* left column of tile         */
+    int32_t         y;			/* index over image rows       */
+    int32_t         n;			/* columns of tile in photo    */
+    int32_t         i;			/* index over columns or slots */
+
+    if (NULL == s) {
+        return &p->img[(ty * photo_tiles_x (p) + tx) * TILE_PIXELS];
+    }
+    if (stream_shown != p) {
+	if (NULL != stream_shown) {
+	    drop_file_pages (&stream_shown->stream->map);
+	}
+	stream_shown = p;
+	stream_mapped = 0;
+	for (i = 0; STREAM_SLOTS > i; i++) {
+	    stream_tag[i] = -1;
+	}
+    }
+    tag = ty * photo_tiles_x (p) + tx;
+    slot = (ty % STREAM_ROWS) * STREAM_COLS + tx % STREAM_COLS;
+    tile = &stream_tiles[slot * TILE_PIXELS];
+    if (stream_tag[slot] == tag) {
+        return tile;
+    }
+    stream_tag[slot] = tag;
+    if (STREAM_SLOTS <= ++stream_mapped) {
+	drop_file_pages (&s->map);
+	stream_mapped = 0;
+    }
+
+    /* The file holds the rows from bottom to top. */
+    x = tx << TILE_BITS;
+    n = (p->hdr.width - x < TILE_SIZE ? p->hdr.width - x : TILE_SIZE);
+    for (y = ty << TILE_BITS; (ty + 1) << TILE_BITS > y; 
+    	 y++, tile += TILE_SIZE) {
+	if (p->hdr.height <= y) {
+	    (void)memset (tile, 0, TILE_SIZE);
+	    continue;
+	}
+	src = &s->map.pixels[(size_t)p->hdr.width * (p->hdr.height - 1 - y) 
+			     + x];
+	if (DITHER_NONE == s->dither) {
+	    for (i = 0; n > i; i++) {
+		tile[i] = s->color_map[src[i]];
+	    }
+	} else {
+	    for (i = 0; n > i; i++) {
+		tile[i] = ordered_color (&s->lookup, s->color_map, src[i], 
+					 bayer[y & 3][(x + i) & 3]);
+	    }
+	}
+	(void)memset (&tile[n], 0, TILE_SIZE - n);
+    }
+    return &stream_tiles[slot * TILE_PIXELS];
+}
+
+
+/* 
+ * photo_row
+ *   DESCRIPTION: Find the pixels of one row of a photo in memory that is
+ *                neither tiled nor split into planes.  For a packed 
+ *                photo, the band holding the row is unpacked into
+ *                band_pixels unless it is already there.  Must be called
+ *                only from the thread drawing the screen.
+ *   INPUTS: p -- the photo
+ *           y -- the row (0 to height - 1)
+ *   OUTPUTS: none
+ *   RETURN VALUE: pointer to the pixels of the row, valid until the next
+ *                 call
+ *   SIDE EFFECTS: may unpack a band, replacing another in band_pixels
+ */
+static const uint8_t*
+photo_row (const photo_t* p, int32_t y)
+{
+    int32_t         band = y / BAND_ROWS;	/* band holding row    */
+    int32_t         slot = band % BAND_SLOTS;	/* slot for band       */
+    uint8_t*        rows;			/* pixels of band      */
+    const uint32_t* start;			/* offsets of bands    */
+    int32_t         i;				/* index over slots    */
+
+    if (0 == p->packed_len) {
+        return &p->img[p->hdr.width * y];
+    }
+    if (band_photo != p) {
+	band_photo = p;
+	for (i = 0; BAND_SLOTS > i; i++) {
+	    band_tag[i] = -1;
+	}
+    }
+    rows = &band_pixels[slot * BAND_ROWS * MAX_PHOTO_WIDTH];
+    if (band_tag[slot] != band) {
+	start = (const uint32_t*)p->img;
+	photo_unpack (&p->img[start[band]], start[band + 1] - start[band],
+		      rows);
+	band_tag[slot] = band;
+    }
+    return &rows[p->hdr.width * (y % BAND_ROWS)];
+}
+
+
+/* 
+ * set_photo_budget
+ *   DESCRIPTION: Set the maximum amount of pixel data kept in memory for
+ *                photos opened with open_photo.  The most recently used
+ *                photo always stays in memory, even if it alone exceeds
+ *                the budget.
+ *   INPUTS: bytes -- the budget in bytes (0 for no limit)
+ *   OUTPUTS: none
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: none (takes effect at the next load)
+ */
+void
+set_photo_budget (size_t bytes)
+{
+    (void)pthread_mutex_lock (&photo_lock);
+    photo_budget = bytes;
+    (void)pthread_mutex_unlock (&photo_lock);
+}
+
+
+/* 
+ * get_photo_lru_stats
+ *   DESCRIPTION: Get the counters kept for photos opened with open_photo.
+ *   INPUTS: none
+ *   OUTPUTS: stats -- copy of the counters
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: none
+ */
+void
+get_photo_lru_stats (photo_lru_stats_t* stats)
+{
+    (void)pthread_mutex_lock (&photo_lock);
+    *stats = lru_stats;
+    (void)pthread_mutex_unlock (&photo_lock);
+}
+
+
+/* 
+ * set_room_layer_budget
+ *   DESCRIPTION: Set the memory kept for composited rooms (see 
+ *                room_layer_t), dropping any kept so far.
+ *   INPUTS: bytes -- the budget in bytes (0 to keep none)
+ *   OUTPUTS: none
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: frees memory (takes effect at the next room entry)
+ */
+void
+set_room_layer_budget (size_t bytes)
+{
+    int32_t i;	/* index over slots */
+
+    for (i = 0; LAYER_SLOTS > i; i++) {
+	if (NULL != layers[i].room) {
+	    drop_layer (&layers[i]);
+	}
+    }
+    layer_budget = bytes;
+}
+
+
+/* 
+ * get_room_layer_stats
+ *   DESCRIPTION: Get the counters kept for composited rooms.
+ *   INPUTS: none
+ *   OUTPUTS: stats -- copy of the counters
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: none
+ */
+void
+get_room_layer_stats (room_layer_stats_t* stats)
+{
+    *stats = layer_stats;
+}
+
+
+/* 
+ * set_photo_quant_stats
+ *   DESCRIPTION: Choose whether to measure the error of each photo 
+ *                quantized from now on (see get_photo_quant_stats).
+ *                Measuring costs one pass over the histogram, or over
+ *                the pixels when dithering.
+ *   INPUTS: on -- 1 to measure, 0 not to
+ *   OUTPUTS: none
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: none
+ */
+void
+set_photo_quant_stats (int32_t on)
+{
+    quant_stats = on;
+}
+
+
+/* 
+ * set_photo_quant_threads
+ *   DESCRIPTION: Limit the threads used to quantize each photo loaded 
+ *                from now on, below the number allowed by 
+ *                QUANT_THREADS_ENV.  A caller loading several photos at
+ *                once on its own threads can use this to avoid starting
+ *                more threads than there are processors.
+ *   INPUTS: n -- most threads to use for one photo, or 0 for no limit
+ *   OUTPUTS: none
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: none
+ */
+void
+set_photo_quant_threads (int32_t n)
+{
+    quant_thread_limit = n;
+}
+
+
+/* 
+ * set_obj_blit
+ *   DESCRIPTION: Select how rows of object images are drawn from now on,
+ *                in place of the choice made from OBJ_BLIT_ENV and 
+ *                OBJ_BLIT_SPAN_ENV (see draw_image_row).
+ *   INPUTS: name -- name of the masked blit (from blit_name)
+ *           span_pixels -- mean span length in pixels below which a row
+ *                          is drawn with the blit (0 for never)
+ *   OUTPUTS: none
+ *   RETURN VALUE: 0 on success, or -1 (with nothing changed) if the 
+ *                 name is unknown or the processor cannot run the blit
+ *   SIDE EFFECTS: none
+ */
+int32_t
+set_obj_blit (const char* name, int32_t span_pixels)
+{
+    int32_t b;	/* index over blits */
+
+    (void)pthread_once (&quant_once, choose_quantizer);
+    for (b = 0; N_BLITS > b && 0 != strcmp (name, blit_name[b]); b++) {
+    }
+    if (N_BLITS == b || best_blit () < b) {
+        return -1;
+    }
+    obj_blit = b;
+    obj_blit_span = span_pixels;
+    return 0;
+}
+
+
+/* 
+ * get_photo_quant_stats
+ *   DESCRIPTION: Get the costs and quality of quantizing a photo.
+ *   INPUTS: p -- the photo
+ *   OUTPUTS: stats -- the costs, if the photo was quantized
+ *   RETURN VALUE: 0 on success, or -1 if the photo's pixels were not 
+ *                 quantized (not yet loaded, or read from the cache)
+ *   SIDE EFFECTS: none
+ */
+int32_t
+get_photo_quant_stats (const photo_t* p, photo_quant_stats_t* stats)
+{
+    int32_t found;	/* 1 if the photo was quantized */
+
+    (void)pthread_mutex_lock (&photo_lock);
+    if (0 != (found = (NULL != p->quant.quantizer))) {
+	*stats = p->quant;
+    }
+    (void)pthread_mutex_unlock (&photo_lock);
+    return (found ? 0 : -1);
+}
+
+
+/* 
+ * set_photo_load_stats
+ *   DESCRIPTION: Choose whether to count the palette slots used by each
+ *                photo loaded from now on (see get_photo_load_stats).
+ *                Counting costs one pass over the pixels, or over the
+ *                histogram for a streamed photo.
+ *   INPUTS: on -- 1 to count, 0 not to
+ *   OUTPUTS: none
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: none
+ */
+void
+set_photo_load_stats (int32_t on)
+{
+    load_stats = on;
+}
+
+
+/* 
+ * get_photo_load_stats
+ *   DESCRIPTION: Get what loading a photo read and produced.  Unlike the
+ *                costs of quantizing, these are known for photos from 
+ *                the on-disk cache.
+ *   INPUTS: p -- the photo
+ *   OUTPUTS: stats -- file read and palette use
+ *   RETURN VALUE: 0 on success, or -1 if the photo is not loaded
+ *   SIDE EFFECTS: none
+ */
+int32_t
+get_photo_load_stats (const photo_t* p, photo_load_stats_t* stats)
+{
+    int32_t found;	/* 1 if the photo is loaded */
+
+    (void)pthread_mutex_lock (&photo_lock);
+    if (0 != (found = (NULL != p->img || NULL != p->stream))) {
+	*stats = p->load;
+    }
+    (void)pthread_mutex_unlock (&photo_lock);
+    return (found ? 0 : -1);
+}
+
+
+/* 
+ * photo_resident_bytes
+ *   DESCRIPTION: Get the size of the pixel data a photo holds in memory,
+ *                which is less than its width times its height if the
+ *                pixels are packed or streamed.
+ *   INPUTS: p -- the photo
+ *   OUTPUTS: none
+ *   RETURN VALUE: size in bytes, or 0 if the pixels are not in memory
+ *   SIDE EFFECTS: none
+ */
+size_t
+photo_resident_bytes (const photo_t* p)
+{
+    size_t bytes;	/* size of pixel data in memory */
+
+    (void)pthread_mutex_lock (&photo_lock);
+    bytes = (NULL == p->img && NULL == p->stream ? 0 : photo_bytes (p));
+    (void)pthread_mutex_unlock (&photo_lock);
+    return bytes;
+}
+
+
+/* 
+ * release_photos
+ *   DESCRIPTION: Release all memory held for room photos and object 
+ *                images, for use just before the program exits.  The 
+ *                prefetch thread is stopped first (after finishing any
+ *                photo it is loading), the data of lazily loaded photos
+ *                and of composited rooms are freed, and the asset arena
+ *                holding everything else is released with one call.
+ *                Data allocated with calloc because the arena was off or
+ *                full are not freed.
+ *   INPUTS: none
+ *   OUTPUTS: none
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: no photo or object image may be used afterward
+ */
+void
+release_photos ()
+{
+    photo_t* p;		/* index over lazy photos */
+
+    (void)pthread_mutex_lock (&photo_lock);
+    prefetch_stop = 1;
+    (void)pthread_cond_signal (&prefetch_cv);
+    while (1 == prefetch_started) {
+	(void)pthread_cond_wait (&photo_cv, &photo_lock);
+    }
+    prefetch_started = -1;
+    for (p = lazy_photos; NULL != p; p = p->lazy_next) {
+	free_photo_data (p);
+    }
+    (void)pthread_mutex_unlock (&photo_lock);
+    band_photo = NULL;
+    stream_shown = NULL;
+    set_room_layer_budget (0);
+    arena_release ();
+}
+
+
+/* 
+ * read_obj_image
+ *   DESCRIPTION: Read size and pixel data in 2:2:2 RGB format from a
+ *                photo file and create an image structure from it.  The
+ *                image must be registered with share_obj_image before it
+ *                is drawn.
+ *   INPUTS: fname -- file name for input
+ *   OUTPUTS: none
+ *   RETURN VALUE: pointer to newly allocated photo on success, or NULL
+ *                 on failure
+ *   SIDE EFFECTS: dynamically allocates memory for the image
+ */
+image_t*
+read_obj_image (const char* fname)
+{
+    FILE*    in;		/* input file               */
+    image_t* img = NULL;	/* image structure          */
+    uint16_t x;			/* index over image columns */
+    uint16_t y;			/* index over image rows    */
+    uint8_t  pixel;		/* one pixel from the file  */
+
+    /* 
+     * Open the file, allocate the structure, read the header, do some
+     * sanity checks on it, and allocate space to hold the image pixels.
+     * If anything fails, clean up as necessary and return NULL.
+     */
+    if (NULL == (in = fopen (fname, "r+b")) ||
+	NULL == (img = alloc_asset (sizeof (*img))) ||
+	NULL != (img->img = NULL) || /* false clause for initialization */
+	1 != fread (&img->hdr, sizeof (img->hdr), 1, in) ||
+	MAX_OBJECT_WIDTH < img->hdr.width ||
+	MAX_OBJECT_HEIGHT < img->hdr.height ||
+	NULL == (img->img = alloc_asset 
+		 (img->hdr.width * img->hdr.height * sizeof (img->img[0])))) {
+	if (NULL != img) {
+	    if (NULL != img->img) {
+	        free_asset (img->img);
+	    }
+	    free_asset (img);
+	}
+	if (NULL != in) {
+	    (void)fclose (in);
+	}
+	return NULL;
+    }
+
+    /* 
+     * Loop over rows from bottom to top.  Note that the file is stored
+     * in this order, whereas in memory we store the data in the reverse
+     * order (top to bottom).
+     */
+    for (y = img->hdr.height; y-- > 0; ) {
+
+	/* Loop over columns from left to right. */
+	for (x = 0; img->hdr.width > x; x++) {
+
+	    /* 
+	     * Try to read one 8-bit pixel.  On failure, clean up and 
+	     * return NULL.
+	     */
+	    if (1 != fread (&pixel, sizeof (pixel), 1, in)) {
+		free_asset (img->img);
+		free_asset (img);
+	        (void)fclose (in);
+		return NULL;
+	    }
+
+	    /* Store the pixel in the image data. */
+	    img->img[img->hdr.width * y + x] = pixel;
+	}
+    }
+
+    /* All done.  Return success. */
+    (void)fclose (in);
+    img->hash_next = NULL;
+    return img;
+}
+
+
+/* 
+ * share_obj_image
+ *   DESCRIPTION: Register an object image so that images with the same
+ *                contents are held only once.  Images are hashed by size
+ *                and pixels, and compared in full when the hashes match.
+ *                The opaque box and the opaque spans (see image_t) of
+ *                each new image are found here, so they are found once
+ *                for each distinct image.
+ *   INPUTS: im -- image just read by read_obj_image
+ *   OUTPUTS: none
+ *   RETURN VALUE: the registered image with the same contents as im, 
+ *                 im itself if there was none, or NULL if the spans of
+ *                 im could not be allocated
+ *   SIDE EFFECTS: frees im unless im itself is returned
+ */
+image_t*
+share_obj_image (image_t* im)
+{
+    image_t* scan;		/* image in hash chain           */
+    size_t   n;			/* number of pixels              */
+    size_t   i;			/* index over pixels             */
+    uint32_t h = 2166136261U;	/* FNV-1a hash of size and pixels */
+
+    n = (size_t)im->hdr.width * im->hdr.height;
+    h = (h ^ im->hdr.width) * 16777619U;
+    h = (h ^ im->hdr.height) * 16777619U;
+    for (i = 0; n > i; i++) {
+	h = (h ^ im->img[i]) * 16777619U;
+    }
+    for (scan = image_hash[h % IMAGE_HASH_SLOTS]; NULL != scan; 
+	 scan = scan->hash_next) {
+	if (h == scan->hash && im->hdr.width == scan->hdr.width &&
+	    im->hdr.height == scan->hdr.height &&
+	    0 == memcmp (im->img, scan->img, n)) {
+	    free_asset (im->img);
+	    free_asset (im);
+	    return scan;
+	}
+    }
+    if (0 != find_opaque_spans (im)) {
+	free_asset (im->img);
+	free_asset (im);
+	return NULL;
+    }
+    im->hash = h;
+    find_opaque_box (im);
+    im->hash_next = image_hash[h % IMAGE_HASH_SLOTS];
+    image_hash[h % IMAGE_HASH_SLOTS] = im;
+    return im;
+}
+
+
+/* 
+ * find_opaque_box
+ *   DESCRIPTION: Find the smallest box holding all opaque pixels of an
+ *                object image.
+ *   INPUTS: im -- the image
+ *   OUTPUTS: im -- left, right, top, and bottom set (see image_t)
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: none
+ */
+static void
+find_opaque_box (image_t* im)
+{
+    uint16_t x;			/* index over image columns */
+    uint16_t y;			/* index over image rows    */
+
+    im->left = im->hdr.width;
+    im->right = im->top = im->bottom = 0;
+    for (y = 0; im->hdr.height > y; y++) {
+	for (x = 0; im->hdr.width > x; x++) {
+	    if (OBJ_CLR_TRANSP == im->img[im->hdr.width * y + x]) {
+		continue;
+	    }
+	    if (im->top == im->bottom) {
+		im->top = y;
+	    }
+	    im->bottom = y + 1;
+	    if (im->left > x) {
+		im->left = x;
+	    }
+	    if (im->right <= x) {
+		im->right = x + 1;
+	    }
+	}
+    }
+    if (im->top == im->bottom) {
+	im->left = im->right = 0;
+    }
+}
+
+
+/* 
+ * find_opaque_spans
+ *   DESCRIPTION: List the spans of opaque pixels in each row and each 
+ *                column of an object image (see image_t).  The spans are
+ *                counted first so that the lists and the indices into 
+ *                them can be held in one block.
+ *   INPUTS: im -- the image
+ *   OUTPUTS: im -- spans, row_span, and col_span filled in
+ *   RETURN VALUE: 0 on success, or -1 if memory cannot be allocated
+ *   SIDE EFFECTS: allocates the block pointed to by spans
+ */
+static int32_t
+find_opaque_spans (image_t* im)
+{
+    uint32_t n_spans = 0;	/* spans in all rows and columns */
+    uint16_t x;			/* index over image columns      */
+    uint16_t y;			/* index over image rows         */
+
+    for (y = 0; im->hdr.height > y; y++) {
+	n_spans += line_spans (&im->img[im->hdr.width * y], im->hdr.width,
+			       1, NULL);
+    }
+    for (x = 0; im->hdr.width > x; x++) {
+	n_spans += line_spans (&im->img[x], im->hdr.height, im->hdr.width,
+			       NULL);
+    }
+    if (NULL == (im->spans = alloc_asset 
+		 (n_spans * sizeof (im->spans[0]) + 
+		  (im->hdr.height + im->hdr.width + 2) * sizeof (uint32_t)))) {
+	return -1;
+    }
+    im->row_span = (uint32_t*)&im->spans[n_spans];
+    im->col_span = &im->row_span[im->hdr.height + 1];
+    n_spans = 0;
+    for (y = 0; im->hdr.height > y; y++) {
+	im->row_span[y] = n_spans;
+	n_spans += line_spans (&im->img[im->hdr.width * y], im->hdr.width,
+			       1, &im->spans[n_spans]);
+    }
+    im->row_span[y] = n_spans;
+    for (x = 0; im->hdr.width > x; x++) {
+	im->col_span[x] = n_spans;
+	n_spans += line_spans (&im->img[x], im->hdr.height, im->hdr.width,
+			       &im->spans[n_spans]);
+    }
+    im->col_span[x] = n_spans;
+    return 0;
+}
+
+
+/* 
+ * line_spans
+ *   DESCRIPTION: Find the spans of opaque pixels in one row or column of
+ *                an object image.
+ *   INPUTS: px -- first pixel of the line
+ *           n -- pixels in the line
+ *           step -- distance between pixels of the line in memory
+ *           spans -- where to write the spans, or NULL only to count them
+ *   OUTPUTS: spans -- the spans, in order along the line, if not NULL
+ *   RETURN VALUE: number of spans in the line
+ *   SIDE EFFECTS: none
+ */
+static uint32_t
+line_spans (const uint8_t* px, uint16_t n, size_t step, image_span_t* spans)
+{
+    uint32_t found = 0;	/* spans found so far        */
+    uint16_t i;		/* index over pixels in line */
+
+    for (i = 0; n > i; i++) {
+	if (OBJ_CLR_TRANSP == px[i * step]) {
+	    continue;
+	}
+	if (0 == i || OBJ_CLR_TRANSP == px[(i - 1) * step]) {
+	    if (NULL != spans) {
+		spans[found].start = i;
+		spans[found].len = 0;
+	    }
+	    found++;
+	}
+	if (NULL != spans) {
+	    spans[found - 1].len++;
+	}
+    }
+    return found;
+}
+
+
+/* 
+ * map_photo_file
+ *   DESCRIPTION: Bring the entire contents of a room photo file into
+ *                memory with a single call and check the header against
+ *                the file size.  The file is mapped with mmap when
+ *                possible; otherwise, it is read with one bulk fread.
+ *                Either way, the pixel data can then be walked as many
+ *                times as needed without further stdio calls.
+ *   INPUTS: fname -- file name for input
+ *   OUTPUTS: map -- filled with the location and length of the data
+ *   RETURN VALUE: 0 on success, -1 on failure (nothing left to release)
+ *   SIDE EFFECTS: maps the file or allocates a buffer for its contents;
+ *                 call unmap_photo_file to release it
+ */
+static int32_t
+map_photo_file (const char* fname, photo_map_t* map)
+{
+    int         fd;	/* file descriptor for input          */
+    struct stat st;	/* file status (for size)             */
+    void*       base;	/* start of mapping or heap buffer    */
+    FILE*       in;	/* stream used if mmap is unavailable */
+
+    if (-1 == (fd = open (fname, O_RDONLY))) {
+	return -1;
+    }
+    if (0 != fstat (fd, &st) || sizeof (photo_header_t) > st.st_size) {
+	(void)close (fd);
+	return -1;
+    }
+    map->len = st.st_size;
+
+    /* Map the whole file; the descriptor is not needed afterward. */
+    base = mmap (NULL, map->len, PROT_READ, MAP_PRIVATE, fd, 0);
+    (void)close (fd);
+    if (MAP_FAILED != base) {
+	map->mapped = 1;
+    } else {
+	/* Fall back to a single bulk read into a heap buffer. */
+	map->mapped = 0;
+	if (NULL == (base = malloc (map->len))) {
+	    return -1;
+	}
+	if (NULL == (in = fopen (fname, "rb")) ||
+	    1 != fread (base, map->len, 1, in)) {
+	    if (NULL != in) {
+		(void)fclose (in);
+	    }
+	    free (base);
+	    return -1;
+	}
+	(void)fclose (in);
+    }
+    map->base = base;
+
+    /* The file must hold exactly the pixels promised by its header. */
+    (void)memcpy (&map->hdr, map->base, sizeof (map->hdr));
+    if (sizeof (map->hdr) + (size_t)map->hdr.width * map->hdr.height * 
+    	sizeof (uint16_t) != map->len) {
+	unmap_photo_file (map);
+	return -1;
+    }
+    map->pixels = (const uint16_t*)(map->base + sizeof (map->hdr));
+    return 0;
+}
+
+
+/* 
+ * drop_file_pages
+ *   DESCRIPTION: Release the pages of a mapped photo file from this 
+ *                process, so that they count against its memory only 
+ *                until they are next read.  The file is never written
+ *                through the mapping, so its contents are unchanged.
+ *   INPUTS: map -- the mapped file
+ *   OUTPUTS: none
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: unmaps the pages from the page tables
+ */
+static void
+drop_file_pages (const photo_map_t* map)
+{
+    (void)madvise ((void*)map->base, map->len, MADV_DONTNEED);
+}
+
+
+/* 
+ * unmap_photo_file
+ *   DESCRIPTION: Release the file contents obtained by map_photo_file.
+ *   INPUTS: map -- the mapping to release
+ *   OUTPUTS: none
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: unmaps or frees the file data
+ */
+static void
+unmap_photo_file (photo_map_t* map)
+{
+    if (map->mapped) {
+	(void)munmap ((void*)map->base, map->len);
+    } else {
+	free ((void*)map->base);
+    }
+    map->base = NULL;
+    map->pixels = NULL;
+}
+
+
+/* 
+ * load_cached_photo
+ *   DESCRIPTION: Fill in a photo structure from the on-disk photo cache
+ *                (see photo_cache.c).  The pixel data are used in place
+ *                within the mapped cache file unless they are packed,
+ *                tiled, or split into planes (see pack_photo, tile_photo,
+ *                and plane_photo).
+ *   INPUTS: p -- the photo structure
+ *           fname -- photo file name
+ *   OUTPUTS: p -- header, palette, pixels, and cache mapping filled in
+ *   RETURN VALUE: 0 on a cache hit, or -1 on a miss or failure
+ *   SIDE EFFECTS: maps the cache file
+ */
+static int32_t
+load_cached_photo (photo_t* p, const char* fname)
+{
+    photo_cache_entry_t ent;	/* cache entry for fname        */
+    uint8_t             used[256]; /* 1 for each color in photo */
+    size_t              i;	/* index over pixels            */
+
+    (void)pthread_once (&quant_once, choose_quantizer);
+    if (0 != photo_cache_lookup (fname, QUANT_VARIANT + 256 * quantizer +
+				 4096 * dither, &ent)) {
+        return -1;
+    }
+    if (MAX_PHOTO_WIDTH < ent.hdr.width ||
+	MAX_PHOTO_HEIGHT < ent.hdr.height) {
+	photo_cache_release (&ent);
+        return -1;
+    }
+    p->hdr = ent.hdr;
+    (void)memcpy (p->palette, ent.palette, sizeof (p->palette));
+    p->img = (uint8_t*)ent.img;
+    p->cache = ent;
+    p->load.cached = 1;
+    p->load.bytes_read = ent.map_len;
+    if (load_stats) {
+	(void)memset (used, 0, sizeof (used));
+	for (i = (size_t)p->hdr.width * p->hdr.height; 0 < i--; ) {
+	    used[p->img[i]] = 1;
+	}
+	count_slots (p, used);
+    }
+    pack_photo (p);
+    tile_photo (p);
+    plane_photo (p);
+    return 0;
+}
+
+
+/* 
+ * load_preview
+ *   DESCRIPTION: Fill in a photo structure with a quick preview of a 
+ *                photo file, for display until the full photo is 
+ *                ready.  Each pixel is mapped to the 2:2:2 color given
+ *                by the top two bits of each field, which needs no 
+ *                histogram or palette selection; the 64 palette colors
+ *                are the centers of the 2:2:2 color ranges.
+ *   INPUTS: p -- the photo structure
+ *           fname -- photo file name
+ *   OUTPUTS: p -- header, palette, and pixels filled in
+ *   RETURN VALUE: 0 on success, or -1 on failure
+ *   SIDE EFFECTS: dynamically allocates memory for the photo pixels
+ */
+static int32_t
+load_preview (photo_t* p, const char* fname)
+{
+    photo_map_t     map;	/* file contents in memory   */
+    const uint16_t* src;	/* next pixel in file order  */
+    uint8_t*        dst;	/* start of image row        */
+    uint16_t        x;		/* index over image columns  */
+    uint16_t        y;		/* index over image rows     */
+    int32_t         c;		/* index over 2:2:2 colors   */
+
+    if (0 != map_photo_file (fname, &map)) {
+	return -1;
+    }
+    if (MAX_PHOTO_WIDTH < map.hdr.width ||
+	MAX_PHOTO_HEIGHT < map.hdr.height ||
+	NULL == (p->img = malloc 
+		 (map.hdr.width * map.hdr.height * sizeof (p->img[0])))) {
+	unmap_photo_file (&map);
+	return -1;
+    }
+    p->hdr = map.hdr;
+    p->cache.map = NULL;
+    p->quant.quantizer = NULL;
+    p->load.cached = 0;
+    p->load.bytes_read = map.len;
+    p->load.slots_used = -1;
+    p->packed_len = 0;
+    p->tiled = 0;
+    p->planar = 0;
+    p->stream = NULL;
+    p->preview = 1;
+    p->keep = 0;
+    p->full = NULL;
+
+    (void)memset (p->palette, 0, sizeof (p->palette));
+    for (c = 0; 64 > c; c++) {
+	p->palette[c][0] = (c & 0x30) + 8;
+	p->palette[c][1] = ((c & 0x0C) << 2) + 8;
+	p->palette[c][2] = ((c & 0x03) << 4) + 8;
+    }
+
+    /* Rows are stored from bottom to top in the file. */
+    src = map.pixels;
+    for (y = p->hdr.height; y-- > 0; ) {
+	dst = &p->img[p->hdr.width * y];
+	for (x = 0; p->hdr.width > x; x++, src++) {
+	    dst[x] = 64 + (((*src >> 10) & 0x30) | ((*src >> 7) & 0x0C) |
+			   ((*src >> 3) & 0x03));
+	}
+    }
+    unmap_photo_file (&map);
+    return 0;
+}
+
+
+/* 
+ * read_photo
+ *   DESCRIPTION: Read size and pixel data in 5:6:5 RGB format from a
+ *                photo file and create a photo structure from it.
+ *   INPUTS: fname -- file name for input
+ *   OUTPUTS: none
+ *   RETURN VALUE: pointer to newly allocated photo on success, or NULL
+ *                 on failure
+ *   SIDE EFFECTS: dynamically allocates memory for the photo
+ */
+photo_t*
+read_photo (const char* fname)
+{
+    photo_t* p;		/* photo structure */
+
+    if (NULL == (p = alloc_asset (sizeof (*p)))) {
+        return NULL;
+    }
+    p->fname = NULL;
+    p->loading = 0;
+    p->lazy_next = NULL;
+    if (0 != load_photo (p, fname, 1)) {
+        free_asset (p);
+	return NULL;
+    }
+    return p;
+}
+
+
+/* 
+ * choose_quantizer
+ *   DESCRIPTION: Select the quantizer for photo palettes, the dithering
+ *                mode, whether to report on each photo quantized, 
+ *                whether to pack, tile, or split photo pixels into
+ *                planes, whether to show previews, the threads used
+ *                to quantize one photo, and how object rows are drawn,
+ *                based on QUANTIZER_ENV, DITHER_ENV, QUANT_REPORT_ENV,
+ *                PHOTO_PACK_ENV, PHOTO_TILE_ENV, PHOTO_PLANE_ENV, 
+ *                PREVIEW_ENV, QUANT_THREADS_ENV, OBJ_BLIT_ENV, and 
+ *                OBJ_BLIT_SPAN_ENV.  An unknown quantizer, dithering, or
+ *                blit name is reported and ignored, as is a blit the 
+ *                processor cannot run.
+ *   INPUTS: none
+ *   OUTPUTS: none
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: sets quantizer, dither, quant_report, pack_photos, 
+ *                 tile_photos, plane_photos, previews_on, 
+ *                 quant_threads, obj_blit, and obj_blit_span
+ */
+static void
+choose_quantizer ()
+{
+    const char* name = getenv (QUANTIZER_ENV);	/* quantizer name */
+    int32_t     q;				/* quantizer      */
+    int32_t     d;				/* dithering mode */
+    int32_t     b;				/* blit           */
+
+    if (NULL != name) {
+	if (0 > (q = quantizer_by_name (name))) {
+	    fprintf (stderr, "Unknown quantizer \"%s\"; using \"%s\".\n", 
+		     name, quantizer_name[quantizer]);
+	} else {
+	    quantizer = q;
+	}
+    }
+    if (NULL != (name = getenv (DITHER_ENV))) {
+	for (d = 0; N_DITHERS > d; d++) {
+	    if (0 == strcmp (name, dither_name[d])) {
+		dither = d;
+		break;
+	    }
+	}
+	if (N_DITHERS == d) {
+	    fprintf (stderr, "Unknown dithering \"%s\"; using \"%s\".\n", 
+		     name, dither_name[dither]);
+	}
+    }
+    quant_report = (NULL != getenv (QUANT_REPORT_ENV));
+    pack_photos = (NULL != (name = getenv (PHOTO_PACK_ENV)) && 
+		   0 == strcmp (name, "1"));
+    tile_photos = (NULL != (name = getenv (PHOTO_TILE_ENV)) && 
+		   0 == strcmp (name, "1"));
+    plane_photos = (NULL != (name = getenv (PHOTO_PLANE_ENV)) && 
+		    0 == strcmp (name, "1"));
+    previews_on = (NULL == (name = getenv (PREVIEW_ENV)) || 
+		   0 != strcmp (name, "0"));
+    if (NULL != (name = getenv (QUANT_THREADS_ENV))) {
+	quant_threads = strtol (name, NULL, 10);
+    } else {
+	quant_threads = sysconf (_SC_NPROCESSORS_ONLN);
+    }
+    if (1 > quant_threads) {
+	quant_threads = 1;
+    }
+    obj_blit = best_blit ();
+    if (NULL != (name = getenv (OBJ_BLIT_ENV))) {
+	for (b = 0; N_BLITS > b && 0 != strcmp (name, blit_name[b]); b++) {
+	}
+	if (N_BLITS == b || obj_blit < b) {
+	    fprintf (stderr, "Cannot use blit \"%s\"; using \"%s\".\n",
+		     name, blit_name[obj_blit]);
+	} else {
+	    obj_blit = b;
+	}
+    }
+    if (NULL != (name = getenv (OBJ_BLIT_SPAN_ENV))) {
+	obj_blit_span = strtol (name, NULL, 10);
+    }
+}
+
+
+/* 
+ * load_photo
+ *   DESCRIPTION: Read size and pixel data in 5:6:5 RGB format from a
+ *                photo file into a photo structure, selecting the 
+ *                optimized palette and mapping the pixels to it.
+ *                The file is brought into memory once (see 
+ *                map_photo_file); the histogram pass and the palette
+ *                mapping pass both walk that copy, so each photo costs
+ *                one open and one map rather than two full passes of
+ *                per-pixel freads.  When the on-disk photo cache holds a
+ *                current entry for the file, the entry is used instead
+ *                and no quantization is done at all; otherwise, the
+ *                result is added to the cache.  Either way, the pixels
+ *                are then packed, tiled, or split into planes if asked
+ *                (see pack_photo, tile_photo, and plane_photo).  Photos
+ *                too large to hold in memory are streamed instead (see
+ *                stream_photo).
+ *   INPUTS: p -- the photo structure
+ *           fname -- file name for input
+ *           keep -- 1 if the pixels are kept until exit, so that they
+ *                   can come from the asset arena (see photo_alloc)
+ *   OUTPUTS: p -- header, palette, and pixels filled in
+ *   RETURN VALUE: 0 on success, or -1 on failure
+ *   SIDE EFFECTS: dynamically allocates memory for the photo pixels
+ */
+static int32_t
+load_photo (photo_t* p, const char* fname, int32_t keep)
+{
+    photo_map_t     map;	/* file contents in memory        */
+    uint32_t        (*colors)[HIST_COLORS]; /* color histograms   */
+    uint8_t         color_map[HIST_COLORS]; /* color for pixel    */
+    struct timespec start;	/* time loading started           */
+    struct timespec hist_start;	/* time counting colors started   */
+    struct timespec pal_start;	/* time choosing palette started  */
+    struct timespec remap_start; /* time mapping pixels started   */
+    struct timespec end;	/* time quantization finished     */
+    uint8_t         used[256];	/* 1 for each color in photo      */
+    size_t          i;		/* index over pixels              */
+
+    /* Use the cached result of an earlier run if there is one. */
+    p->quant.quantizer = NULL;
+    p->load.cached = 0;
+    p->load.bytes_read = 0;
+    p->load.slots_used = -1;
+    p->packed_len = 0;
+    p->tiled = 0;
+    p->planar = 0;
+    p->stream = NULL;
+    p->preview = 0;
+    p->keep = keep;
+    p->full = NULL;
+    if (0 == load_cached_photo (p, fname)) {
+        return 0;
+    }
+
+    /* 
+     * Map the file, do some sanity checks on the header, and allocate
+     * space to hold the photo pixels.  If anything fails, clean up as 
+     * necessary and return -1.
+     */
+    (void)clock_gettime (CLOCK_MONOTONIC, &start);
+    if (0 != map_photo_file (fname, &map)) {
+	return -1;
+    }
+    if (MAX_PHOTO_WIDTH < map.hdr.width ||
+	MAX_PHOTO_HEIGHT < map.hdr.height) {
+        return stream_photo (p, fname, &map);
+    }
+    if (NULL == (p->img = (pack_photos || tile_photos || plane_photos ?
+			   malloc (map.hdr.width * map.hdr.height) :
+			   photo_alloc (p, map.hdr.width * map.hdr.height)))) {
+	unmap_photo_file (&map);
+	return -1;
+    }
+    p->hdr = map.hdr;
+    p->cache.map = NULL;
+    p->load.bytes_read = map.len;
+
+    /* 
+     * Count the colors in the photo.  The histogram does not depend on
+     * pixel position, so the mapped pixels are used in file order.
+     */
+    (void)clock_gettime (CLOCK_MONOTONIC, &hist_start);
+    if (NULL == (colors = calloc (HIST_SUBS, sizeof (*colors)))) {
+	free_asset (p->img);
+	unmap_photo_file (&map);
+	return -1;
+    }
+    count_colors_split (map.pixels, p->hdr.width * p->hdr.height, colors);
+    (void)clock_gettime (CLOCK_MONOTONIC, &pal_start);
+
+    /* Choose the palette and the color for each pixel value. */
+    if (0 != choose_palette (p, colors, color_map)) {
+	free (colors);
+	free_asset (p->img);
+	unmap_photo_file (&map);
+	return -1;
+    }
+
+    (void)clock_gettime (CLOCK_MONOTONIC, &remap_start);
+
+    /* 
+     * Map the pixels to the palette.  The mapped pixels are reused here
+     * rather than read from the file a second time.  Dithering, if any,
+     * is done in the same pass.  Without dithering, each pixel depends
+     * only on its own color, so rows may be mapped on several threads.
+     */
+    if (DITHER_FS == dither) {
+	dither_fs (p, map.pixels, color_map);
+    } else if (DITHER_ORDERED == dither) {
+	dither_ordered (p, map.pixels, color_map);
+    } else {
+	remap_split (p, map.pixels, color_map);
+    }
+
+    /* 
+     * Record time taken and, if asked to do so, measure and report the
+     * quality of the result.  Without dithering, the error for each 
+     * pixel depends only on its color, so it can be found from the 
+     * histogram.
+     */
+    (void)clock_gettime (CLOCK_MONOTONIC, &end);
+    p->quant.quantizer = quantizer_name[quantizer];
+    p->quant.dither = dither_name[dither];
+    p->quant.read_usec = elapsed_usec (&start, &hist_start);
+    p->quant.hist_usec = elapsed_usec (&hist_start, &pal_start);
+    p->quant.select_usec = elapsed_usec (&pal_start, &remap_start);
+    p->quant.remap_usec = elapsed_usec (&remap_start, &end);
+    p->quant.mse = -1.0;
+    if (quant_report || quant_stats) {
+	if (DITHER_NONE != dither) {
+	    p->quant.mse = photo_mse (p, map.pixels);
+	} else {
+	    if (QUANT_POPULAR == quantizer) {
+		merge_colors (colors);
+	    }
+	    p->quant.mse = quantize_mse (colors[0], 
+	    			(const uint8_t (*)[3])p->palette, color_map);
+	}
+    }
+    report_quant (p, fname);
+    free (colors);
+    if (load_stats) {
+	(void)memset (used, 0, sizeof (used));
+	for (i = (size_t)p->hdr.width * p->hdr.height; 0 < i--; ) {
+	    used[p->img[i]] = 1;
+	}
+	count_slots (p, used);
+    }
+
+/* All done.  Save the result for next time and return success. */
+    unmap_photo_file (&map);
+    photo_cache_store (fname, 
+		       QUANT_VARIANT + 256 * quantizer + 4096 * dither, 
+		       &p->hdr, (const uint8_t (*)[3])p->palette, p->img);
+    pack_photo (p);
+    tile_photo (p);
+    plane_photo (p);
+
+    return 0;
+}
+
+
+/* 
+ * choose_palette
+ *   DESCRIPTION: Choose the palette of a photo with the selected
+ *                quantizer, and build a table giving the palette color
+ *                for every 5:6:5 pixel value so that mapping a pixel is
+ *                a single lookup.  Only the entries for colors present
+ *                in the photo are kept; the rest are left 0 so that
+ *                dithering can fill them in with the nearest palette
+ *                color when needed (see map_color).  The popular scheme
+ *                fills in every entry, but may map a missing color to a
+ *                palette color for an empty node, so those entries are
+ *                cleared when dithering.
+ *   INPUTS: p -- the photo
+ *           colors -- HIST_SUBS full-color histograms from count_colors
+ *   OUTPUTS: p -- palette filled in
+ *            colors -- histograms possibly merged (see merge_colors)
+ *            color_map -- VGA color for each 5:6:5 color, or 0 if unknown
+ *   RETURN VALUE: 0 on success, or -1 if memory cannot be allocated
+ *   SIDE EFFECTS: none
+ */
+static int32_t
+choose_palette (photo_t* p, uint32_t (*colors)[HIST_COLORS],
+		uint8_t color_map[HIST_COLORS])
+{
+    int32_t c;		/* index over 5:6:5 colors */
+
+    if (QUANT_POPULAR == quantizer) {
+	popular_palette ((const uint32_t (*)[HIST_COLORS])colors,
+			 p->palette, color_map);
+	if (DITHER_NONE != dither) {
+	    merge_colors (colors);
+	    for (c = 0; HIST_COLORS > c; c++) {
+		if (0 == colors[0][c]) {
+		    color_map[c] = 0;
+		}
+	    }
+	}
+	return 0;
+    }
+    merge_colors (colors);
+    (void)memset (color_map, 0, HIST_COLORS);
+    return quantize_colors (quantizer, colors[0], p->palette, color_map);
+}
+
+
+/* 
+ * report_quant
+ *   DESCRIPTION: Find the peak signal-to-noise ratio of a photo just
+ *                quantized from its mean squared error, and report the
+ *                costs and quality of quantizing it if asked to do so
+ *                (see QUANT_REPORT_ENV).
+ *   INPUTS: p -- the photo, with costs and error (-1 if not measured)
+ *                recorded in quant
+ *           fname -- photo file name
+ *   OUTPUTS: p -- psnr recorded (-1 if not measured)
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: prints the report
+ */
+static void
+report_quant (photo_t* p, const char* fname)
+{
+    if (0.0 > p->quant.mse) {
+	p->quant.psnr = -1.0;
+    } else {
+	p->quant.psnr = (0.0 == p->quant.mse ? 99.0 :
+			 10.0 * log10 (63.0 * 63.0 / p->quant.mse));
+    }
+    if (quant_report) {
+	fprintf (stderr, "quantize %s: %s hist %.3f ms, select %.3f ms, "
+		 "%s remap %.3f ms, PSNR %.2f dB\n", fname,
+		 p->quant.quantizer, p->quant.hist_usec / 1e3,
+		 p->quant.select_usec / 1e3, p->quant.dither,
+		 p->quant.remap_usec / 1e3, p->quant.psnr);
+    }
+}
+
+
+/* 
+ * count_slots
+ *   DESCRIPTION: Count the palette slots used by a photo just loaded.
+ *                For the popular quantizer, only the 128 level-4 colors
+ *                (VGA colors 64 to 191) are counted, since the level-2
+ *                colors are there to catch whatever they miss; for the
+ *                other quantizers, all 192 photo colors are counted.
+ *   INPUTS: p -- the photo
+ *           used -- 1 for each VGA color used by some pixel, 0 otherwise
+ *   OUTPUTS: p -- slots_used and slots recorded in load
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: none
+ */
+static void
+count_slots (photo_t* p, const uint8_t used[256])
+{
+    int32_t c;		/* index over VGA colors */
+
+    p->load.slots = (QUANT_POPULAR == quantizer ? 128 : 192);
+    p->load.slots_used = 0;
+    for (c = 64; 64 + p->load.slots > c; c++) {
+	p->load.slots_used += used[c];
+    }
+}
+
+
+/* 
+ * stream_photo
+ *   DESCRIPTION: Set up a photo too large to hold in memory to be
+ *                streamed from its mapped file.  The palette is chosen
+ *                as usual from the colors of the whole photo, counted a
+ *                piece at a time with the pages of the file released in
+ *                between, but no pixels are mapped to the palette until
+ *                drawn (see photo_tile).  Floyd-Steinberg dithering
+ *                depends on all pixels above and to the left, so it is
+ *                replaced with ordered dithering.  The on-disk photo
+ *                cache is not used.
+ *   INPUTS: p -- the photo structure
+ *           fname -- photo file name
+ *           map -- the photo file, which must be mapped rather than read
+ *                  into memory
+ *   OUTPUTS: p -- header, palette, and stream filled in
+ *   RETURN VALUE: 0 on success, or -1 on failure
+ *   SIDE EFFECTS: the photo keeps the mapping on success; it is released
+ *                 on failure
+ */
+static int32_t
+stream_photo (photo_t* p, const char* fname, photo_map_t* map)
+{
+    uint32_t        (*colors)[HIST_COLORS]; /* color histograms   */
+    photo_stream_t* s;		/* source of tiles                */
+    struct timespec start;	/* time setup started             */
+    struct timespec hist_start;	/* time counting colors started   */
+    struct timespec pal_start;	/* time choosing palette started  */
+    struct timespec end;	/* time setup finished            */
+    size_t          n;		/* pixels in photo                */
+    size_t          i;		/* index over pixels, histograms */
+    uint8_t         used[256];	/* 1 for each color mapped to     */
+    int32_t         c;		/* index over 5:6:5 colors        */
+
+    (void)clock_gettime (CLOCK_MONOTONIC, &start);
+    n = (size_t)map->hdr.width * map->hdr.height;
+    if (!map->mapped || MAX_STREAM_WIDTH < map->hdr.width ||
+	MAX_STREAM_HEIGHT < map->hdr.height ||
+	NULL == (s = photo_alloc (p, sizeof (*s)))) {
+	unmap_photo_file (map);
+	return -1;
+    }
+    if (NULL == (colors = calloc (HIST_SUBS, sizeof (*colors)))) {
+	free_asset (s);
+	unmap_photo_file (map);
+	return -1;
+    }
+
+    /* Count the colors in the photo, releasing pages as they are done. */
+    (void)clock_gettime (CLOCK_MONOTONIC, &hist_start);
+    for (i = 0; n > i; i += STREAM_DROP_PIXELS) {
+	count_colors_split (&map->pixels[i], (n - i < STREAM_DROP_PIXELS ?
+					      n - i : STREAM_DROP_PIXELS), 
+			    colors);
+	drop_file_pages (map);
+    }
+
+    /* Choose the palette and the color for each pixel value. */
+    (void)clock_gettime (CLOCK_MONOTONIC, &pal_start);
+    if (0 != choose_palette (p, colors, s->color_map)) {
+	free (colors);
+	free_asset (s);
+	unmap_photo_file (map);
+	return -1;
+    }
+    s->map = *map;
+    s->dither = (DITHER_FS == dither ? DITHER_ORDERED : dither);
+    p->load.bytes_read = map->len;
+
+    /* Pixels are mapped only when drawn; count what the colors map to. */
+    if (load_stats) {
+	(void)memset (used, 0, sizeof (used));
+	for (c = 0; HIST_COLORS > c; c++) {
+	    for (i = 0; HIST_SUBS > i; i++) {
+		if (0 != colors[i][c]) {
+		    used[s->color_map[c]] = 1;
+		    break;
+		}
+	    }
+	}
+	count_slots (p, used);
+    }
+    quantize_lookup_init (&s->lookup, (const uint8_t (*)[3])p->palette);
+    p->hdr = map->hdr;
+    p->img = NULL;
+    p->cache.map = NULL;
+    p->stream = s;
+    (void)clock_gettime (CLOCK_MONOTONIC, &end);
+
+    /*
+     * Record time taken.  Pixels are mapped only when drawn, and the
+     * error can be found from the histogram only without dithering.
+     */
+    p->quant.quantizer = quantizer_name[quantizer];
+    p->quant.dither = dither_name[s->dither];
+    p->quant.read_usec = elapsed_usec (&start, &hist_start);
+    p->quant.hist_usec = elapsed_usec (&hist_start, &pal_start);
+    p->quant.select_usec = elapsed_usec (&pal_start, &end);
+    p->quant.remap_usec = 0;
+    p->quant.mse = -1.0;
+    if ((quant_report || quant_stats) && DITHER_NONE == s->dither) {
+	if (QUANT_POPULAR == quantizer) {
+	    merge_colors (colors);
+	}
+	p->quant.mse = quantize_mse (colors[0],
+				     (const uint8_t (*)[3])p->palette,
+				     s->color_map);
+    }
+    report_quant (p, fname);
+    free (colors);
+    return 0;
+}
+
+
+/* 
+ * pack_photo
+ *   DESCRIPTION: If asked to do so (see PHOTO_PACK_ENV), replace the 
+ *                pixel data of a photo with a packed copy, so that less
+ *                memory is used to hold it.  Each band of BAND_ROWS rows
+ *                is packed separately so that it can be unpacked alone
+ *                when drawn (see photo_row).  A photo that does not 
+ *                shrink, or that cannot be packed for lack of memory, is
+ *                left as it is.
+ *   INPUTS: p -- the photo, with unpacked pixels
+ *   OUTPUTS: p -- pixels packed and packed_len set, if packed
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: frees or unmaps the unpacked pixels if packed
+ */
+static void
+pack_photo (photo_t* p)
+{
+    size_t    n_bands;	/* number of bands of rows          */
+    size_t    band_len;	/* bytes in a full band             */
+    size_t    len;	/* total packed bytes so far        */
+    uint8_t*  packed;	/* packed pixel data                */
+    uint8_t*  fit;	/* packed data trimmed to length    */
+    uint32_t* start;	/* offsets of bands within packed   */
+    size_t    b;	/* index over bands                 */
+
+    if (!pack_photos || 0 == p->hdr.height) {
+        return;
+    }
+    n_bands = (p->hdr.height + BAND_ROWS - 1) / BAND_ROWS;
+    band_len = (size_t)BAND_ROWS * p->hdr.width;
+    len = (n_bands + 1) * sizeof (*start);
+    if (NULL == (packed = malloc (len + n_bands * 
+    				  PHOTO_PACK_BOUND (band_len)))) {
+        return;
+    }
+    start = (uint32_t*)packed;
+    for (b = 0; n_bands > b; b++) {
+	start[b] = len;
+	if (n_bands == b + 1) {
+	    band_len = photo_bytes (p) - b * band_len;
+	}
+	len += photo_pack (&p->img[b * BAND_ROWS * p->hdr.width], band_len,
+			   &packed[len]);
+    }
+    start[n_bands] = len;
+    if (photo_bytes (p) <= len || 
+	NULL == (fit = (p->keep ? photo_alloc (p, len) : 
+			realloc (packed, len)))) {
+	free (packed);
+        return;
+    }
+    if (p->keep) {
+	(void)memcpy (fit, packed, len);
+	free (packed);
+    }
+    free_photo_data (p);
+    p->img = fit;
+    p->cache.map = NULL;
+    p->packed_len = len;
+}
+
+
+/* 
+ * tile_photo
+ *   DESCRIPTION: If asked to do so (see PHOTO_TILE_ENV), replace the 
+ *                pixel data of a photo that is not packed with a copy 
+ *                arranged in tiles of TILE_SIZE by TILE_SIZE pixels, 
+ *                with the pixels of each tile in row order.  Pixels 
+ *                padding the tiles on the right and bottom edges are 0.
+ *                A photo is left as it is if memory cannot be allocated.
+ *   INPUTS: p -- the photo, with pixels in row order
+ *   OUTPUTS: p -- pixels tiled and tiled set, if tiled
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: frees or unmaps the row-order pixels if tiled
+ */
+static void
+tile_photo (photo_t* p)
+{
+    size_t   tiles_x = photo_tiles_x (p); /* tiles in each row of tiles */
+    uint8_t* tiles;	/* tiled pixel data                   */
+    uint8_t* dst;	/* start of row in first tile of row  */
+    uint16_t x;		/* index over image columns           */
+    uint16_t y;		/* index over image rows              */
+
+    if (!tile_photos || 0 != p->packed_len ||
+	NULL == (tiles = photo_alloc (p, tiles_x * TILE_PIXELS * 
+				      ((p->hdr.height + TILE_MASK) >> 
+				       TILE_BITS)))) {
+        return;
+    }
+    for (y = 0; p->hdr.height > y; y++) {
+	dst = &tiles[(y >> TILE_BITS) * tiles_x * TILE_PIXELS + 
+		     (y & TILE_MASK) * TILE_SIZE];
+	for (x = 0; p->hdr.width > x; x += TILE_SIZE) {
+	    (void)memcpy (&dst[(x >> TILE_BITS) * TILE_PIXELS], 
+			  &p->img[p->hdr.width * y + x],
+			  (p->hdr.width - x < TILE_SIZE ? 
+			   p->hdr.width - x : TILE_SIZE));
+	}
+    }
+    free_photo_data (p);
+    p->img = tiles;
+    p->cache.map = NULL;
+    p->tiled = 1;
+}
+
+
+/* 
+ * plane_photo
+ *   DESCRIPTION: If asked to do so (see PHOTO_PLANE_ENV), replace the 
+ *                pixel data of a photo that is neither packed nor tiled 
+ *                with a copy split into the four mode X planes (see 
+ *                photo_t).  Pixels padding the planes on the right are 0.
+ *                A photo is left as it is if memory cannot be allocated.
+ *   INPUTS: p -- the photo, with pixels in row order
+ *   OUTPUTS: p -- pixels split and planar set, if split
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: frees or unmaps the row-order pixels if split
+ */
+static void
+plane_photo (photo_t* p)
+{
+    size_t   pw = photo_plane_width (p); /* pixels in row of plane    */
+    size_t   plane_len = pw * p->hdr.height; /* pixels in each plane  */
+    uint8_t* planes;	/* planar pixel data                  */
+    uint8_t* dst;	/* row in plane 0                     */
+    uint16_t x;		/* index over image columns           */
+    uint16_t y;		/* index over image rows              */
+
+    if (!plane_photos || 0 != p->packed_len || p->tiled ||
+	NULL == (planes = photo_alloc (p, 4 * plane_len))) {
+        return;
+    }
+    for (y = 0; p->hdr.height > y; y++) {
+	dst = &planes[pw * y];
+	for (x = 0; p->hdr.width > x; x++) {
+	    dst[(x & 3) * plane_len + (x >> 2)] = p->img[p->hdr.width * y + x];
+	}
+    }
+    free_photo_data (p);
+    p->img = planes;
+    p->cache.map = NULL;
+    p->planar = 1;
+}
+
+/* 
+ * popular_palette
+ *   DESCRIPTION: Choose palette colors for a photo with the original
+ *                (QUANT_POPULAR) scheme: the 128 most common level-4
+ *                octree nodes, plus the 64 level-2 nodes for all other
+ *                pixels.
+ *   INPUTS: colors -- HIST_SUBS full-color histograms from count_colors
+ *   OUTPUTS: palette -- the 6:6:6 palette colors
+ *            color_map -- VGA color for each 5:6:5 pixel value
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: none
+ */
+static void
+popular_palette (const uint32_t (*colors)[HIST_COLORS], 
+		 uint8_t palette[QUANT_PALETTE][3], 
+		 uint8_t color_map[HIST_COLORS])
+{
+    photo_hist_t  hist;		/* level-4 color histogram        */
+    struct octree level2[64];	/* level-2 nodes for other colors */
+    uint16_t      top[128];	/* most common level-4 nodes      */
+    uint8_t       node_color[4096]; /* palette color for node     */
+    int32_t       n_top;	/* number of nodes in top         */
+    int32_t       i;		/* index over top nodes           */
+    int32_t       node;		/* level-4 node number            */
+    int32_t       addr;		/* level-2 node number            */
+
+    reduce_colors (colors, &hist);
+
+    /* 
+     * The 128 most common level-4 nodes (4:4:4 RGB) get palette colors
+     * 64 to 191, in order of decreasing pixel count; each color is the
+     * average of the pixels in the node.  Unused colors are black.
+     */
+    n_top = select_top_nodes (&hist, top);
+    (void)memset (palette, 0, QUANT_PALETTE * 3);
+    (void)memset (node_color, 0, sizeof (node_color));
+    for (i = 0; n_top > i; i++) {
+	node = top[i];
+	palette[i][0] = (hist.red[node] / hist.count[node]) << 1;
+	palette[i][1] = hist.green[node] / hist.count[node];
+	palette[i][2] = (hist.blue[node] / hist.count[node]) << 1;
+	node_color[node] = 64 + i;
+    }
+
+    /* 
+     * Pixels in all other nodes use one of the 64 level-2 nodes (2:2:2
+     * RGB), which get palette colors 192 to 255.  Each color is the 
+     * average of the pixels that fall back to the node.
+     */
+    (void)memset (level2, 0, sizeof (level2));
+    for (node = 0; 4096 > node; node++) {
+	if (0 != hist.count[node] && 0 == node_color[node]) {
+	    addr = (((node >> 10) & level2_mask) << 4) | 
+		   (((node >> 6) & level2_mask) << 2) | 
+		   ((node >> 2) & level2_mask);
+	    level2[addr].pixel_loop_counter += hist.count[node];
+	    level2[addr].red_sum += hist.red[node];
+	    level2[addr].green_sum += hist.green[node];
+	    level2[addr].blue_sum += hist.blue[node];
+	}
+    }
+    for (addr = 0; 64 > addr; addr++) {
+	if (0 != level2[addr].pixel_loop_counter) {
+	    palette[addr + 128][0] = (level2[addr].red_sum / 
+	    				 level2[addr].pixel_loop_counter) << 1;
+	    palette[addr + 128][1] = level2[addr].green_sum / 
+	    				level2[addr].pixel_loop_counter;
+	    palette[addr + 128][2] = (level2[addr].blue_sum / 
+	    				 level2[addr].pixel_loop_counter) << 1;
+	}
+    }
+    for (node = 0; 4096 > node; node++) {
+	if (0 == node_color[node]) {
+	    node_color[node] = 192 + 
+	    		       ((((node >> 10) & level2_mask) << 4) | 
+				(((node >> 6) & level2_mask) << 2) | 
+				((node >> 2) & level2_mask));
+	}
+    }
+
+    /* Expand the node colors into a table covering every pixel value. */
+    build_color_map (node_color, color_map);
+}
+
+
+/* 
+ * build_color_map
+ *   DESCRIPTION: Expand a table of colors for level-4 nodes into a table
+ *                of colors for all 5:6:5 pixel values.  As in 
+ *                reduce_colors, the colors with the same red and green 
+ *                node bits form eight runs of 32, within which each 
+ *                node's color simply appears twice.
+ *   INPUTS: node_color -- palette color for each level-4 node
+ *   OUTPUTS: color_map -- palette color for each pixel value
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: none
+ */
+static void
+build_color_map (const uint8_t node_color[4096], 
+		 uint8_t color_map[HIST_COLORS])
+{
+    int32_t  rg;	/* red and green node bits (upper 8 of 12)   */
+    int32_t  low;	/* low red bit and low green bits of a run   */
+    int32_t  b;		/* blue node bits                            */
+    uint8_t* run;	/* first entry of run                        */
+
+#if defined(HIST_SSE2)
+    if (__builtin_cpu_supports ("sse2")) {
+	build_color_map_sse2 (node_color, color_map);
+	return;
+    }
+#endif
+    for (rg = 0; 256 > rg; rg++) {
+	for (low = 0; 8 > low; low++) {
+	    run = &color_map[((rg >> 4) << 12) | ((low & 1) << 11) | 
+			     ((rg & 0xF) << 7) | ((low >> 1) << 5)];
+	    for (b = 0; 16 > b; b++) {
+		run[2 * b] = run[2 * b + 1] = node_color[(rg << 4) | b];
+	    }
+	}
+    }
+}
+
+
+#if defined(HIST_SSE2)
+/* 
+ * build_color_map_sse2
+ *   DESCRIPTION: Expand a table of colors for level-4 nodes into a table
+ *                of colors for all 5:6:5 pixel values, as 
+ *                build_color_map does, with SSE2.  The 16 node colors 
+ *                for a run are loaded as one vector and interleaved with
+ *                themselves to produce the 32 entries.
+ *   INPUTS: node_color -- palette color for each level-4 node
+ *   OUTPUTS: color_map -- palette color for each pixel value
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: none
+ */
+__attribute__ ((target ("sse2")))
+static void
+build_color_map_sse2 (const uint8_t node_color[4096], 
+		      uint8_t color_map[HIST_COLORS])
+{
+    int32_t  rg;	/* red and green node bits (upper 8 of 12)   */
+    int32_t  low;	/* low red bit and low green bits of a run   */
+    uint8_t* run;	/* first entry of run                        */
+    __m128i  colors;	/* colors of the 16 nodes in each run        */
+
+    for (rg = 0; 256 > rg; rg++) {
+	colors = _mm_loadu_si128 ((const __m128i*)&node_color[rg << 4]);
+	for (low = 0; 8 > low; low++) {
+	    run = &color_map[((rg >> 4) << 12) | ((low & 1) << 11) | 
+			     ((rg & 0xF) << 7) | ((low >> 1) << 5)];
+	    _mm_storeu_si128 ((__m128i*)run, 
+	    		      _mm_unpacklo_epi8 (colors, colors));
+	    _mm_storeu_si128 ((__m128i*)(run + 16), 
+	    		      _mm_unpackhi_epi8 (colors, colors));
+	}
+    }
+}
+#endif /* defined(HIST_SSE2) */
+
+
+/* 
+ * map_color
+ *   DESCRIPTION: Find the VGA color for a 5:6:5 color in a photo's color
+ *                map.  Colors not yet in the map (entries of 0, possible
+ *                only with quantizers other than QUANT_POPULAR) are 
+ *                mapped to the nearest palette color and added.
+ *   INPUTS: l -- the photo's palette (see quantize_lookup_init)
+ *           color_map -- VGA color for each 5:6:5 color, or 0 if unknown
+ *           c -- the 5:6:5 color
+ *   OUTPUTS: color_map -- entry for c filled in
+ *   RETURN VALUE: the VGA color
+ *   SIDE EFFECTS: none
+ */
+static uint8_t
+map_color (const quant_lookup_t* l, uint8_t color_map[HIST_COLORS], 
+	   uint16_t c)
+{
+    uint8_t rgb[3];	/* c as a 6:6:6 color */
+
+    if (0 == color_map[c]) {
+	rgb[0] = (c >> 11) << 1;
+	rgb[1] = (c >> 5) & 0x3F;
+	rgb[2] = (c & 0x1F) << 1;
+	color_map[c] = quantize_nearest (l, rgb);
+    }
+    return color_map[c];
+}
+
+
+/* 
+ * dither_fs
+ *   DESCRIPTION: Map a photo's pixels to its palette with Floyd-Steinberg
+ *                error diffusion.  Each pixel's error, in 6:6:6 units, 
+ *                is passed on to its right neighbor (7/16) and to the
+ *                three pixels below it (3/16, 5/16, and 1/16).  Only two
+ *                rows of error terms are kept, one for the row being 
+ *                mapped and one for the row after it, so no full-image
+ *                buffer is needed.  Errors bound for the right neighbor 
+ *                and for the next row are summed in local variables, so
+ *                each term in the next row is written just once.  Rows 
+ *                are visited in file order (bottom to top), and errors 
+ *                accumulate in 16ths.
+ *   INPUTS: p -- the photo, with palette chosen and img allocated
+ *           src -- the 5:6:5 pixels in file order
+ *           color_map -- VGA color for each 5:6:5 color, or 0 if unknown
+ *   OUTPUTS: p -- pixels filled in
+ *            color_map -- entries for dithered colors filled in
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: none
+ */
+static void
+dither_fs (photo_t* p, const uint16_t* src, uint8_t color_map[HIST_COLORS])
+{
+    quant_lookup_t lookup;	/* palette arranged for searches       */
+    int16_t        err[2][MAX_PHOTO_WIDTH + 1][3]; /* error terms      */
+    int16_t        (*cur)[3];	/* errors for this row (from x - 1)    */
+    int16_t        (*next)[3];	/* errors for next row (from x - 1)    */
+    int32_t        right[3];	/* error for pixel x from x - 1        */
+    int32_t        below_left[3]; /* error for x - 1 in next row       */
+    int32_t        below[3];	/* error for x in next row             */
+    int32_t        v[3];	/* dithered 6:6:6 color of pixel       */
+    int32_t        d;		/* error in one field                  */
+    int32_t        j;		/* index over fields                   */
+    uint16_t       c;		/* pixel color                         */
+    const uint8_t* pal;		/* palette color chosen for pixel      */
+    uint8_t*       dst;		/* start of image row                  */
+    uint16_t       x;		/* index over image columns            */
+    uint16_t       y;		/* index over image rows               */
+
+    quantize_lookup_init (&lookup, (const uint8_t (*)[3])p->palette);
+    (void)memset (err, 0, sizeof (err));
+    for (y = p->hdr.height; y-- > 0; ) {
+	dst = &p->img[p->hdr.width * y];
+	cur = err[y & 1];
+	next = err[(y & 1) ^ 1];
+	for (j = 0; 3 > j; j++) {
+	    right[j] = below_left[j] = below[j] = 0;
+	}
+
+	for (x = 0; p->hdr.width > x; x++) {
+	    c = *src++;
+	    v[0] = ((c >> 11) << 1);
+	    v[1] = ((c >> 5) & 0x3F);
+	    v[2] = ((c & 0x1F) << 1);
+	    for (j = 0; 3 > j; j++) {
+		v[j] += (cur[x + 1][j] + right[j] + 8) >> 4;
+		v[j] = (0 > v[j] ? 0 : (0x3F < v[j] ? 0x3F : v[j]));
+	    }
+	    dst[x] = map_color (&lookup, color_map, ((v[0] >> 1) << 11) | 
+				(v[1] << 5) | (v[2] >> 1));
+	    pal = p->palette[dst[x] - 64];
+
+	    /* 
+	     * The term for x - 1 in the next row is now complete; the one
+	     * for x + 1 starts here.
+	     */
+	    for (j = 0; 3 > j; j++) {
+		d = v[j] - pal[j];
+		right[j] = 7 * d;
+		next[x][j] = below_left[j] + 3 * d;
+		below_left[j] = below[j] + 5 * d;
+		below[j] = d;
+	    }
+	}
+	for (j = 0; 3 > j; j++) {
+	    next[x][j] = below_left[j];
+	}
+    }
+}
+
+
+/* 
+ * ordered_color
+ *   DESCRIPTION: Map one pixel to a photo's palette with ordered 
+ *                dithering: the Bayer threshold for the pixel's position
+ *                is turned into an offset of -4 to 4 in 6:6:6 units (see
+ *                ORDERED_RB and ORDERED_G) and added to each field 
+ *                before the color is looked up.
+ *   INPUTS: l -- the photo's palette (see quantize_lookup_init)
+ *           color_map -- VGA color for each 5:6:5 color, or 0 if unknown
+ *           c -- the pixel's 5:6:5 color
+ *           t -- Bayer threshold for the pixel's position
+ *   OUTPUTS: color_map -- entry for dithered color filled in
+ *   RETURN VALUE: the VGA color
+ *   SIDE EFFECTS: none
+ */
+static uint8_t
+ordered_color (const quant_lookup_t* l, uint8_t color_map[HIST_COLORS], 
+	       uint16_t c, int32_t t)
+{
+    int32_t r = (c >> 11) + ORDERED_RB (t);		/* dithered red   */
+    int32_t g = ((c >> 5) & 0x3F) + ORDERED_G (t);	/* dithered green */
+    int32_t b = (c & 0x1F) + ORDERED_RB (t);		/* dithered blue  */
+
+    r = (0 > r ? 0 : (0x1F < r ? 0x1F : r));
+    g = (0 > g ? 0 : (0x3F < g ? 0x3F : g));
+    b = (0 > b ? 0 : (0x1F < b ? 0x1F : b));
+    return map_color (l, color_map, (r << 11) | (g << 5) | b);
+}
+
+
+/* 
+ * dither_ordered
+ *   DESCRIPTION: Map a photo's pixels to its palette with 4x4 ordered
+ *                (Bayer) dithering (see ordered_color).  Each pixel 
+ *                depends only on its own color and position, so the work
+ *                is done with SSE2 when the processor supports it.
+ *   INPUTS: p -- the photo, with palette chosen and img allocated
+ *           src -- the 5:6:5 pixels in file order
+ *           color_map -- VGA color for each 5:6:5 color, or 0 if unknown
+ *   OUTPUTS: p -- pixels filled in
+ *            color_map -- entries for dithered colors filled in
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: none
+ */
+static void
+dither_ordered (photo_t* p, const uint16_t* src, 
+		uint8_t color_map[HIST_COLORS])
+{
+    quant_lookup_t lookup;	/* palette arranged for searches */
+    uint8_t*       dst;		/* start of image row            */
+    uint16_t       x;		/* index over image columns      */
+    uint16_t       y;		/* index over image rows         */
+
+#if defined(HIST_SSE2)
+    if (__builtin_cpu_supports ("sse2")) {
+	dither_ordered_sse2 (p, src, color_map);
+	return;
+    }
+#endif
+
+    quantize_lookup_init (&lookup, (const uint8_t (*)[3])p->palette);
+
+    for (y = p->hdr.height; y-- > 0; ) {
+	dst = &p->img[p->hdr.width * y];
+	for (x = 0; p->hdr.width > x; x++) {
+	    dst[x] = ordered_color (&lookup, color_map, *src++, 
+				    bayer[y & 3][x & 3]);
+	}
+    }
+}
+
+
+#if defined(HIST_SSE2)
+/* 
+ * dither_ordered_sse2
+ *   DESCRIPTION: SSE2 version of dither_ordered.  The fields of eight
+ *                pixels are separated, offset, clamped, and reassembled
+ *                at once; the offsets repeat every four columns, so one
+ *                pair of vectors serves a whole row.  The resulting 
+ *                colors are then looked up one at a time.
+ *   INPUTS: p -- the photo, with palette chosen and img allocated
+ *           src -- the 5:6:5 pixels in file order
+ *           color_map -- VGA color for each 5:6:5 color, or 0 if unknown
+ *   OUTPUTS: p -- pixels filled in
+ *            color_map -- entries for dithered colors filled in
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: none
+ */
+__attribute__ ((target ("sse2")))
+static void
+dither_ordered_sse2 (photo_t* p, const uint16_t* src, 
+		     uint8_t color_map[HIST_COLORS])
+{
+    const __m128i  zero = _mm_setzero_si128 ();  /* field minimum      */
+    const __m128i  max5 = _mm_set1_epi16 (0x1F); /* red/blue maximum   */
+    const __m128i  max6 = _mm_set1_epi16 (0x3F); /* green maximum      */
+    quant_lookup_t lookup;	/* palette arranged for searches       */
+    const uint8_t* t;		/* Bayer thresholds for row            */
+    __m128i        rb_off;	/* red and blue offsets for row        */
+    __m128i        g_off;	/* green offsets for row               */
+    __m128i        pix;		/* eight pixels                        */
+    __m128i        r;		/* their red fields                    */
+    __m128i        g;		/* their green fields                  */
+    __m128i        b;		/* their blue fields                   */
+    uint16_t       key[8];	/* their dithered colors               */
+    uint8_t*       dst;		/* start of image row                  */
+    uint16_t       x;		/* index over image columns            */
+    uint16_t       y;		/* index over image rows               */
+    int32_t        i;		/* index over pixels in vector         */
+
+    quantize_lookup_init (&lookup, (const uint8_t (*)[3])p->palette);
+    for (y = p->hdr.height; y-- > 0; ) {
+	dst = &p->img[p->hdr.width * y];
+	t = bayer[y & 3];
+	rb_off = _mm_setr_epi16 (ORDERED_RB (t[0]), ORDERED_RB (t[1]), 
+				 ORDERED_RB (t[2]), ORDERED_RB (t[3]), 
+				 ORDERED_RB (t[0]), ORDERED_RB (t[1]), 
+				 ORDERED_RB (t[2]), ORDERED_RB (t[3]));
+	g_off = _mm_setr_epi16 (ORDERED_G (t[0]), ORDERED_G (t[1]), 
+				ORDERED_G (t[2]), ORDERED_G (t[3]), 
+				ORDERED_G (t[0]), ORDERED_G (t[1]), 
+				ORDERED_G (t[2]), ORDERED_G (t[3]));
+
+	for (x = 0; p->hdr.width >= x + 8; x += 8, src += 8) {
+	    pix = _mm_loadu_si128 ((const __m128i*)src);
+	    r = _mm_add_epi16 (_mm_srli_epi16 (pix, 11), rb_off);
+	    g = _mm_add_epi16 (_mm_and_si128 (_mm_srli_epi16 (pix, 5), max6),
+			       g_off);
+	    b = _mm_add_epi16 (_mm_and_si128 (pix, max5), rb_off);
+	    r = _mm_min_epi16 (_mm_max_epi16 (r, zero), max5);
+	    g = _mm_min_epi16 (_mm_max_epi16 (g, zero), max6);
+	    b = _mm_min_epi16 (_mm_max_epi16 (b, zero), max5);
+	    pix = _mm_or_si128 (_mm_or_si128 (_mm_slli_epi16 (r, 11), 
+					      _mm_slli_epi16 (g, 5)), b);
+	    _mm_storeu_si128 ((__m128i*)key, pix);
+	    for (i = 0; 8 > i; i++) {
+		dst[x + i] = map_color (&lookup, color_map, key[i]);
+	    }
+	}
+	for (; p->hdr.width > x; x++) {
+	    dst[x] = ordered_color (&lookup, color_map, *src++, t[x & 3]);
+	}
+    }
+}
+#endif
+
+
+/* 
+ * photo_mse
+ *   DESCRIPTION: Compute the mean squared error per field of a photo's 
+ *                pixels against its 5:6:5 source, pixel by pixel.  This
+ *                is the measure used by quantize_mse, but does not 
+ *                assume that all pixels of one color are mapped alike,
+ *                so it is correct for dithered photos.
+ *   INPUTS: p -- the photo, with palette and pixels filled in
+ *           src -- the 5:6:5 pixels in file order
+ *   OUTPUTS: none
+ *   RETURN VALUE: mean squared error (0 if the photo is reproduced 
+ *                 exactly)
+ *   SIDE EFFECTS: none
+ */
+static double
+photo_mse (const photo_t* p, const uint16_t* src)
+{
+    uint64_t       sse = 0;	/* sum of squared errors        */
+    const uint8_t* dst;		/* start of image row           */
+    const uint8_t* pal;		/* palette color of pixel       */
+    int32_t        dr;		/* red error                    */
+    int32_t        dg;		/* green error                  */
+    int32_t        db;		/* blue error                   */
+    uint16_t       x;		/* index over image columns     */
+    uint16_t       y;		/* index over image rows        */
+
+    for (y = p->hdr.height; y-- > 0; ) {
+	dst = &p->img[p->hdr.width * y];
+	for (x = 0; p->hdr.width > x; x++, src++) {
+	    pal = p->palette[dst[x] - 64];
+	    dr = ((*src >> 11) << 1) - pal[0];
+	    dg = ((*src >> 5) & 0x3F) - pal[1];
+	    db = ((*src & 0x1F) << 1) - pal[2];
+	    sse += dr * dr + dg * dg + db * db;
+	}
+    }
+    if (0 == p->hdr.width * p->hdr.height) {
+        return 0.0;
+    }
+    return (double)sse / (3.0 * p->hdr.width * p->hdr.height);
+}
+
+
+/* 
+ * count_colors
+ *   DESCRIPTION: Count the pixels of each 5:6:5 color in a photo.  The
+ *                loop over pixels does one increment per pixel and needs
+ *                no field decoding.  Consecutive pixels are counted in
+ *                different histograms (HIST_SUBS of them) so that runs
+ *                of the same color do not make each increment wait for
+ *                the one before it; see merge_colors and reduce_colors.
+ *   INPUTS: pix -- 5:6:5 pixels
+ *           n -- number of pixels
+ *           colors -- HIST_SUBS zeroed full-color histograms
+ *   OUTPUTS: colors -- the pixel counts
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: none
+ */
+static void
+count_colors (const uint16_t* pix, size_t n, uint32_t (*colors)[HIST_COLORS])
+{
+    size_t  i;		/* index over pixels     */
+    int32_t sub;	/* index over histograms */
+
+    for (i = 0; i + HIST_SUBS <= n; i += HIST_SUBS) {
+	for (sub = 0; HIST_SUBS > sub; sub++) {
+	    colors[sub][pix[i + sub]]++;
+	}
+    }
+    for (; n > i; i++) {
+	colors[0][pix[i]]++;
+    }
+}
+
+
+/* 
+ * count_colors_split
+ *   DESCRIPTION: Count the pixels of each 5:6:5 color, as count_colors
+ *                does, splitting the pixels into parts counted on 
+ *                separate threads (see quant_part_count) if there are
+ *                enough of them.  Each part after the first is counted
+ *                into its own histograms, which are then added into 
+ *                colors, so the counts are exactly those of count_colors
+ *                over all pixels.  If memory for the extra histograms 
+ *                cannot be allocated, the pixels are counted serially.
+ *   INPUTS: pix -- 5:6:5 pixels
+ *           n -- number of pixels
+ *           colors -- HIST_SUBS zeroed full-color histograms
+ *   OUTPUTS: colors -- the pixel counts
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: may create and join threads
+ */
+static void
+count_colors_split (const uint16_t* pix, size_t n, 
+		    uint32_t (*colors)[HIST_COLORS])
+{
+    quant_part_t part[QUANT_MAX_PARTS]; /* work for each thread      */
+    uint32_t     (*extra)[HIST_COLORS]; /* histograms of later parts */
+    int32_t      n_parts;	/* number of parts                    */
+    int32_t      k;		/* index over parts                   */
+    int32_t      sub;		/* index over histograms              */
+    int32_t      c;		/* index over 5:6:5 colors            */
+
+    n_parts = quant_part_count (n);
+    if (1 == n_parts || 
+	NULL == (extra = calloc ((n_parts - 1) * HIST_SUBS, 
+				 sizeof (*extra)))) {
+	count_colors (pix, n, colors);
+	return;
+    }
+    for (k = 0; n_parts > k; k++) {
+	part[k].src = pix;
+	part[k].colors = (0 == k ? colors : &extra[(k - 1) * HIST_SUBS]);
+	part[k].first = n * k / n_parts;
+	part[k].end = n * (k + 1) / n_parts;
+    }
+    run_quant_parts (count_part, part, n_parts);
+    for (k = 1; n_parts > k; k++) {
+	for (sub = 0; HIST_SUBS > sub; sub++) {
+	    for (c = 0; HIST_COLORS > c; c++) {
+		colors[sub][c] += part[k].colors[sub][c];
+	    }
+	}
+    }
+    free (extra);
+}
+
+
+/* 
+ * count_part
+ *   DESCRIPTION: Count the colors of one part of a photo's pixels into
+ *                the part's histograms.  Run by run_quant_parts.
+ *   INPUTS: arg -- the part (a quant_part_t)
+ *   OUTPUTS: the part's histograms
+ *   RETURN VALUE: NULL
+ *   SIDE EFFECTS: none
+ */
+static void*
+count_part (void* arg)
+{
+    quant_part_t* part = arg;	/* the part */
+
+    count_colors (&part->src[part->first], part->end - part->first, 
+		  part->colors);
+    return NULL;
+}
+
+
+/* 
+ * quant_part_count
+ *   DESCRIPTION: Decide how many parts to split quantizing work into:
+ *                one per thread allowed (see QUANT_THREADS_ENV and 
+ *                set_photo_quant_threads), but with at least 
+ *                QUANT_PART_MIN pixels in each part, so that the cost of
+ *                starting a thread is small beside its share of the work.
+ *   INPUTS: n_pixels -- number of pixels to be processed
+ *   OUTPUTS: none
+ *   RETURN VALUE: number of parts (1 to QUANT_MAX_PARTS)
+ *   SIDE EFFECTS: none
+ */
+static int32_t
+quant_part_count (size_t n_pixels)
+{
+    size_t n = quant_threads;	/* number of parts */
+
+    if (0 != quant_thread_limit && quant_thread_limit < n) {
+	n = quant_thread_limit;
+    }
+    if (n_pixels / QUANT_PART_MIN < n) {
+	n = n_pixels / QUANT_PART_MIN;
+    }
+    if (QUANT_MAX_PARTS < n) {
+	n = QUANT_MAX_PARTS;
+    }
+    return (1 > n ? 1 : n);
+}
+
+
+/* 
+ * run_quant_parts
+ *   DESCRIPTION: Run a function on each part of some quantizing work, 
+ *                the first part on the calling thread and each other 
+ *                part on a thread of its own, and wait for all of them.
+ *                A part whose thread cannot be created is run on the 
+ *                calling thread instead.
+ *   INPUTS: fn -- function to run, given a pointer to the part
+ *           part -- the parts
+ *           n_parts -- number of parts (1 to QUANT_MAX_PARTS)
+ *   OUTPUTS: whatever fn produces for each part
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: creates and joins threads
+ */
+static void
+run_quant_parts (void* (*fn) (void*), quant_part_t* part, int32_t n_parts)
+{
+    pthread_t tid[QUANT_MAX_PARTS]; /* thread for each part         */
+    int32_t   made[QUANT_MAX_PARTS]; /* 1 if thread was created     */
+    int32_t   k;		/* index over parts                 */
+
+    for (k = 1; n_parts > k; k++) {
+	made[k] = (0 == pthread_create (&tid[k], NULL, fn, &part[k]));
+    }
+    (void)fn (&part[0]);
+    for (k = 1; n_parts > k; k++) {
+	if (made[k]) {
+	    (void)pthread_join (tid[k], NULL);
+	} else {
+	    (void)fn (&part[k]);
+	}
+    }
+}
+
+
+/* 
+ * remap_part
+ *   DESCRIPTION: Map a range of rows of a photo's pixels to the palette
+ *                without dithering.  Rows are stored from bottom to top
+ *                in the file, whereas in memory we store the data in the
+ *                reverse order (top to bottom).
+ *   INPUTS: p -- the photo, with img allocated
+ *           src -- the 5:6:5 pixels in file order
+ *           color_map -- VGA color for each 5:6:5 color
+ *           first -- first row (in memory) to map
+ *           end -- row after last to map
+ *   OUTPUTS: p -- pixels of the rows filled in
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: none
+ */
+static void
+remap_part (photo_t* p, const uint16_t* src, 
+	    const uint8_t color_map[HIST_COLORS], int32_t first, int32_t end)
+{
+    uint8_t* dst;		/* start of image row       */
+    int32_t  x;			/* index over image columns */
+    int32_t  y;			/* index over image rows    */
+
+    src += (size_t)p->hdr.width * (p->hdr.height - end);
+    for (y = end; y-- > first; ) {
+	dst = &p->img[p->hdr.width * y];
+
+	/* Loop over columns from left to right, four pixels at a time. */
+	for (x = 0; p->hdr.width >= x + 4; x += 4, src += 4) {
+	    dst[x] = color_map[src[0]];
+	    dst[x + 1] = color_map[src[1]];
+	    dst[x + 2] = color_map[src[2]];
+	    dst[x + 3] = color_map[src[3]];
+	}
+	for (; p->hdr.width > x; x++) {
+	    dst[x] = color_map[*src++];
+	}
+    }
+}
+
+
+/* 
+ * remap_part_thread
+ *   DESCRIPTION: Map the rows of one part of a photo to the palette (see
+ *                remap_part).  Run by run_quant_parts.
+ *   INPUTS: arg -- the part (a quant_part_t)
+ *   OUTPUTS: pixels of the part's rows
+ *   RETURN VALUE: NULL
+ *   SIDE EFFECTS: none
+ */
+static void*
+remap_part_thread (void* arg)
+{
+    quant_part_t* part = arg;	/* the part */
+
+    remap_part (part->p, part->src, part->color_map, part->first, 
+		part->end);
+    return NULL;
+}
+
+
+/* 
+ * remap_split
+ *   DESCRIPTION: Map all of a photo's pixels to the palette without 
+ *                dithering, splitting the rows into parts mapped on 
+ *                separate threads (see quant_part_count) if there are
+ *                enough pixels.  The parts write disjoint rows of img, 
+ *                so the result is the same however it is split.
+ *   INPUTS: p -- the photo, with img allocated
+ *           src -- the 5:6:5 pixels in file order
+ *           color_map -- VGA color for each 5:6:5 color
+ *   OUTPUTS: p -- pixels filled in
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: may create and join threads
+ */
+static void
+remap_split (photo_t* p, const uint16_t* src, 
+	     const uint8_t color_map[HIST_COLORS])
+{
+    quant_part_t part[QUANT_MAX_PARTS]; /* work for each thread */
+    int32_t      n_parts;	/* number of parts               */
+    int32_t      k;		/* index over parts              */
+
+    n_parts = quant_part_count ((size_t)p->hdr.width * p->hdr.height);
+    for (k = 0; n_parts > k; k++) {
+	part[k].p = p;
+	part[k].src = src;
+	part[k].color_map = color_map;
+	part[k].first = p->hdr.height * k / n_parts;
+	part[k].end = p->hdr.height * (k + 1) / n_parts;
+    }
+    run_quant_parts (remap_part_thread, part, n_parts);
+}
+
+
+/* 
+ * merge_colors
+ *   DESCRIPTION: Add the full-color histograms built by count_colors 
+ *                into the first one.
+ *   INPUTS: colors -- HIST_SUBS full-color histograms
+ *   OUTPUTS: colors -- first histogram holds the total counts; the 
+ *                      others are zeroed
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: none
+ */
+static void
+merge_colors (uint32_t (*colors)[HIST_COLORS])
+{
+    int32_t c;		/* index over colors     */
+    int32_t sub;	/* index over histograms */
+
+    for (sub = 1; HIST_SUBS > sub; sub++) {
+	for (c = 0; HIST_COLORS > c; c++) {
+	    colors[0][c] += colors[sub][c];
+	    colors[sub][c] = 0;
+	}
+    }
+}
+
+
+/* 
+ * reduce_colors
+ *   DESCRIPTION: Merge the full-color histograms built by count_colors 
+ *                and reduce them to level-4 nodes.  A node holds 16 
+ *                5:6:5 colors, which differ only in the low bit of red,
+ *                the low two bits of green, and the low bit of blue.  The
+ *                counts for those bits are summed first; the field sums
+ *                follow from them and from the node number.  Colors with
+ *                the same red and green nodes are contiguous, so each 
+ *                group of 16 nodes is built from eight runs of 32 
+ *                counts.  Uses SSE2 when the processor supports it.
+ *                The result is exactly the same as summing the fields 
+ *                of each pixel into its node directly.
+ *   INPUTS: colors -- HIST_SUBS full-color histograms
+ *   OUTPUTS: h -- the histogram
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: none
+ */
+static void
+reduce_colors (const uint32_t (*colors)[HIST_COLORS], photo_hist_t* h)
+{
+    int32_t  rg;	/* red and green node bits (upper 8 of 12)   */
+    int32_t  low;	/* low red bit and low green bits of a run   */
+    int32_t  b;		/* blue node bits                            */
+    int32_t  sub;	/* index over histograms                     */
+    int32_t  node;	/* level-4 node number                       */
+    uint32_t base;	/* first color in run                        */
+    uint32_t even;	/* pixels in run with blue low bit clear     */
+    uint32_t odd;	/* pixels in run with blue low bit set       */
+
+#if defined(HIST_SSE2)
+    if (__builtin_cpu_supports ("sse2")) {
+	reduce_colors_sse2 (colors, h);
+	return;
+    }
+#endif
+    (void)memset (h, 0, sizeof (*h));
+    for (rg = 0; 256 > rg; rg++) {
+	for (low = 0; 8 > low; low++) {
+	    base = ((rg >> 4) << 12) | ((low & 1) << 11) | 
+		   ((rg & 0xF) << 7) | ((low >> 1) << 5);
+	    for (b = 0; 16 > b; b++) {
+		even = odd = 0;
+		for (sub = 0; HIST_SUBS > sub; sub++) {
+		    even += colors[sub][base + 2 * b];
+		    odd += colors[sub][base + 2 * b + 1];
+		}
+		node = (rg << 4) | b;
+		h->count[node] += even + odd;
+		h->red[node] += (low & 1) * (even + odd);
+		h->green[node] += (low >> 1) * (even + odd);
+		h->blue[node] += odd;
+	    }
+	}
+	for (b = 0; 16 > b; b++) {
+	    node = (rg << 4) | b;
+	    h->red[node] += (uint64_t)h->count[node] * ((rg >> 4) << 1);
+	    h->green[node] += (uint64_t)h->count[node] * ((rg & 0xF) << 2);
+	    h->blue[node] += (uint64_t)h->count[node] * (b << 1);
+	}
+    }
+}
+
+
+#if defined(HIST_SSE2)
+/* 
+ * reduce_colors_sse2
+ *   DESCRIPTION: Merge the full-color histograms built by count_colors 
+ *                and reduce them to level-4 nodes, as reduce_colors 
+ *                does, with SSE2.  Each run of 32 counts is loaded as 
+ *                eight vectors, and the even (blue low bit clear) and 
+ *                odd counts are separated with shuffles, giving the 
+ *                contributions to 16 nodes in four vectors.
+ *   INPUTS: colors -- HIST_SUBS full-color histograms
+ *   OUTPUTS: h -- the histogram
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: none
+ */
+__attribute__ ((target ("sse2")))
+static void
+reduce_colors_sse2 (const uint32_t (*colors)[HIST_COLORS], photo_hist_t* h)
+{
+    int32_t  rg;	/* red and green node bits (upper 8 of 12)   */
+    int32_t  low;	/* low red bit and low green bits of a run   */
+    int32_t  v;		/* index over vectors of four nodes          */
+    int32_t  sub;	/* index over histograms                     */
+    int32_t  node;	/* level-4 node number                       */
+    uint32_t base;	/* first color in run                        */
+    __m128i lo;		/* counts for four colors                    */
+    __m128i hi;		/* counts for the next four colors           */
+    __m128i pair;	/* pixels in four nodes from this run        */
+    __m128i odd;	/* pixels with blue low bit set, in the run  */
+    __m128i count[4];	/* pixels in 16 nodes                        */
+    __m128i red[4];	/* sums of low red bits for 16 nodes         */
+    __m128i green[4];	/* sums of low green bits for 16 nodes       */
+    __m128i blue[4];	/* sums of low blue bits for 16 nodes        */
+    uint32_t low_red[16];   /* red[] as stored, one node per element   */
+    uint32_t low_green[16]; /* green[] as stored, one node per element */
+    uint32_t low_blue[16];  /* blue[] as stored, one node per element  */
+
+    for (rg = 0; 256 > rg; rg++) {
+	for (v = 0; 4 > v; v++) {
+	    count[v] = red[v] = green[v] = blue[v] = _mm_setzero_si128 ();
+	}
+	for (low = 0; 8 > low; low++) {
+	    base = ((rg >> 4) << 12) | ((low & 1) << 11) | 
+		   ((rg & 0xF) << 7) | ((low >> 1) << 5);
+	    for (v = 0; 4 > v; v++) {
+		lo = hi = _mm_setzero_si128 ();
+		for (sub = 0; HIST_SUBS > sub; sub++) {
+		    lo = _mm_add_epi32 (lo, _mm_loadu_si128 
+		    	    ((const __m128i*)&colors[sub][base + 8 * v]));
+		    hi = _mm_add_epi32 (hi, _mm_loadu_si128 
+		    	    ((const __m128i*)&colors[sub][base + 8 * v + 4]));
+		}
+		odd = _mm_castps_si128 (_mm_shuffle_ps 
+			(_mm_castsi128_ps (lo), _mm_castsi128_ps (hi), 
+			 _MM_SHUFFLE (3, 1, 3, 1)));
+		pair = _mm_add_epi32 (odd, _mm_castps_si128 (_mm_shuffle_ps 
+			(_mm_castsi128_ps (lo), _mm_castsi128_ps (hi), 
+			 _MM_SHUFFLE (2, 0, 2, 0))));
+		count[v] = _mm_add_epi32 (count[v], pair);
+		blue[v] = _mm_add_epi32 (blue[v], odd);
+		if (low & 1) {
+		    red[v] = _mm_add_epi32 (red[v], pair);
+		}
+		if (low & 2) {
+		    green[v] = _mm_add_epi32 (green[v], pair);
+		}
+		if (low & 4) {
+		    green[v] = _mm_add_epi32 (green[v], 
+		    			      _mm_slli_epi32 (pair, 1));
+		}
+	    }
+	}
+	for (v = 0; 4 > v; v++) {
+	    node = (rg << 4) | (v << 2);
+	    _mm_storeu_si128 ((__m128i*)&h->count[node], count[v]);
+	    _mm_storeu_si128 ((__m128i*)&low_red[v << 2], red[v]);
+	    _mm_storeu_si128 ((__m128i*)&low_green[v << 2], green[v]);
+	    _mm_storeu_si128 ((__m128i*)&low_blue[v << 2], blue[v]);
+	}
+	for (v = 0; 16 > v; v++) {
+	    node = (rg << 4) | v;
+	    h->red[node] = low_red[v] + 
+	    		   (uint64_t)h->count[node] * ((rg >> 4) << 1);
+	    h->green[node] = low_green[v] + 
+	    		     (uint64_t)h->count[node] * ((rg & 0xF) << 2);
+	    h->blue[node] = low_blue[v] + 
+	    		    (uint64_t)h->count[node] * (v << 1);
+	}
+    }
+}
+#endif /* defined(HIST_SSE2) */
+
+
+/* 
+ * select_top_nodes
+ *   DESCRIPTION: Find the (up to) 128 level-4 nodes with the most pixels,
+ *                skipping empty nodes.  Nodes with equal counts are 
+ *                ranked by node number, lowest first, so the palette 
+ *                does not depend on the sorting algorithm used.  A 
+ *                min-heap holds the best nodes seen so far, with the 
+ *                worst of them at the root, so each node costs a single
+ *                comparison unless it displaces the root.
+ *   INPUTS: h -- the histogram
+ *   OUTPUTS: top -- the nodes selected, most pixels first
+ *   RETURN VALUE: number of nodes selected
+ *   SIDE EFFECTS: none
+ */
+static int32_t
+select_top_nodes (const photo_hist_t* h, uint16_t top[128])
+{
+    uint16_t heap[128];	/* best nodes so far, worst at root */
+    int32_t  n = 0;	/* number of nodes in heap          */
+    int32_t  n_top;	/* number of nodes selected         */
+    int32_t  node;	/* index over nodes                 */
+    int32_t  pos;	/* position in heap                 */
+    int32_t  child;	/* worse child of pos               */
+    uint16_t tmp;	/* node being moved in heap         */
+
+/* 
+ * Is node a ranked below node b?  Nodes are visited in increasing order,
+ * so a node with the same count as the root ranks below it.
+ */
+#define RANKS_BELOW(a,b)                                             \
+    (h->count[a] < h->count[b] || (h->count[a] == h->count[b] && (a) > (b)))
+
+    for (node = 0; 4096 > node; node++) {
+	if (0 == h->count[node]) {
+	    continue;
+	}
+	if (128 > n) {
+	    /* Add the node at the bottom and move it up past better nodes. */
+	    for (pos = n++; 0 < pos && RANKS_BELOW (node, heap[(pos - 1) / 2]);
+	    	 pos = (pos - 1) / 2) {
+		heap[pos] = heap[(pos - 1) / 2];
+	    }
+	    heap[pos] = node;
+	} else if (h->count[node] > h->count[heap[0]]) {
+	    /* Replace the root and move it down past worse nodes. */
+	    for (pos = 0; (child = 2 * pos + 1) < n; pos = child) {
+		if (child + 1 < n && 
+		    RANKS_BELOW (heap[child + 1], heap[child])) {
+		    child++;
+		}
+		if (!RANKS_BELOW (heap[child], node)) {
+		    break;
+		}
+		heap[pos] = heap[child];
+	    }
+	    heap[pos] = node;
+	}
+    }
+
+    /* Remove the worst node repeatedly, filling top from the end. */
+    for (n_top = n; 0 < n; ) {
+	top[--n] = heap[0];
+	tmp = heap[n];
+	for (pos = 0; (child = 2 * pos + 1) < n; pos = child) {
+	    if (child + 1 < n && 
+		RANKS_BELOW (heap[child + 1], heap[child])) {
+		child++;
+	    }
+	    if (!RANKS_BELOW (heap[child], tmp)) {
+		break;
+	    }
+	    heap[pos] = heap[child];
+	}
+	heap[pos] = tmp;
+    }
+    return n_top;
+
+#undef RANKS_BELOW
+}
+
+
 
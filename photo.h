@@ -51,6 +51,13 @@
 #define MAX_PHOTO_HEIGHT  1024
 #define MAX_OBJECT_WIDTH  160
 #define MAX_OBJECT_HEIGHT 100
+
+/* 
+ * larger room photos are streamed from their files a few tiles at a 
+ * time, up to this size
+ */
+#define MAX_STREAM_WIDTH  16384
+#define MAX_STREAM_HEIGHT 16384
 #define red_blue_mask 0x1F // RGB = 5:6:5,red and blue need 5 bit
 #define green_mask  0x3F // RGB = 5:6:5, green need 6 bit
 #define level2_mask 0x3  // RGB = 2:2:2
@@ -60,18 +67,94 @@
 struct octree {
     size_t node_number;
     size_t pixel_loop_counter;
-    size_t red_sum;
-    size_t green_sum;
-    size_t blue_sum;
+    uint64_t red_sum;
+    uint64_t green_sum;
+    uint64_t blue_sum;
+
+};
+
+/* counters kept for photos opened with open_photo and for prep_room */
+typedef struct photo_lru_stats_t photo_lru_stats_t;
+struct photo_lru_stats_t {
+    uint32_t hits;		/* uses of a photo already in memory  */
+    uint32_t misses;		/* uses that loaded a photo           */
+    uint32_t evictions;		/* photos unloaded to fit the budget  */
+    size_t   resident_bytes;	/* pixel data currently in memory     */
+    size_t   peak_bytes;	/* largest value of resident_bytes    */
+    uint32_t prefetches;	/* photos loaded by the prefetcher    */
+    uint32_t prefetch_drops;	/* prefetched photos no longer wanted */
+    uint32_t prefetch_waits;	/* uses that waited for a prefetch    */
+    uint32_t previews;		/* misses shown first with a preview  */
+    uint32_t refines;		/* previews replaced by full photos   */
+    uint32_t entries;		/* calls to prep_room                 */
+    uint64_t entry_usec;	/* total time spent in prep_room      */
+    uint32_t entry_max_usec;	/* longest time spent in prep_room    */
+};
 
+/* counters kept for composited rooms (see set_room_layer_budget) */
+typedef struct room_layer_stats_t room_layer_stats_t;
+struct room_layer_stats_t {
+    uint32_t hits;		/* room entries that found a layer    */
+    uint32_t misses;		/* room entries that had to composite */
+    uint32_t too_large;		/* misses over the budget (no layer)  */
+    uint32_t evictions;		/* layers dropped to fit the budget   */
+    uint32_t updates;		/* areas composited again after an    */
+				/*   object entered or left           */
+    size_t   resident_bytes;	/* composited pixels in memory        */
+    size_t   peak_bytes;	/* largest value of resident_bytes    */
+};
+
+/* 
+ * Costs and quality of quantizing one room photo.  Times are recorded 
+ * whenever a photo is quantized (not when it comes from the on-disk
+ * cache); the error measures only when set_photo_quant_stats is on.
+ */
+typedef struct photo_quant_stats_t photo_quant_stats_t;
+struct photo_quant_stats_t {
+    const char* quantizer;	/* name of quantizer used             */
+    const char* dither;		/* name of dithering mode used        */
+    uint32_t    read_usec;	/* mapping file and allocating pixels */
+    uint32_t    hist_usec;	/* counting colors                    */
+    uint32_t    select_usec;	/* choosing palette and color map     */
+    uint32_t    remap_usec;	/* mapping pixels to the palette      */
+    double      mse;		/* mean squared error per 6-bit field */
+				/*   (-1 if not measured)             */
+    double      psnr;		/* peak signal-to-noise ratio in dB   */
+};
+
+/* 
+ * What loading one room photo read and produced, for startup profiling.
+ * Palette use is counted only when set_photo_load_stats is on: for the
+ * popular quantizer, the slots counted are the 128 level-4 colors; for
+ * the others, all 192 colors chosen for the photo.
+ */
+typedef struct photo_load_stats_t photo_load_stats_t;
+struct photo_load_stats_t {
+    int32_t     cached;		/* 1 if read from the on-disk cache   */
+    size_t      bytes_read;	/* size of photo or cache file        */
+    int32_t     slots_used;	/* palette slots used by some pixel   */
+				/*   (-1 if not counted)              */
+    int32_t     slots;		/* palette slots counted              */
 };
-// compare function for qsort
-extern int compare_function(const void *a, const void *b);
 
 
 /* Fill a buffer with the pixels for a horizontal line of current room. */
 extern void fill_horiz_buffer (int x, int y, unsigned char buf[SCROLL_X_DIM]);
 
+/* 
+ * Write the pixels for a horizontal line of current room directly into
+ * the four planes of the mode X build buffer, if the room photo is 
+ * split into planes; see photo.c.  Returns -1 if it is not.
+ */
+extern int fill_horiz_planes (int x, int y, unsigned char* plane[4]);
+
+/* 
+ * Draw the opaque pixels of one row of an object image over a line 
+ * buffer, with image column start at buf[0].
+ */
+extern void draw_image_row (const image_t* im, int32_t row, int32_t start,
+			    unsigned char buf[SCROLL_X_DIM]);
+
 /* Fill a buffer with the pixels for a vertical line of current room. */
 extern void fill_vert_buffer (int x, int y, unsigned char buf[SCROLL_Y_DIM]);
 
@@ -81,6 +164,13 @@ extern uint32_t image_height (const image_t* im);
 /* Get width of object image in pixels. */
 extern uint32_t image_width (const image_t* im);
 
+/* 
+ * Get the box holding the opaque pixels of an object image, as the 
+ * columns [left,right) and rows [top,bottom) (all 0 if there are none).
+ */
+extern void image_opaque_box (const image_t* im, int32_t* left, 
+			      int32_t* right, int32_t* top, int32_t* bottom);
+
 /* Get height of room photo in pixels. */
 extern uint32_t photo_height (const photo_t* p);
 
@@ -93,19 +183,103 @@ extern uint32_t photo_width (const photo_t* p);
  */
 extern void prep_room (const room_t* r);
 
+/* 
+ * Replace a preview of the room on the screen with the full photo once
+ * it is ready.  Returns 1 if the room must then be redrawn.
+ */
+extern int32_t refine_room (void);
+
 /* Read object image from a file into a dynamically allocated structure. */
 extern image_t* read_obj_image (const char* fname);
 
+/* 
+ * Share an object image with any earlier one of the same contents, and
+ * prepare it for drawing; see photo.c.  Returns the image to use in 
+ * place of im, which may be freed, or NULL if memory runs out.
+ */
+extern image_t* share_obj_image (image_t* im);
+
 /* Read room photo from a file into a dynamically allocated structure. */
 extern photo_t* read_photo (const char* fname);
 
 /* 
- * N.B.  I'm aware that Valgrind and similar tools will report the fact that
- * I chose not to bother freeing image data before terminating the program.
- * It's probably a bad habit, but ... maybe in a future release (FIXME).
- * (The data are needed until the program terminates, and all data are freed
- * when a program terminates.)
+ * Create a room photo structure whose pixel data are read from the file
+ * on first use and may later be unloaded (see set_photo_budget).
+ */
+extern photo_t* open_photo (const char* fname);
+
+/* Load a room photo if necessary and mark it as most recently used. */
+extern void photo_use (photo_t* p);
+
+/* Load photos from open_photo in the background, in order given. */
+extern void photo_prefetch (photo_t* const* list, int32_t n);
+
+/* Limit the pixel data kept in memory for photos from open_photo. */
+extern void set_photo_budget (size_t bytes);
+
+/* Get the load and unload counters for photos from open_photo. */
+extern void get_photo_lru_stats (photo_lru_stats_t* stats);
+
+/* 
+ * Keep up to the given number of bytes of rooms composited with their
+ * objects, so that lines are drawn by copying (0, the default, for 
+ * none); see room_layer_t in photo.c.
+ */
+extern void set_room_layer_budget (size_t bytes);
+
+/* Get the hit and miss counters for composited rooms. */
+extern void get_room_layer_stats (room_layer_stats_t* stats);
+
+/* 
+ * Bring the area [left,right) by [top,bottom) of room r up to date in its
+ * composited layer, if any, after an object entered or left it.
+ */
+extern void update_room_layer (const room_t* r, int32_t left, 
+			       int32_t right, int32_t top, int32_t bottom);
+
+/* Measure the error of each photo quantized from now on if on is 1. */
+extern void set_photo_quant_stats (int32_t on);
+
+/* 
+ * Get the costs of quantizing a photo.  Returns -1 if the photo was not
+ * quantized (it has not been loaded, or was loaded from the cache).
+ */
+extern int32_t get_photo_quant_stats (const photo_t* p, 
+				      photo_quant_stats_t* stats);
+
+/* 
+ * Use at most n threads (0 for no limit beyond that set in the 
+ * environment) to quantize each photo loaded from now on.
+ */
+extern void set_photo_quant_threads (int32_t n);
+
+/* 
+ * Draw rows of object images whose opaque spans average fewer than 
+ * span_pixels pixels (0 for none) with the named masked blit ("scalar",
+ * "sse2", or "avx2") from now on; see photo.c.  Returns -1 if the name
+ * is unknown or the processor cannot run the blit.
+ */
+extern int32_t set_obj_blit (const char* name, int32_t span_pixels);
+
+/* Count the palette slots used by each photo loaded from now on if on is 1. */
+extern void set_photo_load_stats (int32_t on);
+
+/* 
+ * Get what loading a photo read and produced.  Returns -1 if the photo 
+ * has not been loaded.
+ */
+extern int32_t get_photo_load_stats (const photo_t* p, 
+				     photo_load_stats_t* stats);
+
+/* Get the bytes of pixel data a photo holds in memory (0 if none). */
+extern size_t photo_resident_bytes (const photo_t* p);
+
+/* 
+ * Release all memory held for room photos and object images, which are
+ * carved from one arena (see arena.c).  Called just before the program 
+ * exits; no photo or image may be used afterward.
  */
+extern void release_photos (void);
 
 #endif /* PHOTO_H */
 
@@ -0,0 +1,260 @@
+/*									tab:8
+ *
+ * photo_cache.c - on-disk cache of quantized room photos
+ *
+ * Version:	    1
+ * Creation Date:   Sun Oct 18 10:12:40 2026
+ * Filename:	    photo_cache.c
+ * History:
+ *	1	Sun Oct 18 10:12:40 2026
+ *		First written.
+ */
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "photo_cache.h"
+
+
+/* parameters defined for this file */
+
+#define CACHE_MAGIC    "ADVQPC1"	/* identifies version 1 cache files */
+#define CACHE_PATH_LEN 256		/* longest source path recorded     */
+
+
+/* types local to this file */
+
+/*
+ * Header of a cache file.  The header is followed immediately by the
+ * palette-indexed pixels (width * height bytes, top row first).  Field
+ * order and the explicit padding keep the layout the same for 32- and
+ * 64-bit builds.  The source path, size, and modification time identify
+ * the photo file from which the entry was generated; the variant
+ * identifies the quantization settings used.
+ */
+typedef struct cache_header_t cache_header_t;
+struct cache_header_t {
+    char           magic[8];		/* CACHE_MAGIC                 */
+    int64_t        src_mtime_sec;	/* source modification time    */
+    int64_t        src_mtime_nsec;
+    uint32_t       src_size;		/* source file size in bytes   */
+    uint32_t       variant;		/* quantization settings       */
+    char           src_path[CACHE_PATH_LEN]; /* source file name       */
+    photo_header_t hdr;			/* photo width and height      */
+    uint8_t        palette[192][3];	/* optimized palette colors    */
+    uint8_t        pad[4];		/* round size to 8 bytes       */
+};
+
+
+/* functions local to this file--see function headers for details */
+
+static const char* cache_dir (void);
+static int32_t cache_file_name (const char* fname, char* buf, size_t len);
+
+
+/*
+ * cache_dir
+ *   DESCRIPTION: Find the directory that holds cache files.
+ *   INPUTS: none
+ *   OUTPUTS: none
+ *   RETURN VALUE: directory name, or NULL if caching is disabled
+ *   SIDE EFFECTS: none
+ */
+static const char*
+cache_dir ()
+{
+    const char* dir = getenv (PHOTO_CACHE_ENV);
+
+    if (NULL == dir) {
+        return PHOTO_CACHE_DEFAULT;
+    }
+    return ('\0' == *dir ? NULL : dir);
+}
+
+
+/*
+ * cache_file_name
+ *   DESCRIPTION: Produce the name of the cache file for a photo file.
+ *                The name combines the base name of the photo with a
+ *                hash of its full path so that photos with the same
+ *                base name in different directories do not collide.
+ *   INPUTS: fname -- photo file name
+ *           len -- size of buf in bytes
+ *   OUTPUTS: buf -- cache file name
+ *   RETURN VALUE: 0 on success, -1 if caching is disabled or the name
+ *                 does not fit
+ *   SIDE EFFECTS: none
+ */
+static int32_t
+cache_file_name (const char* fname, char* buf, size_t len)
+{
+    const char* dir;		/* cache directory             */
+    const char* base;		/* base name of photo file     */
+    const char* scan;		/* index over path characters  */
+    uint32_t    hash;		/* FNV-1a hash of the path     */
+    int         n;		/* length of name produced     */
+
+    if (NULL == (dir = cache_dir ()) || CACHE_PATH_LEN <= strlen (fname)) {
+        return -1;
+    }
+    hash = 2166136261U;
+    for (scan = base = fname; '\0' != *scan; scan++) {
+        hash = (hash ^ (uint8_t)*scan) * 16777619U;
+	if ('/' == *scan) {
+	    base = scan + 1;
+	}
+    }
+    n = snprintf (buf, len, "%s/%s-%08x", dir, base, hash);
+    return (0 > n || len <= (size_t)n ? -1 : 0);
+}
+
+
+/*
+ * photo_cache_lookup
+ *   DESCRIPTION: Look up the quantized version of a photo file.  A hit
+ *                costs one stat of the source, one open and mmap of the
+ *                cache file, and a header check; no pixel data are
+ *                copied.
+ *   INPUTS: fname -- photo file name
+ *           variant -- quantization settings required
+ *   OUTPUTS: ent -- on a hit, the cached header, palette, and pixels
+ *   RETURN VALUE: 0 on a hit, -1 on a miss (missing or stale entry)
+ *   SIDE EFFECTS: maps the cache file on a hit
+ */
+int32_t
+photo_cache_lookup (const char* fname, uint32_t variant,
+		    photo_cache_entry_t* ent)
+{
+    char                  cname[CACHE_PATH_LEN * 2]; /* cache file name */
+    struct stat           src;	/* source file status              */
+    struct stat           st;	/* cache file status               */
+    int                   fd;	/* cache file descriptor           */
+    void*                 map;	/* mapping of cache file           */
+    const cache_header_t* h;	/* header at start of mapping      */
+
+    if (0 != cache_file_name (fname, cname, sizeof (cname)) ||
+        0 != stat (fname, &src) ||
+	-1 == (fd = open (cname, O_RDONLY))) {
+	return -1;
+    }
+    if (0 != fstat (fd, &st) || sizeof (*h) > (size_t)st.st_size ||
+	MAP_FAILED == (map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+				   fd, 0))) {
+	(void)close (fd);
+        return -1;
+    }
+    (void)close (fd);
+
+    /* The entry must match both the source file and the settings. */
+    h = map;
+    if (0 != memcmp (h->magic, CACHE_MAGIC, sizeof (h->magic)) ||
+	src.st_size != h->src_size ||
+	src.st_mtim.tv_sec != h->src_mtime_sec ||
+	src.st_mtim.tv_nsec != h->src_mtime_nsec ||
+	variant != h->variant ||
+	0 != strncmp (fname, h->src_path, CACHE_PATH_LEN) ||
+	sizeof (*h) + (size_t)h->hdr.width * h->hdr.height !=
+		(size_t)st.st_size) {
+	(void)munmap (map, st.st_size);
+        return -1;
+    }
+
+    ent->map = map;
+    ent->map_len = st.st_size;
+    ent->hdr = h->hdr;
+    ent->palette = h->palette;
+    ent->img = (const uint8_t*)(h + 1);
+    return 0;
+}
+
+
+/*
+ * photo_cache_release
+ *   DESCRIPTION: Release the mapping behind a cache entry.
+ *   INPUTS: ent -- the entry
+ *   OUTPUTS: none
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: unmaps the cache file; the entry's pointers become
+ *                 invalid
+ */
+void
+photo_cache_release (photo_cache_entry_t* ent)
+{
+    if (NULL != ent->map) {
+	(void)munmap (ent->map, ent->map_len);
+	ent->map = NULL;
+    }
+}
+
+
+/*
+ * photo_cache_store
+ *   DESCRIPTION: Write the quantized version of a photo file to the
+ *                cache.  The entry is written to a temporary file and
+ *                renamed into place, so readers (including other
+ *                threads and processes) never see a partial entry.
+ *   INPUTS: fname -- photo file name
+ *           variant -- quantization settings used
+ *           hdr -- photo width and height
+ *           palette -- the photo's 192 optimized colors
+ *           img -- palette-indexed pixels, top row first
+ *   OUTPUTS: none
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: may create the cache directory and a cache file
+ */
+void
+photo_cache_store (const char* fname, uint32_t variant,
+		   const photo_header_t* hdr, const uint8_t palette[192][3],
+		   const uint8_t* img)
+{
+    char           cname[CACHE_PATH_LEN * 2]; /* cache file name      */
+    char           tname[CACHE_PATH_LEN * 2]; /* temporary file name  */
+    struct stat    src;		/* source file status                 */
+    cache_header_t h;		/* header to be written               */
+    size_t         len;		/* number of pixel bytes              */
+    FILE*          out;		/* temporary file stream              */
+    int            fd;		/* temporary file descriptor          */
+    int            ok;		/* 1 if all writes succeeded          */
+
+    if (0 != cache_file_name (fname, cname, sizeof (cname)) ||
+        0 != stat (fname, &src) ||
+	(0 != mkdir (cache_dir (), 0755) && EEXIST != errno)) {
+	return;
+    }
+    (void)snprintf (tname, sizeof (tname), "%s/.tmp-XXXXXX", cache_dir ());
+    if (-1 == (fd = mkstemp (tname))) {
+        return;
+    }
+    if (NULL == (out = fdopen (fd, "wb"))) {
+	(void)close (fd);
+	(void)unlink (tname);
+        return;
+    }
+
+    (void)memset (&h, 0, sizeof (h));
+    (void)memcpy (h.magic, CACHE_MAGIC, sizeof (h.magic));
+    h.src_mtime_sec = src.st_mtim.tv_sec;
+    h.src_mtime_nsec = src.st_mtim.tv_nsec;
+    h.src_size = src.st_size;
+    h.variant = variant;
+    (void)strncpy (h.src_path, fname, CACHE_PATH_LEN - 1);
+    h.hdr = *hdr;
+    (void)memcpy (h.palette, palette, sizeof (h.palette));
+    len = (size_t)hdr->width * hdr->height;
+
+    ok = (1 == fwrite (&h, sizeof (h), 1, out) &&
+	  (0 == len || 1 == fwrite (img, len, 1, out)));
+    if (EOF == fclose (out)) {
+        ok = 0;
+    }
+    if (!ok || 0 != rename (tname, cname)) {
+	(void)unlink (tname);
+    }
+}
@@ -0,0 +1,65 @@
+/*									tab:8
+ *
+ * photo_cache.h - on-disk cache of quantized room photos (header file)
+ *
+ * Version:	    1
+ * Creation Date:   Sun Oct 18 10:12:40 2026
+ * Filename:	    photo_cache.h
+ * History:
+ *	1	Sun Oct 18 10:12:40 2026
+ *		First written.
+ */
+#ifndef PHOTO_CACHE_H
+#define PHOTO_CACHE_H
+
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "photo_headers.h"
+
+
+/*
+ * environment variable naming the cache directory; setting it to an
+ * empty string disables the cache
+ */
+#define PHOTO_CACHE_ENV     "ADV_PHOTO_CACHE"
+#define PHOTO_CACHE_DEFAULT ".photo_cache"
+
+/*
+ * A quantized photo found in the cache.  The palette and pixel pointers
+ * refer directly into a read-only mapping of the cache file, which must
+ * be released with photo_cache_release once the data are no longer
+ * needed.
+ */
+typedef struct photo_cache_entry_t photo_cache_entry_t;
+struct photo_cache_entry_t {
+    void*          map;			/* mapping of the cache file   */
+    size_t         map_len;		/* length of the mapping       */
+    photo_header_t hdr;			/* photo width and height      */
+    const uint8_t  (*palette)[3];	/* 192 optimized colors        */
+    const uint8_t* img;			/* palette-indexed pixels      */
+};
+
+/*
+ * Look up the quantized version of photo file fname.  The variant value
+ * identifies the quantization settings; an entry produced with other
+ * settings, or from an older version of the source file, is stale.
+ * Returns 0 and fills *ent on a hit, or -1 on a miss.
+ */
+extern int32_t photo_cache_lookup (const char* fname, uint32_t variant,
+				   photo_cache_entry_t* ent);
+
+/* Release the mapping behind a cache entry. */
+extern void photo_cache_release (photo_cache_entry_t* ent);
+
+/*
+ * Record the quantized version of photo file fname.  Failures are
+ * silent: the cache is only an optimization.
+ */
+extern void photo_cache_store (const char* fname, uint32_t variant,
+			       const photo_header_t* hdr,
+			       const uint8_t palette[192][3],
+			       const uint8_t* img);
+
+#endif /* PHOTO_CACHE_H */
@@ -0,0 +1,229 @@
+/*									tab:8
+ *
+ * photo_pack.c - compression of room photo pixels
+ *
+ * Version:	    1
+ * Creation Date:   Sun Oct 18 15:02:47 2026
+ * Filename:	    photo_pack.c
+ * History:
+ *	1	Sun Oct 18 15:02:47 2026
+ *		First written.
+ */
+
+
+/*
+ * Blocks are packed with a byte-oriented LZ77 scheme in the style of
+ * LZ4.  A packed block is a series of sequences, each of which is
+ *
+ *     token          high four bits: number of literal bytes
+ *                    low four bits: match length - PACK_MIN_MATCH
+ *     [more length]  if the literal count field is 15, bytes added to it,
+ *                    ending with the first byte that is not 255
+ *     literals       bytes copied to the output as they are
+ *     offset         two bytes, low byte first: distance back in the
+ *                    output from which to copy the match
+ *     [more length]  as for literals, if the match length field is 15
+ *
+ * The last sequence ends after its literals, with no match.  Matches may
+ * overlap the bytes they produce, so runs of one color cost a few bytes.
+ * Photo pixels are noisy enough that an entropy coder would be needed to
+ * do much better, at several times the cost to decode.
+ */
+
+
+#include <string.h>
+
+#include "photo_pack.h"
+
+
+/* parameters defined for this file */
+
+#define PACK_MIN_MATCH 4	/* shortest match worth encoding         */
+#define PACK_HASH_BITS 12	/* log2 of number of hash chains         */
+#define PACK_MAX_TRIES 16	/* earlier positions checked per match   */
+
+
+/* functions local to this file--see function headers for details */
+
+static uint32_t hash_bytes (const uint8_t* s);
+static uint8_t* put_length (uint8_t* out, size_t n);
+
+
+/*
+ * hash_bytes
+ *   DESCRIPTION: Hash the PACK_MIN_MATCH bytes at a position.
+ *   INPUTS: s -- the bytes
+ *   OUTPUTS: none
+ *   RETURN VALUE: hash chain number
+ *   SIDE EFFECTS: none
+ */
+static uint32_t
+hash_bytes (const uint8_t* s)
+{
+    uint32_t v = s[0] | (s[1] << 8) | (s[2] << 16) | ((uint32_t)s[3] << 24);
+
+    return (v * 2654435761U) >> (32 - PACK_HASH_BITS);
+}
+
+
+/*
+ * put_length
+ *   DESCRIPTION: Write the extra bytes of a length whose field in the
+ *                token is 15.
+ *   INPUTS: n -- length beyond 15
+ *   OUTPUTS: out -- the bytes
+ *   RETURN VALUE: position after the bytes written
+ *   SIDE EFFECTS: none
+ */
+static uint8_t*
+put_length (uint8_t* out, size_t n)
+{
+    for (; 255 <= n; n -= 255) {
+        *out++ = 255;
+    }
+    *out++ = n;
+    return out;
+}
+
+
+/*
+ * photo_pack
+ *   DESCRIPTION: Pack a block of bytes.  Each position is found through
+ *                a hash of the bytes there; earlier positions with the
+ *                same hash are chained together, and the longest match
+ *                among the first PACK_MAX_TRIES of them is used.
+ *   INPUTS: src -- the bytes
+ *           len -- number of bytes (at most PHOTO_PACK_MAX)
+ *   OUTPUTS: dst -- the packed block (see the top of this file)
+ *   RETURN VALUE: packed size in bytes
+ *   SIDE EFFECTS: none
+ */
+size_t
+photo_pack (const uint8_t* src, size_t len, uint8_t* dst)
+{
+    int16_t  head[1 << PACK_HASH_BITS]; /* last position in each chain */
+    int16_t  prev[PHOTO_PACK_MAX];	/* earlier position in chain    */
+    uint8_t* out = dst;		/* next byte of output                 */
+    uint8_t* token;		/* token of sequence being written     */
+    size_t   lit = 0;		/* first literal not yet written       */
+    size_t   pos = 0;		/* position being matched              */
+    size_t   best;		/* longest match length found          */
+    size_t   best_at = 0;	/* position of longest match           */
+    size_t   n;			/* match length or literal count       */
+    int32_t  cand;		/* earlier position being checked      */
+    int32_t  tries;		/* positions left to check             */
+    uint32_t h;			/* hash at pos                         */
+
+    (void)memset (head, 0xFF, sizeof (head));
+    while (len >= pos + PACK_MIN_MATCH) {
+	h = hash_bytes (&src[pos]);
+	best = 0;
+	for (cand = head[h], tries = PACK_MAX_TRIES; 0 <= cand && 0 < tries;
+	     cand = prev[cand], tries--) {
+	    for (n = 0; len > pos + n && src[cand + n] == src[pos + n]; n++) {
+	    }
+	    if (best < n) {
+		best = n;
+		best_at = cand;
+	    }
+	}
+
+	if (PACK_MIN_MATCH > best) {
+	    prev[pos] = head[h];
+	    head[h] = pos++;
+	    continue;
+	}
+
+	/* Write the literals before the match, then the match itself. */
+	token = out++;
+	n = pos - lit;
+	*token = (15 <= n ? 15 : n) << 4;
+	if (15 <= n) {
+	    out = put_length (out, n - 15);
+	}
+	(void)memcpy (out, &src[lit], n);
+	out += n;
+	*out++ = (pos - best_at) & 0xFF;
+	*out++ = (pos - best_at) >> 8;
+	n = best - PACK_MIN_MATCH;
+	*token |= (15 <= n ? 15 : n);
+	if (15 <= n) {
+	    out = put_length (out, n - 15);
+	}
+
+	/* Add the matched positions to their hash chains. */
+	for (n = pos + best; n > pos; pos++) {
+	    if (len >= pos + PACK_MIN_MATCH) {
+		h = hash_bytes (&src[pos]);
+		prev[pos] = head[h];
+		head[h] = pos;
+	    }
+	}
+	lit = pos;
+    }
+
+    /* The last sequence holds only the remaining literals. */
+    n = len - lit;
+    *out++ = (15 <= n ? 15 : n) << 4;
+    if (15 <= n) {
+	out = put_length (out, n - 15);
+    }
+    (void)memcpy (out, &src[lit], n);
+    return (out + n) - dst;
+}
+
+
+/*
+ * photo_unpack
+ *   DESCRIPTION: Unpack a block produced by photo_pack.
+ *   INPUTS: src -- the packed block
+ *           packed_len -- its size in bytes
+ *   OUTPUTS: dst -- the original bytes
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: none
+ */
+void
+photo_unpack (const uint8_t* src, size_t packed_len, uint8_t* dst)
+{
+    const uint8_t* end = src + packed_len; /* end of packed block     */
+    const uint8_t* from;	/* start of match in output            */
+    uint8_t        token;	/* token of current sequence           */
+    size_t         n;		/* literal count or match length       */
+    size_t         offset;	/* distance back to match              */
+    uint8_t        more;	/* extra length byte                   */
+
+    while (end > src) {
+	token = *src++;
+	if (15 == (n = token >> 4)) {
+	    do {
+		n += (more = *src++);
+	    } while (255 == more);
+	}
+	(void)memcpy (dst, src, n);
+	dst += n;
+	src += n;
+	if (end <= src) {
+	    return;
+	}
+
+	offset = src[0] | (src[1] << 8);
+	src += 2;
+	if (15 == (n = token & 0x0F)) {
+	    do {
+		n += (more = *src++);
+	    } while (255 == more);
+	}
+	n += PACK_MIN_MATCH;
+
+	/* Matches may overlap their own output; copy those bytewise. */
+	from = dst - offset;
+	if (offset >= n) {
+	    (void)memcpy (dst, from, n);
+	    dst += n;
+	} else {
+	    while (0 < n--) {
+		*dst++ = *from++;
+	    }
+	}
+    }
+}
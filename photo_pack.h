@@ -0,0 +1,40 @@
+/*									tab:8
+ *
+ * photo_pack.h - compression of room photo pixels (header file)
+ *
+ * Version:	    1
+ * Creation Date:   Sun Oct 18 15:02:47 2026
+ * Filename:	    photo_pack.h
+ * History:
+ *	1	Sun Oct 18 15:02:47 2026
+ *		First written.
+ */
+#ifndef PHOTO_PACK_H
+#define PHOTO_PACK_H
+
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/* largest block of bytes that can be packed at once */
+#define PHOTO_PACK_MAX 16384
+
+/* largest packed size of a block of len bytes */
+#define PHOTO_PACK_BOUND(len) ((len) + (len) / 255 + 16)
+
+/*
+ * Pack a block of len bytes (at most PHOTO_PACK_MAX) from src into dst,
+ * which must have room for PHOTO_PACK_BOUND(len) bytes.  Each block is
+ * packed independently of all others.  Returns the packed size.
+ */
+extern size_t photo_pack (const uint8_t* src, size_t len, uint8_t* dst);
+
+/*
+ * Unpack a block produced by photo_pack, whose packed size is
+ * packed_len, into dst, which must have room for the original block.
+ */
+extern void photo_unpack (const uint8_t* src, size_t packed_len,
+			  uint8_t* dst);
+
+#endif /* PHOTO_PACK_H */
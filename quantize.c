@@ -0,0 +1,833 @@
+/*									tab:8
+ *
+ * quantize.c - palette selection for room photos
+ *
+ * Version:	    1
+ * Creation Date:   Sun Oct 18 12:40:05 2026
+ * Filename:	    quantize.c
+ * History:
+ *	1	Sun Oct 18 12:40:05 2026
+ *		First written.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "quantize.h"
+
+
+/* parameters defined for this file */
+
+#define OCTREE_DEPTH     6	/* levels below root; leaves are 6:6:6   */
+#define KMEANS_MAX_PASSES 8	/* k-means stops sooner if nothing moves */
+
+/* x86 processors may support SSE2 even if this file is not built for it */
+#if defined(__i386__) || defined(__x86_64__)
+#define QUANT_SSE2 1
+#include <emmintrin.h>
+#endif
+
+
+/* types local to this file */
+
+/*
+ * A color that appears in a photo.  The 5:6:5 color is also kept in
+ * 6:6:6 form (rgb), which is the form of palette colors.  The key is
+ * scratch space for sorting.
+ */
+typedef struct qcolor_t qcolor_t;
+struct qcolor_t {
+    uint32_t count;		/* pixels of this color         */
+    uint32_t key;		/* sort key (see median_cut)    */
+    uint16_t color;		/* 5:6:5 color                  */
+    uint8_t  rgb[3];		/* 6:6:6 color                  */
+};
+
+/*
+ * A node in the octree used by octree_palette.  Each node holds the
+ * count and field sums of all pixels below it.  Node 0 is the root.
+ */
+typedef struct onode_t onode_t;
+struct onode_t {
+    int32_t  child[8];		/* child node numbers (-1 if none) */
+    uint32_t count;		/* pixels below node               */
+    uint64_t sum[3];		/* sums of 6:6:6 fields            */
+    uint8_t  level;		/* 0 at root                       */
+    uint8_t  leaf;		/* 1 if node is a leaf             */
+    uint8_t  index;		/* palette color of leaf           */
+};
+
+/* A box of colors in median cut: entries lo to hi - 1 of the list. */
+typedef struct mbox_t mbox_t;
+struct mbox_t {
+    int32_t  lo;		/* first color in box              */
+    int32_t  hi;		/* one past last color in box      */
+    uint32_t count;		/* pixels in box                   */
+    uint8_t  min[3];		/* smallest 6:6:6 field values     */
+    uint8_t  max[3];		/* largest 6:6:6 field values      */
+};
+
+
+/* functions local to this file--see function headers for details */
+
+static void average_color (const uint64_t sum[3], uint32_t count,
+			   uint8_t rgb[3]);
+static int compare_keys (const void* a, const void* b);
+static int compare_nodes (const void* a, const void* b);
+static int32_t gather_colors (const uint32_t* counts, qcolor_t** list);
+static int32_t kmeans_palette (const qcolor_t* col, int32_t n_col,
+			       uint8_t palette[QUANT_PALETTE][3],
+			       uint8_t* color_map);
+static void measure_box (const qcolor_t* col, mbox_t* box);
+static int32_t median_cut_palette (qcolor_t* col, int32_t n_col,
+				   uint8_t palette[QUANT_PALETTE][3],
+				   uint8_t* color_map);
+static int32_t nearest_color (const uint8_t rgb[3],
+			      const uint8_t palette[QUANT_PALETTE][3],
+			      int32_t n_pal);
+#if defined(QUANT_SSE2)
+static uint8_t nearest_sse2 (const quant_lookup_t* l, const uint8_t rgb[3]);
+#endif
+static void number_leaves (onode_t* node, int32_t idx, int32_t* next,
+			   uint8_t palette[QUANT_PALETTE][3]);
+static int32_t octree_palette (const qcolor_t* col, int32_t n_col,
+			       uint8_t palette[QUANT_PALETTE][3],
+			       uint8_t* color_map);
+
+
+/* file-scope variables */
+
+const char* const quantizer_name[N_QUANTIZERS] = {
+    "popular", "octree", "median", "kmeans"
+};
+
+/* node array used by compare_nodes (set by octree_palette) */
+static __thread const onode_t* sort_nodes;
+
+
+/*
+ * quantizer_by_name
+ *   DESCRIPTION: Look up a quantizer by name (see quantizer_name).
+ *   INPUTS: name -- the name
+ *   OUTPUTS: none
+ *   RETURN VALUE: the quantizer, or -1 if the name is unknown
+ *   SIDE EFFECTS: none
+ */
+int32_t
+quantizer_by_name (const char* name)
+{
+    int32_t q;		/* index over quantizers */
+
+    for (q = 0; N_QUANTIZERS > q; q++) {
+	if (0 == strcmp (name, quantizer_name[q])) {
+	    return q;
+	}
+    }
+    return -1;
+}
+
+
+/*
+ * quantize_colors
+ *   DESCRIPTION: Choose palette colors for a photo with the given
+ *                quantizer and map each color in the photo to one of
+ *                them.  Palette colors that are not needed are black.
+ *   INPUTS: q -- the quantizer (not QUANT_POPULAR)
+ *           counts -- number of pixels of each 5:6:5 color
+ *   OUTPUTS: palette -- the 6:6:6 palette colors
+ *            color_map -- VGA color for each 5:6:5 color present
+ *   RETURN VALUE: 0 on success, or -1 on failure
+ *   SIDE EFFECTS: none
+ */
+int32_t
+quantize_colors (quantizer_t q, const uint32_t* counts,
+		 uint8_t palette[QUANT_PALETTE][3], uint8_t* color_map)
+{
+    qcolor_t* col;	/* colors present in photo */
+    int32_t   n_col;	/* number of such colors   */
+    int32_t   ret;	/* return value            */
+
+    if (0 > (n_col = gather_colors (counts, &col))) {
+        return -1;
+    }
+    (void)memset (palette, 0, QUANT_PALETTE * 3);
+    switch (q) {
+	case QUANT_OCTREE:
+	    ret = octree_palette (col, n_col, palette, color_map);
+	    break;
+	case QUANT_MEDIAN_CUT:
+	    ret = median_cut_palette (col, n_col, palette, color_map);
+	    break;
+	case QUANT_KMEANS:
+	    ret = kmeans_palette (col, n_col, palette, color_map);
+	    break;
+	default:
+	    ret = -1;
+	    break;
+    }
+    free (col);
+    return (0 > ret ? -1 : 0);
+}
+
+
+/*
+ * quantize_mse
+ *   DESCRIPTION: Compute the mean squared error per field of a quantized
+ *                photo against its 5:6:5 source.  Source colors are
+ *                widened to 6:6:6 as palette colors are (red and blue
+ *                shifted left by one bit).
+ *   INPUTS: counts -- number of pixels of each 5:6:5 color
+ *           palette -- the photo's 6:6:6 palette colors
+ *           color_map -- VGA color for each 5:6:5 color present
+ *   OUTPUTS: none
+ *   RETURN VALUE: mean squared error (0 if the photo is reproduced 
+ *                 exactly or has no pixels)
+ *   SIDE EFFECTS: none
+ */
+double
+quantize_mse (const uint32_t* counts,
+	      const uint8_t palette[QUANT_PALETTE][3],
+	      const uint8_t* color_map)
+{
+    uint64_t       sse = 0;	/* sum of squared errors        */
+    uint64_t       total = 0;	/* number of pixels             */
+    int32_t        c;		/* index over 5:6:5 colors      */
+    int32_t        dr;		/* red error                    */
+    int32_t        dg;		/* green error                  */
+    int32_t        db;		/* blue error                   */
+    const uint8_t* pal;		/* palette color used for c     */
+
+    for (c = 0; QUANT_COLORS > c; c++) {
+	if (0 != counts[c]) {
+	    pal = palette[color_map[c] - 64];
+	    dr = ((c >> 11) << 1) - pal[0];
+	    dg = ((c >> 5) & 0x3F) - pal[1];
+	    db = ((c & 0x1F) << 1) - pal[2];
+	    sse += (uint64_t)counts[c] * (dr * dr + dg * dg + db * db);
+	    total += counts[c];
+	}
+    }
+    return (0 == total ? 0.0 : (double)sse / (3 * total));
+}
+
+
+/*
+ * quantize_lookup_init
+ *   DESCRIPTION: Arrange a photo's palette for quantize_nearest.
+ *   INPUTS: palette -- the photo's 192 palette colors
+ *   OUTPUTS: l -- the palette, one array per field
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: none
+ */
+void
+quantize_lookup_init (quant_lookup_t* l,
+		      const uint8_t palette[QUANT_PALETTE][3])
+{
+    int32_t k;		/* index over palette colors */
+    int32_t j;		/* index over fields         */
+
+    for (k = 0; QUANT_PALETTE > k; k++) {
+	for (j = 0; 3 > j; j++) {
+	    l->field[j][k] = palette[k][j];
+	}
+    }
+}
+
+
+/*
+ * quantize_nearest
+ *   DESCRIPTION: Find the VGA color whose palette color is nearest to a
+ *                6:6:6 color, by squared distance.  Ties go to the 
+ *                lowest-numbered palette color, as in nearest_color.
+ *   INPUTS: l -- the photo's palette (see quantize_lookup_init)
+ *           rgb -- the color
+ *   OUTPUTS: none
+ *   RETURN VALUE: the VGA color, from 64 to 255
+ *   SIDE EFFECTS: none
+ */
+uint8_t
+quantize_nearest (const quant_lookup_t* l, const uint8_t rgb[3])
+{
+    int32_t best = 0;			/* nearest color so far         */
+    int32_t best_dist = 0x7FFFFFFF;	/* squared distance to best     */
+    int32_t dist;			/* squared distance to color k  */
+    int32_t d;				/* difference in one field      */
+    int32_t k;				/* index over palette colors    */
+    int32_t j;				/* index over fields            */
+
+#if defined(QUANT_SSE2)
+    if (__builtin_cpu_supports ("sse2")) {
+	return nearest_sse2 (l, rgb);
+    }
+#endif
+
+    for (k = 0; QUANT_PALETTE > k; k++) {
+	for (j = 0, dist = 0; 3 > j; j++) {
+	    d = rgb[j] - l->field[j][k];
+	    dist += d * d;
+	}
+	if (dist < best_dist) {
+	    best = k;
+	    best_dist = dist;
+	}
+    }
+    return 64 + best;
+}
+
+
+#if defined(QUANT_SSE2)
+/*
+ * nearest_sse2
+ *   DESCRIPTION: SSE2 version of quantize_nearest.  Eight palette colors
+ *                are measured at once; squared distances are at most 
+ *                3 * 63 * 63, so 16-bit lanes suffice.  Each lane keeps
+ *                its nearest color (the first, on ties), and the lanes
+ *                are then compared.
+ *   INPUTS: l -- the photo's palette (see quantize_lookup_init)
+ *           rgb -- the color
+ *   OUTPUTS: none
+ *   RETURN VALUE: the VGA color, from 64 to 255
+ *   SIDE EFFECTS: none
+ */
+__attribute__ ((target ("sse2")))
+static uint8_t
+nearest_sse2 (const quant_lookup_t* l, const uint8_t rgb[3])
+{
+    const __m128i r = _mm_set1_epi16 (rgb[0]);	/* color's fields     */
+    const __m128i g = _mm_set1_epi16 (rgb[1]);
+    const __m128i b = _mm_set1_epi16 (rgb[2]);
+    const __m128i step = _mm_set1_epi16 (8);	/* index increment    */
+    __m128i       idx = _mm_setr_epi16 (0, 1, 2, 3, 4, 5, 6, 7);
+    __m128i       best = _mm_set1_epi16 (0x7FFF); /* lane distances   */
+    __m128i       best_idx = _mm_setzero_si128 (); /* lane colors     */
+    __m128i       dist;		/* distances to eight colors    */
+    __m128i       d;		/* differences in one field     */
+    __m128i       closer;	/* lanes where dist < best      */
+    int16_t       lane_dist[8];	/* best distance in each lane   */
+    int16_t       lane_idx[8];	/* best color in each lane      */
+    int32_t       k;		/* index over palette colors    */
+    int32_t       i;		/* index over lanes             */
+    int32_t       found = 0;	/* nearest color                */
+
+    for (k = 0; QUANT_PALETTE > k; k += 8) {
+	d = _mm_sub_epi16 (_mm_loadu_si128 ((const __m128i*)&l->field[0][k]), 
+			   r);
+	dist = _mm_mullo_epi16 (d, d);
+	d = _mm_sub_epi16 (_mm_loadu_si128 ((const __m128i*)&l->field[1][k]), 
+			   g);
+	dist = _mm_add_epi16 (dist, _mm_mullo_epi16 (d, d));
+	d = _mm_sub_epi16 (_mm_loadu_si128 ((const __m128i*)&l->field[2][k]), 
+			   b);
+	dist = _mm_add_epi16 (dist, _mm_mullo_epi16 (d, d));
+	closer = _mm_cmplt_epi16 (dist, best);
+	best = _mm_min_epi16 (best, dist);
+	best_idx = _mm_or_si128 (_mm_and_si128 (closer, idx), 
+				 _mm_andnot_si128 (closer, best_idx));
+	idx = _mm_add_epi16 (idx, step);
+    }
+
+    _mm_storeu_si128 ((__m128i*)lane_dist, best);
+    _mm_storeu_si128 ((__m128i*)lane_idx, best_idx);
+    for (i = 1; 8 > i; i++) {
+	if (lane_dist[i] < lane_dist[found] || 
+	    (lane_dist[i] == lane_dist[found] && 
+	     lane_idx[i] < lane_idx[found])) {
+	    found = i;
+	}
+    }
+    return 64 + lane_idx[found];
+}
+#endif
+
+
+/*
+ * gather_colors
+ *   DESCRIPTION: Make a list of the colors present in a photo, in
+ *                increasing order of 5:6:5 value.
+ *   INPUTS: counts -- number of pixels of each 5:6:5 color
+ *   OUTPUTS: *list -- newly allocated list (free with free)
+ *   RETURN VALUE: number of colors in list, or -1 on failure
+ *   SIDE EFFECTS: dynamically allocates memory for the list
+ */
+static int32_t
+gather_colors (const uint32_t* counts, qcolor_t** list)
+{
+    int32_t c;		/* index over 5:6:5 colors */
+    int32_t n = 0;	/* number of colors found  */
+
+    for (c = 0; QUANT_COLORS > c; c++) {
+	n += (0 != counts[c]);
+    }
+    if (NULL == (*list = malloc ((n + 1) * sizeof (**list)))) {
+        return -1;
+    }
+    for (c = 0, n = 0; QUANT_COLORS > c; c++) {
+	if (0 != counts[c]) {
+	    (*list)[n].count = counts[c];
+	    (*list)[n].color = c;
+	    (*list)[n].rgb[0] = (c >> 11) << 1;
+	    (*list)[n].rgb[1] = (c >> 5) & 0x3F;
+	    (*list)[n].rgb[2] = (c & 0x1F) << 1;
+	    n++;
+	}
+    }
+    return n;
+}
+
+
+/*
+ * average_color
+ *   DESCRIPTION: Compute the average of a set of 6:6:6 colors, rounded
+ *                to the nearest value.
+ *   INPUTS: sum -- sums of the red, green, and blue fields
+ *           count -- number of colors summed (non-zero)
+ *   OUTPUTS: rgb -- the average color
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: none
+ */
+static void
+average_color (const uint64_t sum[3], uint32_t count, uint8_t rgb[3])
+{
+    int32_t i;		/* index over fields */
+
+    for (i = 0; 3 > i; i++) {
+	rgb[i] = (2 * sum[i] + count) / (2 * (uint64_t)count);
+    }
+}
+
+
+/*
+ * octree_palette
+ *   DESCRIPTION: Choose palette colors by octree reduction.  Every color
+ *                is added to an octree whose leaves are single 6:6:6
+ *                colors; each level of the tree takes the next bit of
+ *                the red, green, and blue fields.  Working up from the
+ *                deepest level, nodes whose children are all leaves are
+ *                turned into leaves, those with the fewest pixels first,
+ *                until at most QUANT_PALETTE leaves remain.  Each leaf
+ *                then gives one palette color, the average of its
+ *                pixels.
+ *   INPUTS: col -- colors present in photo
+ *           n_col -- number of colors in col
+ *   OUTPUTS: palette -- the 6:6:6 palette colors
+ *            color_map -- VGA color for each 5:6:5 color in col
+ *   RETURN VALUE: number of palette colors used, or -1 on failure
+ *   SIDE EFFECTS: none
+ */
+static int32_t
+octree_palette (const qcolor_t* col, int32_t n_col,
+		uint8_t palette[QUANT_PALETTE][3], uint8_t* color_map)
+{
+    onode_t* node;	/* the octree                               */
+    int32_t* order;	/* nodes at one level, for reduction        */
+    int32_t  max_nodes;	/* bound on number of nodes                 */
+    int32_t  n_nodes;	/* number of nodes                          */
+    int32_t  n_leaves;	/* number of leaves                         */
+    int32_t  n_order;	/* number of nodes in order                 */
+    int32_t  level;	/* index over tree levels                   */
+    int32_t  width;	/* bound on nodes at level                  */
+    int32_t  i;		/* index over colors or nodes               */
+    int32_t  j;		/* index over children                      */
+    int32_t  cur;	/* node being visited                       */
+    int32_t  ci;	/* child index at cur                       */
+    int32_t  next;	/* next palette color                       */
+
+    /* Each level has at most 8^level nodes, and at most n_col. */
+    for (max_nodes = 0, level = 0, width = 1; OCTREE_DEPTH >= level;
+	 level++, width *= 8) {
+	max_nodes += (width < n_col ? width : n_col);
+    }
+    node = malloc (max_nodes * sizeof (*node));
+    order = malloc (max_nodes * sizeof (*order));
+    if (NULL == node || NULL == order) {
+	free (node);
+	free (order);
+        return -1;
+    }
+
+    /* Build the tree, adding each color's pixels to every node passed. */
+    (void)memset (&node[0], 0, sizeof (node[0]));
+    (void)memset (node[0].child, -1, sizeof (node[0].child));
+    n_nodes = 1;
+    for (i = 0; n_col > i; i++) {
+	for (cur = 0, level = 0; 1; level++) {
+	    node[cur].count += col[i].count;
+	    for (j = 0; 3 > j; j++) {
+		node[cur].sum[j] += (uint64_t)col[i].count * col[i].rgb[j];
+	    }
+	    if (OCTREE_DEPTH == level) {
+		node[cur].leaf = 1;
+	        break;
+	    }
+	    ci = ((((col[i].rgb[0] >> (5 - level)) & 1) << 2) |
+		  (((col[i].rgb[1] >> (5 - level)) & 1) << 1) |
+		  ((col[i].rgb[2] >> (5 - level)) & 1));
+	    if (0 > node[cur].child[ci]) {
+		(void)memset (&node[n_nodes], 0, sizeof (node[0]));
+		(void)memset (node[n_nodes].child, -1,
+			      sizeof (node[0].child));
+		node[n_nodes].level = level + 1;
+		node[cur].child[ci] = n_nodes++;
+	    }
+	    cur = node[cur].child[ci];
+	}
+    }
+    n_leaves = n_col;
+
+    /* Reduce the tree, deepest level first. */
+    sort_nodes = node;
+    for (level = OCTREE_DEPTH - 1;
+	 0 <= level && QUANT_PALETTE < n_leaves; level--) {
+	for (i = 0, n_order = 0; n_nodes > i; i++) {
+	    if (level == node[i].level && !node[i].leaf) {
+		order[n_order++] = i;
+	    }
+	}
+	qsort (order, n_order, sizeof (order[0]), compare_nodes);
+	for (i = 0; n_order > i && QUANT_PALETTE < n_leaves; i++) {
+	    node[order[i]].leaf = 1;
+	    for (j = 0; 8 > j; j++) {
+		n_leaves -= (0 <= node[order[i]].child[j]);
+	    }
+	    n_leaves++;
+	}
+    }
+
+    /* Number the leaves, then map each color to its leaf. */
+    next = 0;
+    number_leaves (node, 0, &next, palette);
+    for (i = 0; n_col > i; i++) {
+	for (cur = 0, level = 0; !node[cur].leaf; level++) {
+	    ci = ((((col[i].rgb[0] >> (5 - level)) & 1) << 2) |
+		  (((col[i].rgb[1] >> (5 - level)) & 1) << 1) |
+		  ((col[i].rgb[2] >> (5 - level)) & 1));
+	    cur = node[cur].child[ci];
+	}
+	color_map[col[i].color] = 64 + node[cur].index;
+    }
+
+    free (node);
+    free (order);
+    return next;
+}
+
+
+/*
+ * compare_nodes
+ *   DESCRIPTION: Order octree nodes for reduction: fewest pixels first,
+ *                then by node number.  The nodes are in sort_nodes.
+ *   INPUTS: a -- pointer to first node number
+ *           b -- pointer to second node number
+ *   OUTPUTS: none
+ *   RETURN VALUE: negative if a goes first, positive if b goes first
+ *   SIDE EFFECTS: none
+ */
+static int
+compare_nodes (const void* a, const void* b)
+{
+    int32_t na = *(const int32_t*)a;	/* first node number  */
+    int32_t nb = *(const int32_t*)b;	/* second node number */
+
+    if (sort_nodes[na].count != sort_nodes[nb].count) {
+        return (sort_nodes[na].count < sort_nodes[nb].count ? -1 : 1);
+    }
+    return (na < nb ? -1 : (na > nb));
+}
+
+
+/*
+ * number_leaves
+ *   DESCRIPTION: Give palette colors to the leaves of an octree in
+ *                depth-first order.
+ *   INPUTS: node -- the octree
+ *           idx -- root of the subtree to number
+ *           next -- next palette color
+ *   OUTPUTS: next -- advanced past the colors used
+ *            palette -- colors for the leaves
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: none
+ */
+static void
+number_leaves (onode_t* node, int32_t idx, int32_t* next,
+	       uint8_t palette[QUANT_PALETTE][3])
+{
+    int32_t j;		/* index over children */
+
+    if (node[idx].leaf) {
+	node[idx].index = *next;
+	average_color (node[idx].sum, node[idx].count, palette[(*next)++]);
+	return;
+    }
+    for (j = 0; 8 > j; j++) {
+	if (0 <= node[idx].child[j]) {
+	    number_leaves (node, node[idx].child[j], next, palette);
+	}
+    }
+}
+
+
+/*
+ * median_cut_palette
+ *   DESCRIPTION: Choose palette colors by median cut.  Starting with one
+ *                box holding all colors, repeatedly split the box with
+ *                the largest product of pixel count and longest side
+ *                across that side, at the pixel-weighted median, until
+ *                there are QUANT_PALETTE boxes or no box can be split.
+ *                Each box then gives one palette color, the average of
+ *                its pixels.
+ *   INPUTS: col -- colors present in photo
+ *           n_col -- number of colors in col
+ *   OUTPUTS: col -- reordered
+ *            palette -- the 6:6:6 palette colors
+ *            color_map -- VGA color for each 5:6:5 color in col
+ *   RETURN VALUE: number of palette colors used
+ *   SIDE EFFECTS: none
+ */
+static int32_t
+median_cut_palette (qcolor_t* col, int32_t n_col,
+		    uint8_t palette[QUANT_PALETTE][3], uint8_t* color_map)
+{
+    mbox_t   box[QUANT_PALETTE];	/* the boxes                    */
+    int32_t  n_box;			/* number of boxes              */
+    int32_t  best;			/* box to split next            */
+    uint64_t best_score;		/* score of best box            */
+    uint64_t score;			/* score of box being checked   */
+    int32_t  axis;			/* longest side of box          */
+    int32_t  b;				/* index over boxes             */
+    int32_t  i;				/* index over colors            */
+    int32_t  j;				/* index over fields            */
+    uint32_t half;			/* pixels in first half         */
+    uint64_t sum[3];			/* field sums for a box         */
+
+    if (0 == n_col) {
+        return 0;
+    }
+    box[0].lo = 0;
+    box[0].hi = n_col;
+    measure_box (col, &box[0]);
+    for (n_box = 1; QUANT_PALETTE > n_box; n_box++) {
+
+	/* Find the box to split: ties go to the lowest-numbered box. */
+	best = -1;
+	best_score = 0;
+	for (b = 0; n_box > b; b++) {
+	    if (2 > box[b].hi - box[b].lo) {
+		continue;
+	    }
+	    for (j = 0, axis = 0; 3 > j; j++) {
+		if (box[b].max[j] - box[b].min[j] >
+		    box[b].max[axis] - box[b].min[axis]) {
+		    axis = j;
+		}
+	    }
+	    score = (uint64_t)box[b].count *
+		    (box[b].max[axis] - box[b].min[axis]);
+	    if (-1 == best || score > best_score) {
+		best = b;
+		best_score = score;
+	    }
+	}
+	if (-1 == best) {
+	    break;
+	}
+
+	/* Sort the box along its longest side; ties go by color. */
+	for (j = 0, axis = 0; 3 > j; j++) {
+	    if (box[best].max[j] - box[best].min[j] >
+		box[best].max[axis] - box[best].min[axis]) {
+		axis = j;
+	    }
+	}
+	for (i = box[best].lo; box[best].hi > i; i++) {
+	    col[i].key = (col[i].rgb[axis] << 16) | col[i].color;
+	}
+	qsort (&col[box[best].lo], box[best].hi - box[best].lo,
+	       sizeof (col[0]), compare_keys);
+
+	/* Split at the median pixel, leaving at least one color in each. */
+	for (i = box[best].lo, half = 0; box[best].hi - 1 > i + 1 &&
+	     2 * (half + col[i].count) <= box[best].count; i++) {
+	    half += col[i].count;
+	}
+	box[n_box].lo = i + 1;
+	box[n_box].hi = box[best].hi;
+	box[best].hi = i + 1;
+	measure_box (col, &box[best]);
+	measure_box (col, &box[n_box]);
+    }
+
+    /* Average each box and map its colors. */
+    for (b = 0; n_box > b; b++) {
+	sum[0] = sum[1] = sum[2] = 0;
+	for (i = box[b].lo; box[b].hi > i; i++) {
+	    for (j = 0; 3 > j; j++) {
+		sum[j] += (uint64_t)col[i].count * col[i].rgb[j];
+	    }
+	    color_map[col[i].color] = 64 + b;
+	}
+	average_color (sum, box[b].count, palette[b]);
+    }
+    return n_box;
+}
+
+
+/*
+ * measure_box
+ *   DESCRIPTION: Find the pixel count and bounds of a median cut box.
+ *   INPUTS: col -- colors present in photo
+ *           box -- the box (lo and hi set)
+ *   OUTPUTS: box -- count, min, and max set
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: none
+ */
+static void
+measure_box (const qcolor_t* col, mbox_t* box)
+{
+    int32_t i;		/* index over colors */
+    int32_t j;		/* index over fields */
+
+    box->count = 0;
+    for (j = 0; 3 > j; j++) {
+	box->min[j] = 63;
+	box->max[j] = 0;
+    }
+    for (i = box->lo; box->hi > i; i++) {
+	box->count += col[i].count;
+	for (j = 0; 3 > j; j++) {
+	    if (box->min[j] > col[i].rgb[j]) {
+		box->min[j] = col[i].rgb[j];
+	    }
+	    if (box->max[j] < col[i].rgb[j]) {
+		box->max[j] = col[i].rgb[j];
+	    }
+	}
+    }
+}
+
+
+/*
+ * compare_keys
+ *   DESCRIPTION: Order colors by increasing sort key.
+ *   INPUTS: a -- pointer to first color
+ *           b -- pointer to second color
+ *   OUTPUTS: none
+ *   RETURN VALUE: negative if a goes first, positive if b goes first
+ *   SIDE EFFECTS: none
+ */
+static int
+compare_keys (const void* a, const void* b)
+{
+    uint32_t ka = ((const qcolor_t*)a)->key;	/* first key  */
+    uint32_t kb = ((const qcolor_t*)b)->key;	/* second key */
+
+    return (ka < kb ? -1 : (ka > kb));
+}
+
+
+/*
+ * kmeans_palette
+ *   DESCRIPTION: Choose palette colors by k-means refinement of the
+ *                octree palette.  Each pass maps every color to the
+ *                nearest palette color (the lowest-numbered on ties) and
+ *                then moves each palette color to the average of the
+ *                pixels mapped to it.  Passes stop after
+ *                KMEANS_MAX_PASSES or when no color changes palette
+ *                color.
+ *   INPUTS: col -- colors present in photo
+ *           n_col -- number of colors in col
+ *   OUTPUTS: palette -- the 6:6:6 palette colors
+ *            color_map -- VGA color for each 5:6:5 color in col
+ *   RETURN VALUE: number of palette colors used, or -1 on failure
+ *   SIDE EFFECTS: none
+ */
+static int32_t
+kmeans_palette (const qcolor_t* col, int32_t n_col,
+		uint8_t palette[QUANT_PALETTE][3], uint8_t* color_map)
+{
+    uint32_t count[QUANT_PALETTE];	/* pixels mapped to color       */
+    uint64_t sum[QUANT_PALETTE][3];	/* field sums of those pixels   */
+    int32_t  n_pal;			/* number of palette colors     */
+    int32_t  pass;			/* index over passes            */
+    int32_t  moved;			/* colors changed this pass     */
+    int32_t  i;				/* index over colors            */
+    int32_t  k;				/* index over palette colors    */
+    int32_t  j;				/* index over fields            */
+    int32_t  best;			/* nearest palette color        */
+
+    if (0 > (n_pal = octree_palette (col, n_col, palette, color_map))) {
+        return -1;
+    }
+    for (pass = 0, moved = 1; KMEANS_MAX_PASSES > pass && 0 != moved;
+	 pass++) {
+
+	/* Map each color to the nearest palette color. */
+	(void)memset (count, 0, sizeof (count));
+	(void)memset (sum, 0, sizeof (sum));
+	for (i = 0, moved = 0; n_col > i; i++) {
+	    best = nearest_color (col[i].rgb, palette, n_pal);
+	    moved += (64 + best != color_map[col[i].color]);
+	    color_map[col[i].color] = 64 + best;
+	    count[best] += col[i].count;
+	    for (j = 0; 3 > j; j++) {
+		sum[best][j] += (uint64_t)col[i].count * col[i].rgb[j];
+	    }
+	}
+
+	/* Move each palette color to its pixels' average. */
+	for (k = 0; n_pal > k; k++) {
+	    if (0 != count[k]) {
+		average_color (sum[k], count[k], palette[k]);
+	    }
+	}
+    }
+
+    /*
+     * The last pass moved the palette colors after mapping, so map once
+     * more if anything changed.
+     */
+    if (0 != moved) {
+	for (i = 0; n_col > i; i++) {
+	    best = nearest_color (col[i].rgb, palette, n_pal);
+	    color_map[col[i].color] = 64 + best;
+	}
+    }
+    return n_pal;
+}
+
+
+/*
+ * nearest_color
+ *   DESCRIPTION: Find the palette color nearest to a 6:6:6 color, by
+ *                squared distance.  Ties go to the lowest-numbered
+ *                palette color.
+ *   INPUTS: rgb -- the color
+ *           palette -- the palette colors
+ *           n_pal -- number of palette colors (non-zero)
+ *   OUTPUTS: none
+ *   RETURN VALUE: the number of the nearest palette color
+ *   SIDE EFFECTS: none
+ */
+static int32_t
+nearest_color (const uint8_t rgb[3], const uint8_t palette[QUANT_PALETTE][3],
+	       int32_t n_pal)
+{
+    int32_t best = 0;			/* nearest color so far         */
+    int32_t best_dist = 0x7FFFFFFF;	/* squared distance to best     */
+    int32_t dist;			/* squared distance to color k  */
+    int32_t d;				/* difference in one field      */
+    int32_t k;				/* index over palette colors    */
+    int32_t j;				/* index over fields            */
+
+    for (k = 0; n_pal > k; k++) {
+	for (j = 0, dist = 0; 3 > j; j++) {
+	    d = rgb[j] - palette[k][j];
+	    dist += d * d;
+	}
+	if (dist < best_dist) {
+	    best = k;
+	    best_dist = dist;
+	}
+    }
+    return best;
+}
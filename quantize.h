@@ -0,0 +1,90 @@
+/*									tab:8
+ *
+ * quantize.h - palette selection for room photos (header file)
+ *
+ * Version:	    1
+ * Creation Date:   Sun Oct 18 12:40:05 2026
+ * Filename:	    quantize.h
+ * History:
+ *	1	Sun Oct 18 12:40:05 2026
+ *		First written.
+ */
+#ifndef QUANTIZE_H
+#define QUANTIZE_H
+
+
+#include <stdint.h>
+
+
+/* number of 5:6:5 colors, and number of palette colors for a photo */
+#define QUANT_COLORS  65536
+#define QUANT_PALETTE 192
+
+/*
+ * Ways of choosing a photo's 192 palette colors.  Palette color i is
+ * VGA color 64 + i; VGA colors 0 to 63 are reserved for objects.
+ *
+ * QUANT_POPULAR    the 128 most common 4:4:4 colors plus all 64 2:2:2
+ *                  colors (fastest; done in photo.c)
+ * QUANT_OCTREE     octree reduction to 192 leaves
+ * QUANT_MEDIAN_CUT median cut into 192 boxes
+ * QUANT_KMEANS     k-means refinement of the octree palette (slowest)
+ */
+typedef enum {
+    QUANT_POPULAR,
+    QUANT_OCTREE,
+    QUANT_MEDIAN_CUT,
+    QUANT_KMEANS,
+    N_QUANTIZERS
+} quantizer_t;
+
+/* names accepted by quantizer_by_name, indexed by quantizer_t */
+extern const char* const quantizer_name[N_QUANTIZERS];
+
+/* Look up a quantizer by name.  Returns -1 if the name is unknown. */
+extern int32_t quantizer_by_name (const char* name);
+
+/*
+ * Choose palette colors with quantizer q (not QUANT_POPULAR) for the
+ * pixels counted in counts, which has one entry per 5:6:5 color.  Fills
+ * in the 6:6:6 palette and, for each color with a non-zero count, the
+ * VGA color used for it in color_map.  Returns 0 on success, or -1 if
+ * memory cannot be allocated.
+ */
+extern int32_t quantize_colors (quantizer_t q, const uint32_t* counts,
+				uint8_t palette[QUANT_PALETTE][3],
+				uint8_t* color_map);
+
+/*
+ * Compute the mean squared error per field of a quantized photo against
+ * its 5:6:5 source, given the source's color counts and the palette and
+ * color map chosen for it.  Both are compared as 6:6:6 colors.
+ */
+extern double quantize_mse (const uint32_t* counts,
+			    const uint8_t palette[QUANT_PALETTE][3],
+			    const uint8_t* color_map);
+
+/*
+ * A photo palette arranged for fast nearest-color searches, with the
+ * fields of all colors in separate arrays.  Fill one in with
+ * quantize_lookup_init once the palette has been chosen.
+ */
+typedef struct quant_lookup_t quant_lookup_t;
+struct quant_lookup_t {
+    int16_t field[3][QUANT_PALETTE];	/* red, green, blue of each color */
+};
+
+/* Arrange a photo's 6:6:6 palette for quantize_nearest. */
+extern void quantize_lookup_init (quant_lookup_t* l,
+				  const uint8_t palette[QUANT_PALETTE][3]);
+
+/*
+ * Find the VGA color (64 to 255) whose palette color is nearest to the
+ * 6:6:6 color rgb.  All 192 palette colors are candidates, including
+ * any left black by the quantizer.  Used to map colors that were not in
+ * the counts given to quantize_colors, such as those made by dithering.
+ */
+extern uint8_t quantize_nearest (const quant_lookup_t* l,
+				 const uint8_t rgb[3]);
+
+#endif /* QUANTIZE_H */
@@ -34,8 +34,10 @@
  */
  
 
+#include <pthread.h>
 #include <string.h>
 #include <strings.h>
+#include <time.h>
 
 #include "assert.h"
 #include "photo.h"
@@ -163,6 +165,55 @@ enum {
     NUM_FLAGS
 };
 
+/* 
+ * Environment variable that sets the number of threads used to load 
+ * photos and images in build_world (1 forces serial loading).  By 
+ * default, one thread per online processor is used.
+ */
+#define LOAD_THREADS_ENV "ADV_LOAD_THREADS"
+
+/*
+ * Environment variable that, when set, makes room photos load lazily on
+ * first use, keeping at most the given number of kilobytes of photo 
+ * pixel data in memory (0 for no limit).  See open_photo in photo.c.
+ */
+#define PHOTO_BUDGET_ENV "ADV_PHOTO_BUDGET_KB"
+
+/*
+ * Environment variable that, when set to 0, turns off background loading
+ * of the photos of rooms next to the player's room.  Prefetching only 
+ * matters when photos are loaded lazily (see PHOTO_BUDGET_ENV).
+ */
+#define PREFETCH_ENV "ADV_PREFETCH"
+
+/*
+ * Environment variable that, when set, keeps rooms composited with their
+ * objects, within the given number of kilobytes, so that lines of the
+ * screen are copied rather than drawn object by object.  See 
+ * set_room_layer_budget in photo.c.
+ */
+#define ROOM_LAYER_ENV "ADV_ROOM_LAYER_KB"
+
+/*
+ * Environment variable that, when set, makes build_world time the load
+ * of every room photo, object image, and swap photo and print a report
+ * to stderr, ending with the given number of slowest loads (default 
+ * PROFILE_SLOWEST if not a positive number).  Nothing is timed when it
+ * is not set.
+ */
+#define LOAD_PROFILE_ENV "ADV_LOAD_PROFILE"
+#define PROFILE_SLOWEST  5
+
+/*
+ * Each room indexes its objects by bands of rows and of columns, each 
+ * band 2^INDEX_BAND_BITS pixels wide (see index_room).  Positions past
+ * the last of the INDEX_BANDS bands fall into the last band.  The sets 
+ * of objects in a band are bit vectors in 32-bit words, so no more than
+ * 32 objects can be in one room.
+ */
+#define INDEX_BAND_BITS 3
+#define INDEX_BANDS     128
+
 /* identifiers for rooms with photo swapping */
 enum {
     SWAP_CIRCLE,	/* Boneyard Creek Bridge photo swap */
@@ -184,6 +235,15 @@ struct room_t {
     room_t*     left;   	/* room to the "left"             */
     room_t*     enter;  	/* doors, etc.                    */
     room_t*     right;  	/* room to the "right"            */
+
+    /* index of contents for drawing (see index_room) */
+    obj_draw_t  draw[N_OBJECTS];     /* objects in order of contents */
+    uint32_t    on_row[INDEX_BANDS]; /* objects by band of rows      */
+    uint32_t    on_col[INDEX_BANDS]; /* objects by band of columns   */
+
+    /* areas changed since last drawn (see mark_dirty) */
+    int32_t     n_dirty;                 /* rectangles in dirty   */
+    room_rect_t dirty[ROOM_DIRTY_RECTS]; /* areas to draw again   */
 };
 
 /*
@@ -422,16 +482,42 @@ static const swap_data_t swap_data[N_SWAPS] = {
 };
 
 
+/*
+ * One file to be loaded by build_world.  All loads are independent, so
+ * build_world describes them in an array of jobs, runs the jobs (in 
+ * parallel unless told otherwise), and then checks the results in the
+ * order of the data arrays above.
+ */
+typedef struct load_job_t load_job_t;
+struct load_job_t {
+    const char* filename;	/* file to be read (NULL to skip)       */
+    int32_t     is_photo;	/* 1 for a room photo, 0 for an object  */
+    photo_t*    photo;		/* photo read (if is_photo)             */
+    image_t*    image;		/* object image read (if !is_photo)     */
+    uint32_t    usec;		/* time to read file, if profiling      */
+};
+
+
 /* functions local to this file--see function headers for details */
 static void do_photo_swap (room_t* r, int32_t which);
 static object_t* find_in_room (const room_t* r, const char* arg);
+static void index_room (room_t* r);
 static void insert_object_at (object_t* o, room_t* r, int32_t x, int32_t y);
 static void insert_object (object_t* o, room_t* r);
+static void mark_dirty (room_t* r, const object_t* o);
 static void move_object_to_inventory (object_t* obj);
 static object_t* obj_special_get (room_t* r, const char* arg);
 static int32_t player_flag_is_set (int32_t fnum);
 static void player_set_flag (int32_t fnum);
 static void remove_object (object_t* o);
+static void report_load (const char* kind, const char* fname, 
+			 const load_job_t* job, int32_t shared, 
+			 uint64_t total[5]);
+static void report_load_profile (const load_job_t* jobs, 
+				 uint32_t wall_usec);
+static void run_load_jobs (load_job_t* jobs, int32_t n_jobs);
+static void* load_worker (void* ignore);
+static int32_t load_thread_count (int32_t n_jobs);
 
 
 /* file-scope variables */
@@ -444,6 +530,17 @@ static room_t   room[N_ROOMS];			     /* rooms                */
 static object_t object[N_OBJECTS];		     /* objects              */
 static uint32_t player_flags[(NUM_FLAGS + 31) / 32]; /* accomplishment flags */
 static photo_t* swap_photo[N_SWAPS];                 /* swapping photos      */
+static int32_t prefetch_on;                          /* prefetch neighbors?  */
+static int32_t load_profile;              /* slowest loads shown, 0 if off */
+
+/*
+ * Jobs being run by run_load_jobs.  Worker threads claim jobs in order
+ * by advancing next_load_job while holding load_lock.
+ */
+static load_job_t*     load_jobs;
+static int32_t         n_load_jobs;
+static int32_t         next_load_job;
+static pthread_mutex_t load_lock = PTHREAD_MUTEX_INITIALIZER;
 
 
 /* 
@@ -464,6 +561,9 @@ do_photo_swap (room_t* r, int32_t which)
     tmp               = r->view;
     r->view           = swap_photo[which];
     swap_photo[which] = tmp;
+
+    /* Bring in the new photo if it was loaded lazily and is not resident. */
+    photo_use (r->view);
 }
 
 
@@ -496,6 +596,117 @@ find_in_room (const room_t* r, const char* arg)
 }
 
 
+/* 
+ * index_room
+ *   DESCRIPTION: Rebuild the index of a room's objects used to draw them.
+ *                Each object's image, position, and opaque box go into 
+ *                the draw array in the order of the room's contents, 
+ *                which is the order in which they are drawn, and the bit
+ *                for the object is set in every band of rows and of 
+ *                columns that its box touches.  Objects with no opaque
+ *                pixels are in no band.  Rooms hold few objects and they
+ *                move rarely, so the index is rebuilt whenever an object
+ *                enters or leaves.
+ *   INPUTS: r -- the room
+ *   OUTPUTS: r -- draw, on_row, and on_col filled in
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: none
+ */
+static void
+index_room (room_t* r)
+{
+    object_t*   obj;	/* index over room contents          */
+    obj_draw_t* d;	/* entry for obj in draw array       */
+    int32_t     n;	/* index of obj in draw array        */
+    int32_t     band;	/* index over bands touched by obj   */
+    int32_t     last;	/* last band touched by obj          */
+
+    (void)memset (r->on_row, 0, sizeof (r->on_row));
+    (void)memset (r->on_col, 0, sizeof (r->on_col));
+    for (obj = r->contents, n = 0; NULL != obj; obj = obj->next, n++) {
+	ASSERT (32 > n);
+	d = &r->draw[n];
+	d->img = obj->img;
+	d->x = obj->x;
+	d->y = obj->y;
+	image_opaque_box (obj->img, &d->left, &d->right, &d->top, 
+			  &d->bottom);
+	if (d->left == d->right) {
+	    continue;
+	}
+	d->left += obj->x;
+	d->right += obj->x;
+	d->top += obj->y;
+	d->bottom += obj->y;
+	last = (d->bottom - 1) >> INDEX_BAND_BITS;
+	for (band = d->top >> INDEX_BAND_BITS; 
+	     INDEX_BANDS > band && last >= band; band++) {
+	    r->on_row[band] |= (1UL << n);
+	}
+	if (INDEX_BANDS <= last) {
+	    r->on_row[INDEX_BANDS - 1] |= (1UL << n);
+	}
+	last = (d->right - 1) >> INDEX_BAND_BITS;
+	for (band = d->left >> INDEX_BAND_BITS; 
+	     INDEX_BANDS > band && last >= band; band++) {
+	    r->on_col[band] |= (1UL << n);
+	}
+	if (INDEX_BANDS <= last) {
+	    r->on_col[INDEX_BANDS - 1] |= (1UL << n);
+	}
+    }
+}
+
+
+/* 
+ * mark_dirty
+ *   DESCRIPTION: Record that the opaque box of an object in a room must
+ *                be drawn again, because the object has entered or left
+ *                the room, and bring the box up to date in the room's 
+ *                composited layer, if any (see update_room_layer).  Once
+ *                ROOM_DIRTY_RECTS rectangles are recorded, further boxes
+ *                are merged into the last.
+ *   INPUTS: r -- the room, with its index up to date (see index_room)
+ *           o -- the object, at its position in the room
+ *   OUTPUTS: r -- box added to dirty
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: may composite part of the room's layer
+ */
+static void
+mark_dirty (room_t* r, const object_t* o)
+{
+    room_rect_t  box;	/* opaque box of o in room */
+    room_rect_t* last;	/* last rectangle recorded */
+
+    image_opaque_box (o->img, &box.left, &box.right, &box.top, &box.bottom);
+    if (box.left == box.right) {
+        return;
+    }
+    box.left += o->x;
+    box.right += o->x;
+    box.top += o->y;
+    box.bottom += o->y;
+    update_room_layer (r, box.left, box.right, box.top, box.bottom);
+    if (ROOM_DIRTY_RECTS > r->n_dirty) {
+        r->dirty[r->n_dirty++] = box;
+	return;
+    }
+    last = &r->dirty[ROOM_DIRTY_RECTS - 1];
+    if (last->left > box.left) {
+        last->left = box.left;
+    }
+    if (last->right < box.right) {
+        last->right = box.right;
+    }
+    if (last->top > box.top) {
+        last->top = box.top;
+    }
+    if (last->bottom < box.bottom) {
+        last->bottom = box.bottom;
+    }
+}
+
+
 /* 
  * insert_object_at
  *   DESCRIPTION: Place an object at a specific (x,y) location in a room.
@@ -523,6 +734,8 @@ insert_object_at (object_t* o, room_t* r, int32_t x, int32_t y)
     o->loc = r;
     o->next = r->contents;
     r->contents = o;
+    index_room (r);
+    mark_dirty (r, o);
 }
 
 
@@ -706,6 +919,10 @@ remove_object (object_t* o)
 		break;
 	    }
 	}
+	index_room (o->loc);
+
+	/* Its box in the room must be drawn again without it. */
+	mark_dirty (o->loc, o);
 
 	/* Mark the object's location as NULL. */
 	o->loc = NULL;
@@ -791,6 +1008,69 @@ room_contents_iterate (const room_t* r)
 }
 
 
+/* 
+ * room_objects
+ *   DESCRIPTION: Get the objects in a room as they are drawn, in drawing
+ *                order.  Use with room_objects_on_row and 
+ *                room_objects_on_col to find those covering a line.
+ *   INPUTS: r -- pointer to the room
+ *   OUTPUTS: none
+ *   RETURN VALUE: the draw array of room r (see index_room)
+ *   SIDE EFFECTS: none
+ */
+const obj_draw_t*
+room_objects (const room_t* r)
+{
+    return r->draw;
+}
+
+
+/* 
+ * room_objects_on_col
+ *   DESCRIPTION: Get the set of objects in a room whose opaque boxes may
+ *                cover a column of the room photo.  Every object that 
+ *                does is in the set, but so may be some that do not.
+ *   INPUTS: r -- pointer to the room
+ *           x -- the column
+ *   OUTPUTS: none
+ *   RETURN VALUE: a bit vector with bit i set if the ith object given by
+ *                 room_objects may cover column x
+ *   SIDE EFFECTS: none
+ */
+uint32_t
+room_objects_on_col (const room_t* r, int32_t x)
+{
+    if (0 > x) {
+        return 0;
+    }
+    x >>= INDEX_BAND_BITS;
+    return r->on_col[INDEX_BANDS > x ? x : INDEX_BANDS - 1];
+}
+
+
+/* 
+ * room_objects_on_row
+ *   DESCRIPTION: Get the set of objects in a room whose opaque boxes may
+ *                cover a row of the room photo.  Every object that 
+ *                does is in the set, but so may be some that do not.
+ *   INPUTS: r -- pointer to the room
+ *           y -- the row
+ *   OUTPUTS: none
+ *   RETURN VALUE: a bit vector with bit i set if the ith object given by
+ *                 room_objects may cover row y
+ *   SIDE EFFECTS: none
+ */
+uint32_t
+room_objects_on_row (const room_t* r, int32_t y)
+{
+    if (0 > y) {
+        return 0;
+    }
+    y >>= INDEX_BAND_BITS;
+    return r->on_row[INDEX_BANDS > y ? y : INDEX_BANDS - 1];
+}
+
+
 /* 
  * room_name
  *   DESCRIPTION: Get name for a room.
@@ -808,7 +1088,10 @@ room_name (const room_t* r)
 
 /* 
  * room_photo
- *   DESCRIPTION: Get room photo for a room.
+ *   DESCRIPTION: Get room photo for a room.  The pixel data of a lazily
+ *                loaded photo are brought into memory by prep_room (see
+ *                photo_use), and stay there while the room is on the 
+ *                screen, so drawing the room needs no further checks.
  *   INPUTS: r -- pointer to the room
  *   OUTPUTS: none
  *   RETURN VALUE: a pointer to room r's photo
@@ -821,9 +1104,63 @@ room_photo (const room_t* r)
 }
 
 
+/* 
+ * prefetch_neighbors
+ *   DESCRIPTION: Start loading, in the background, the photos that the
+ *                player may see next from a room: those of the rooms to
+ *                the left, to the right, and ahead, followed by those of
+ *                the rooms reached with the "go" command and the photos
+ *                swapped in when entering the Boneyard Creek Bridge or
+ *                fixing the car.  Any photos still waiting from the 
+ *                previous room are dropped.  Does nothing unless photos
+ *                are loaded lazily and PREFETCH_ENV is not 0.
+ *   INPUTS: r -- the player's room
+ *   OUTPUTS: none
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: may start loading photos (see photo_prefetch)
+ */
+void
+prefetch_neighbors (const room_t* r)
+{
+    static const int32_t go_room[3] = {R_CAR_SITE, R_ALLERTON, R_WILLARD};
+    room_t*  next[6];	/* rooms reachable from r, most likely first */
+    photo_t* list[12];	/* photos to be loaded                       */
+    int32_t  n = 0;	/* number of rooms in next                   */
+    int32_t  n_list = 0;/* number of photos in list                  */
+    int32_t  idx;	/* index over rooms                          */
+
+    if (!prefetch_on) {
+        return;
+    }
+    next[n++] = r->left;
+    next[n++] = r->right;
+    next[n++] = r->enter;
+    for (idx = 0; 3 > idx; idx++) {
+	if (&room[go_room[idx]] == r) {
+	    next[n++] = &room[go_room[(idx + 1) % 3]];
+	    next[n++] = &room[go_room[(idx + 2) % 3]];
+	}
+    }
+    for (idx = 0; n > idx; idx++) {
+	if (NULL != next[idx] && r != next[idx]) {
+	    list[n_list++] = next[idx]->view;
+	    if (&room[R_CIRCLE_N] == next[idx]) {
+	        list[n_list++] = swap_photo[SWAP_CIRCLE];
+	    }
+	}
+    }
+    if (&room[R_CAR_SITE] == r) {
+        list[n_list++] = swap_photo[SWAP_CAR];
+    }
+    photo_prefetch (list, n_list);
+}
+
+
 /* 
  * room_photo_height
- *   DESCRIPTION: Get height of room photo in pixels for a room.
+ *   DESCRIPTION: Get height of room photo in pixels for a room.  The 
+ *                header of a lazily loaded photo is always in memory, so
+ *                the photo itself need not be loaded.
  *   INPUTS: r -- pointer to the room
  *   OUTPUTS: none
  *   RETURN VALUE: height of room r's photo in pixels
@@ -838,7 +1175,9 @@ room_photo_height (const room_t* r)
 
 /* 
  * room_photo_width
- *   DESCRIPTION: Get width of room photo in pixels for a room.
+ *   DESCRIPTION: Get width of room photo in pixels for a room.  The 
+ *                header of a lazily loaded photo is always in memory, so
+ *                the photo itself need not be loaded.
  *   INPUTS: r -- pointer to the room
  *   OUTPUTS: none
  *   RETURN VALUE: width of room r's photo in pixels
@@ -851,11 +1190,315 @@ room_photo_width (const room_t* r)
 }
 
 
+/* 
+ * room_take_dirty
+ *   DESCRIPTION: Get the areas of a room that objects have entered or
+ *                left since the last call, and forget them.  Drawing 
+ *                just these areas of a room already on the screen 
+ *                brings it up to date; after drawing the whole room, 
+ *                the areas should be taken and ignored.
+ *   INPUTS: r -- pointer to the room
+ *   OUTPUTS: rect -- the areas, as rectangles of the room photo, which
+ *                    may overlap
+ *   RETURN VALUE: the number of rectangles in rect
+ *   SIDE EFFECTS: none
+ */
+int32_t
+room_take_dirty (room_t* r, room_rect_t rect[ROOM_DIRTY_RECTS])
+{
+    int32_t n = r->n_dirty;	/* number of rectangles */
+
+    (void)memcpy (rect, r->dirty, n * sizeof (rect[0]));
+    r->n_dirty = 0;
+    return n;
+}
+
+
+/* 
+ * load_worker
+ *   DESCRIPTION: Run load jobs until none remain.  Executed by each
+ *                thread started by run_load_jobs (and by the calling
+ *                thread itself).
+ *   INPUTS: none (ignored)
+ *   OUTPUTS: none
+ *   RETURN VALUE: NULL
+ *   SIDE EFFECTS: fills in the results of the jobs claimed
+ */
+static void*
+load_worker (void* ignore)
+{
+    load_job_t*     job;	/* job claimed            */
+    struct timespec start;	/* time job started       */
+    struct timespec end;	/* time job finished      */
+
+    while (1) {
+	/* Claim the next job, if any. */
+	(void)pthread_mutex_lock (&load_lock);
+	job = (n_load_jobs > next_load_job ? 
+	       &load_jobs[next_load_job++] : NULL);
+	(void)pthread_mutex_unlock (&load_lock);
+	if (NULL == job) {
+	    return NULL;
+	}
+
+	/* Jobs write only their own results, so no lock is needed. */
+	if (NULL == job->filename) {
+	    continue;
+	}
+	if (0 != load_profile) {
+	    (void)clock_gettime (CLOCK_MONOTONIC, &start);
+	}
+	if (job->is_photo) {
+	    job->photo = read_photo (job->filename);
+	} else {
+	    job->image = read_obj_image (job->filename);
+	}
+	if (0 != load_profile) {
+	    (void)clock_gettime (CLOCK_MONOTONIC, &end);
+	    job->usec = (end.tv_sec - start.tv_sec) * 1000000 +
+			(end.tv_nsec - start.tv_nsec) / 1000;
+	}
+    }
+}
+
+
+/* 
+ * load_thread_count
+ *   DESCRIPTION: Decide how many threads to use for loading.  The 
+ *                LOAD_THREADS_ENV environment variable overrides the 
+ *                default of one thread per online processor.
+ *   INPUTS: n_jobs -- number of jobs to be run
+ *   OUTPUTS: none
+ *   RETURN VALUE: number of threads (at least 1, at most n_jobs)
+ *   SIDE EFFECTS: none
+ */
+static int32_t
+load_thread_count (int32_t n_jobs)
+{
+    const char* env;	/* value of LOAD_THREADS_ENV */
+    long        n;	/* number of threads         */
+
+    if (NULL != (env = getenv (LOAD_THREADS_ENV))) {
+        n = strtol (env, NULL, 10);
+    } else {
+	n = sysconf (_SC_NPROCESSORS_ONLN);
+    }
+    if (1 > n) {
+        n = 1;
+    }
+    return (n_jobs < n ? n_jobs : n);
+}
+
+
+/* 
+ * run_load_jobs
+ *   DESCRIPTION: Run an array of load jobs on a pool of threads sized 
+ *                by load_thread_count.  The calling thread joins in, so
+ *                a pool of one thread loads serially with no threads 
+ *                created at all.  If threads cannot be created, the 
+ *                remaining threads simply take on more of the jobs.
+ *                While a pool of several threads runs, each photo is 
+ *                quantized by one thread (see set_photo_quant_threads),
+ *                since the pool already keeps the processors busy.
+ *   INPUTS: jobs -- the jobs to run
+ *           n_jobs -- number of jobs in the array
+ *   OUTPUTS: jobs -- results filled in (NULL for files that failed)
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: creates and joins threads
+ */
+static void
+run_load_jobs (load_job_t* jobs, int32_t n_jobs)
+{
+    pthread_t tid[64];	/* ids of threads created           */
+    int32_t   n_tid;	/* number of threads to create      */
+    int32_t   made;	/* number of threads created        */
+    int32_t   i;	/* loop index over threads          */
+
+    load_jobs = jobs;
+    n_load_jobs = n_jobs;
+    next_load_job = 0;
+
+    n_tid = load_thread_count (n_jobs) - 1;
+    if ((int32_t)(sizeof (tid) / sizeof (tid[0])) < n_tid) {
+	n_tid = sizeof (tid) / sizeof (tid[0]);
+    }
+    if (0 < n_tid) {
+	set_photo_quant_threads (1);
+    }
+    for (made = 0; n_tid > made; made++) {
+        if (0 != pthread_create (&tid[made], NULL, load_worker, NULL)) {
+	    break;
+	}
+    }
+    (void)load_worker (NULL);
+    for (i = 0; made > i; i++) {
+        (void)pthread_join (tid[i], NULL);
+    }
+    set_photo_quant_threads (0);
+}
+
+
+/* 
+ * report_load
+ *   DESCRIPTION: Print one line of the load profile (see 
+ *                report_load_profile) and add it to the totals.  Decode
+ *                time is the time taken to load the file less the time
+ *                spent quantizing and remapping, so it includes reading
+ *                the file, using the on-disk cache, and packing pixels.
+ *   INPUTS: kind -- "room", "object", or "swap"
+ *           fname -- file name
+ *           job -- the job that loaded the file (or, for a photo opened
+ *                  lazily or an image read by an earlier job, that holds
+ *                  the photo or image)
+ *           shared -- 1 if the image is shared with an earlier object,
+ *                     so that its pixels are not counted again
+ *           total -- bytes read, decode, quantize, and remap times, and
+ *                    resident bytes so far
+ *   OUTPUTS: total -- this file added
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: prints to stderr
+ */
+static void
+report_load (const char* kind, const char* fname, const load_job_t* job,
+	     int32_t shared, uint64_t total[5])
+{
+    photo_load_stats_t  ls;	/* what loading the photo read    */
+    photo_quant_stats_t qs;	/* costs of quantizing the photo  */
+    char                palette[16]; /* palette slots used        */
+    size_t              bytes;	/* bytes read from file           */
+    size_t              resident; /* bytes of pixel data held     */
+    uint32_t            quant = 0; /* quantizing time             */
+    uint32_t            remap = 0; /* remapping time              */
+    uint32_t            decode;	/* rest of load time              */
+    int32_t             cached = 0; /* 1 if from on-disk cache    */
+
+    (void)strcpy (palette, "-");
+    if (job->is_photo) {
+	if (0 != get_photo_load_stats (job->photo, &ls)) {
+	    fprintf (stderr, "%-6s %10s %9s %9s %9s %10s %7s  %s "
+		     "(not loaded)\n", kind, "-", "-", "-", "-", "-", "-",
+		     fname);
+	    return;
+	}
+	if (0 == get_photo_quant_stats (job->photo, &qs)) {
+	    quant = qs.hist_usec + qs.select_usec;
+	    remap = qs.remap_usec;
+	}
+	if (0 <= ls.slots_used) {
+	    (void)snprintf (palette, sizeof (palette), "%d/%d", 
+			    ls.slots_used, ls.slots);
+	}
+	bytes = ls.bytes_read;
+	resident = photo_resident_bytes (job->photo);
+	cached = ls.cached;
+    } else {
+	resident = image_width (job->image) * image_height (job->image);
+	bytes = (NULL == job->filename ? 0 : 
+		 sizeof (photo_header_t) + resident);
+	if (shared) {
+	    resident = 0;
+	}
+    }
+    decode = (job->usec > quant + remap ? job->usec - quant - remap : 0);
+
+    fprintf (stderr, "%-6s %10zu %9.3f %9.3f %9.3f %10zu %7s  %s%s\n",
+	     kind, bytes, decode / 1e3, quant / 1e3, remap / 1e3, resident,
+	     palette, fname, (cached ? " (cache)" : 
+	     		      (shared ? " (shared)" : "")));
+    total[0] += bytes;
+    total[1] += decode;
+    total[2] += quant;
+    total[3] += remap;
+    total[4] += resident;
+}
+
+
+/* 
+ * report_load_profile
+ *   DESCRIPTION: Print the load profile asked for by LOAD_PROFILE_ENV to
+ *                stderr: one line for each room photo, object image, and
+ *                swap photo, then the totals, then the slowest loads.
+ *                Times are in milliseconds.  With several loading 
+ *                threads, the times of each load overlap those of 
+ *                others, so their total exceeds the elapsed time.
+ *   INPUTS: jobs -- the jobs run by build_world, in its order
+ *           wall_usec -- elapsed time of run_load_jobs
+ *   OUTPUTS: none
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: prints to stderr
+ */
+static void
+report_load_profile (const load_job_t* jobs, uint32_t wall_usec)
+{
+    const int32_t n_jobs = N_ROOMS + N_OBJECTS + N_SWAPS; /* jobs  */
+    const char*   name[N_ROOMS + N_OBJECTS + N_SWAPS]; /* file names */
+    int32_t       order[N_ROOMS + N_OBJECTS + N_SWAPS]; /* slowest */
+    uint64_t      total[5] = {0, 0, 0, 0, 0}; /* see report_load */
+    int32_t       n_order = 0; /* number of files loaded         */
+    int32_t       idx;		/* index over jobs                */
+    int32_t       idx2;		/* index over earlier objects     */
+    int32_t       pos;		/* position in order              */
+
+    fprintf (stderr, "%-6s %10s %9s %9s %9s %10s %7s  %s\n", "asset",
+	     "read", "decode_ms", "quant_ms", "remap_ms", "resident",
+	     "palette", "file");
+    for (idx = 0; N_ROOMS > idx; idx++) {
+	name[idx] = room_data[idx].filename;
+	report_load ("room", name[idx], &jobs[idx], 0, total);
+    }
+    for (idx = 0; N_OBJECTS > idx; idx++) {
+	name[N_ROOMS + idx] = obj_data[idx].filename;
+	for (idx2 = 0; idx > idx2 && 
+	     jobs[N_ROOMS + idx2].image != jobs[N_ROOMS + idx].image; idx2++) {
+	}
+	report_load ("object", name[N_ROOMS + idx], &jobs[N_ROOMS + idx], 
+		     idx > idx2, total);
+    }
+    for (idx = 0; N_SWAPS > idx; idx++) {
+	name[N_ROOMS + N_OBJECTS + idx] = swap_data[idx].filename;
+	report_load ("swap", name[N_ROOMS + N_OBJECTS + idx], 
+		     &jobs[N_ROOMS + N_OBJECTS + idx], 0, total);
+    }
+    fprintf (stderr, "%-6s %10llu %9.3f %9.3f %9.3f %10llu\n", "total",
+	     (unsigned long long)total[0], total[1] / 1e3, total[2] / 1e3,
+	     total[3] / 1e3, (unsigned long long)total[4]);
+    fprintf (stderr, "loaded in %.3f ms\n", wall_usec / 1e3);
+
+    /* Sort the files loaded by time taken, slowest first. */
+    for (idx = 0; n_jobs > idx; idx++) {
+	if (NULL == jobs[idx].filename) {
+	    continue;
+	}
+	for (pos = n_order++; 0 < pos && 
+	     jobs[order[pos - 1]].usec < jobs[idx].usec; pos--) {
+	    order[pos] = order[pos - 1];
+	}
+	order[pos] = idx;
+    }
+    for (pos = 0; n_order > pos && load_profile > pos; pos++) {
+	fprintf (stderr, "slowest %d: %9.3f ms  %s\n", pos + 1, 
+		 jobs[order[pos]].usec / 1e3, name[order[pos]]);
+    }
+}
+
+
 /* 
  * build_world
  *   DESCRIPTION: Builds and connects the rooms, creates objects, and 
- *                reads in all image data (could be done lazily with 
- *                caching instead).
+ *                reads in all image data.  If PHOTO_BUDGET_ENV is set,
+ *                room and swap photos are instead opened for loading on
+ *                first use, within the given memory budget, and the
+ *                photos of nearby rooms are loaded in the background 
+ *                unless PREFETCH_ENV is 0 (see prefetch_neighbors).  All
+ *                room data, object data, and swap data are checked for
+ *                bad or duplicate ids before any files are read; the 
+ *                files are then read in parallel (see run_load_jobs),
+ *                and failures are reported in data
+ *                array order, so the outcome does not depend on thread
+ *                timing.  Object image files named more than once are 
+ *                read once, and images with the same contents are held
+ *                once.  Objects are placed only after all loads 
+ *                finish, in the same order as with serial loading.
  *   INPUTS: none
  *   OUTPUTS: none
  *   RETURN VALUE: 1 on success, or 0 on failure
@@ -864,8 +1507,37 @@ room_photo_width (const room_t* r)
 int32_t
 build_world ()
 {
-    int32_t idx;	/* index over data arrays   */
-    int32_t which;	/* id for current data item */
+    static load_job_t job[N_ROOMS + N_OBJECTS + N_SWAPS]; /* file loads */
+    load_job_t* room_job = &job[0];		      /* room photos   */
+    load_job_t* obj_job = &job[N_ROOMS];	      /* object images */
+    load_job_t* swap_job = &job[N_ROOMS + N_OBJECTS]; /* swap photos   */
+    int32_t idx;	/* index over data arrays       */
+    int32_t idx2;	/* index over earlier data      */
+    int32_t which;	/* id for current data item     */
+    const char* budget;	/* value of PHOTO_BUDGET_ENV    */
+    const char* prefetch; /* value of PREFETCH_ENV      */
+    const char* layer_kb; /* value of ROOM_LAYER_ENV    */
+    const char* profile; /* value of LOAD_PROFILE_ENV   */
+    struct timespec start; /* time loads started        */
+    struct timespec end; /* time loads finished          */
+
+    /* Lazily loaded photos are opened below rather than read by jobs. */
+    if (NULL != (budget = getenv (PHOTO_BUDGET_ENV))) {
+        set_photo_budget ((size_t)strtoul (budget, NULL, 10) * 1024);
+    }
+    if (NULL != (layer_kb = getenv (ROOM_LAYER_ENV))) {
+        set_room_layer_budget ((size_t)strtoul (layer_kb, NULL, 10) * 1024);
+    }
+    prefetch_on = (NULL != budget && 
+		   (NULL == (prefetch = getenv (PREFETCH_ENV)) || 
+		    0 != strcmp (prefetch, "0")));
+    load_profile = 0;
+    if (NULL != (profile = getenv (LOAD_PROFILE_ENV))) {
+	if (0 >= (load_profile = strtol (profile, NULL, 10))) {
+	    load_profile = PROFILE_SLOWEST;
+	}
+	set_photo_load_stats (1);
+    }
 
     /* Clear all accomplishment flags. */
     (void)memset (player_flags, 0, sizeof (player_flags));
@@ -891,12 +1563,6 @@ build_world ()
 
 	/* Set up the room. */
         room[which].name = room_data[idx].name;
-	room[which].view = read_photo (room_data[idx].filename);
-	if (NULL == room[which].view) {
-	    fprintf (stderr, "Can't read room photo %s.\n", 
-	    	     room_data[idx].filename);
-	    return 0;
-	}
 	room[which].contents = NULL;
 	room[which].left  = (R_NONE == room_data[idx].left ? NULL : 
 			     &room[room_data[idx].left]);
@@ -904,6 +1570,9 @@ build_world ()
 			     &room[room_data[idx].enter]);
 	room[which].right = (R_NONE == room_data[idx].right ? NULL : 
 			     &room[room_data[idx].right]);
+	room_job[idx].filename = (NULL == budget ? room_data[idx].filename :
+				  NULL);
+	room_job[idx].is_photo = 1;
     }
 
     /* Clear object data to enable sanity check for duplication. */
@@ -927,24 +1596,19 @@ build_world ()
 
 	/* Set up the object. */
         object[which].name = obj_data[idx].name;
-	object[which].img = read_obj_image (obj_data[idx].filename);
-	if (NULL == object[which].img) {
-	    fprintf (stderr, "Can't read object photo %s.\n", 
-	    	     obj_data[idx].filename);
-	    return 0;
-	}
         object[which].next = NULL;
         object[which].loc = NULL;
         object[which].x = 0;
         object[which].y = 0;
 
-	/* Insert it into a room if necessary. */
-	if (R_NONE != obj_data[idx].room) {
-	    if (-1 != obj_data[idx].x) {
-	        insert_object_at (&object[which], &room[obj_data[idx].room],
-				  obj_data[idx].x, obj_data[idx].y);
-	    } else {
-	        insert_object (&object[which], &room[obj_data[idx].room]);
+	/* Read each image file only once; objects share the image. */
+	obj_job[idx].filename = obj_data[idx].filename;
+	obj_job[idx].is_photo = 0;
+	for (idx2 = 0; idx > idx2; idx2++) {
+	    if (0 == strcmp (obj_data[idx2].filename, 
+	    		     obj_data[idx].filename)) {
+		obj_job[idx].filename = NULL;
+		break;
 	    }
 	}
     }
@@ -963,20 +1627,90 @@ build_world ()
 	    fputs ("Bad index in swap data.\n", stderr);
 	    return 0;
 	}
-	if (NULL != swap_photo[which]) {
-	    fprintf (stderr, "Duplicate index %d in swap data.\n", which);
+	for (idx2 = 0; idx > idx2; idx2++) {
+	    if (which == swap_data[idx2].id) {
+		fprintf (stderr, "Duplicate index %d in swap data.\n", which);
+		return 0;
+	    }
+	}
+	swap_job[idx].filename = (NULL == budget ? swap_data[idx].filename :
+				  NULL);
+	swap_job[idx].is_photo = 1;
+    }
+
+    /* Read all of the files. */
+    if (0 != load_profile) {
+	(void)clock_gettime (CLOCK_MONOTONIC, &start);
+    }
+    run_load_jobs (job, sizeof (job) / sizeof (job[0]));
+    if (0 != load_profile) {
+	(void)clock_gettime (CLOCK_MONOTONIC, &end);
+    }
+
+    /* Install (or open) the room photos. */
+    for (idx = 0; N_ROOMS > idx; idx++) {
+	if (NULL != budget) {
+	    room_job[idx].photo = open_photo (room_data[idx].filename);
+	}
+	room[room_data[idx].id].view = room_job[idx].photo;
+	if (NULL == room_job[idx].photo) {
+	    fprintf (stderr, "Can't read room photo %s.\n", 
+	    	     room_data[idx].filename);
+	    return 0;
+	}
+    }
+
+    /* 
+     * Install the object images and place the objects.  Images with the
+     * same contents as earlier ones, whether read from the same file or
+     * not, are shared (see share_obj_image).
+     */
+    for (idx = 0; N_OBJECTS > idx; idx++) {
+	which = obj_data[idx].id;
+	if (NULL == obj_job[idx].filename) {
+	    for (idx2 = 0; 0 != strcmp (obj_data[idx2].filename, 
+	    				obj_data[idx].filename); idx2++) {
+	    }
+	    obj_job[idx].image = obj_job[idx2].image;
+	} else if (NULL != obj_job[idx].image) {
+	    obj_job[idx].image = share_obj_image (obj_job[idx].image);
+	}
+	object[which].img = obj_job[idx].image;
+	if (NULL == object[which].img) {
+	    fprintf (stderr, "Can't read object photo %s.\n", 
+	    	     obj_data[idx].filename);
 	    return 0;
 	}
 
-	/* Read in the swap photo. */
-	swap_photo[which] = read_photo (swap_data[idx].filename);
-	if (NULL == swap_photo[which]) {
+	/* Insert it into a room if necessary. */
+	if (R_NONE != obj_data[idx].room) {
+	    if (-1 != obj_data[idx].x) {
+	        insert_object_at (&object[which], &room[obj_data[idx].room],
+				  obj_data[idx].x, obj_data[idx].y);
+	    } else {
+	        insert_object (&object[which], &room[obj_data[idx].room]);
+	    }
+	}
+    }
+
+    /* Install (or open) the swap photos. */
+    for (idx = 0; N_SWAPS > idx; idx++) {
+	if (NULL != budget) {
+	    swap_job[idx].photo = open_photo (swap_data[idx].filename);
+	}
+	swap_photo[swap_data[idx].id] = swap_job[idx].photo;
+	if (NULL == swap_job[idx].photo) {
 	    fprintf (stderr, "Can't read room photo %s.\n", 
 	    	     swap_data[idx].filename);
 	    return 0;
 	}
     }
 
+    if (0 != load_profile) {
+	report_load_profile (job, (end.tv_sec - start.tv_sec) * 1000000 +
+			     (end.tv_nsec - start.tv_nsec) / 1000);
+    }
+
     /* Everything worked! */
     return 1;
 }
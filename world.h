@@ -39,16 +39,54 @@
 #include "types.h"
 
 
+/* 
+ * An object as drawn over a room photo: its image, the position of the
+ * image, and the box holding the image's opaque pixels, all in room 
+ * photo coordinates.  room_objects gives the objects in a room in the
+ * order in which they are drawn; room_objects_on_row and 
+ * room_objects_on_col give the set of those whose boxes may cover a 
+ * row or column (bit i for the ith object), so that lines can be drawn
+ * without looking at the rest.
+ */
+typedef struct obj_draw_t obj_draw_t;
+struct obj_draw_t {
+    const image_t* img;		/* object image                    */
+    int32_t        x, y;	/* position of image in room photo */
+    int32_t        left, right;	/* columns of opaque box, [l,r)    */
+    int32_t        top, bottom;	/* rows of opaque box, [t,b)       */
+};
+
+/* 
+ * A rectangle of a room photo.  Each room keeps the areas uncovered or
+ * covered by objects entering and leaving it since it was last drawn,
+ * as up to ROOM_DIRTY_RECTS rectangles (more are merged), so that only
+ * those areas need be drawn again (see room_take_dirty).
+ */
+#define ROOM_DIRTY_RECTS 4
+typedef struct room_rect_t room_rect_t;
+struct room_rect_t {
+    int32_t left, right;	/* columns of rectangle, [l,r) */
+    int32_t top, bottom;	/* rows of rectangle, [t,b)    */
+};
+
 /* structure access functions */
 extern uint16_t obj_get_x (const object_t* obj);
 extern uint16_t obj_get_y (const object_t* obj);
 extern image_t* obj_image (const object_t* obj);
 extern object_t* obj_next (const object_t* obj);
 extern object_t* room_contents_iterate (const room_t* r);
+extern const obj_draw_t* room_objects (const room_t* r);
+extern uint32_t room_objects_on_col (const room_t* r, int32_t x);
+extern uint32_t room_objects_on_row (const room_t* r, int32_t y);
 extern const char* room_name (const room_t* r);
 extern photo_t* room_photo (const room_t* r);
 extern uint32_t room_photo_height (const room_t* r);
 extern uint32_t room_photo_width (const room_t* r);
+extern int32_t room_take_dirty (room_t* r, 
+				room_rect_t rect[ROOM_DIRTY_RECTS]);
+
+/* Start loading the photos of rooms next to r in the background. */
+extern void prefetch_neighbors (const room_t* r);
 
 /* Build the game world.  Returns 0 on failure, or 1 on success. */
 extern int32_t build_world (void);